@@ -7,6 +7,9 @@
 #include "version.h"
 #include "os.h"
 
+#if defined(_M_IX86)
+#include <intrin.h>
+#endif
 
 namespace Compatible
 {
@@ -21,6 +24,53 @@ namespace Compatible
 #endif
    }
 
+   unsigned long long GetMicroseconds()
+   {
+#ifdef WIN32
+      LARGE_INTEGER frequency;
+      LARGE_INTEGER counter;
+      if (!QueryPerformanceFrequency(&frequency) || !QueryPerformanceCounter(&counter))
+      {
+         return static_cast<unsigned long long>(timeGetTime()) * 1000;
+      }
+
+      // Split the division up so the multiply can't overflow
+      const unsigned long long seconds = counter.QuadPart / frequency.QuadPart;
+      const unsigned long long remainder = counter.QuadPart % frequency.QuadPart;
+      return (seconds * 1000000) + (remainder * 1000000 / frequency.QuadPart);
+#else
+      timeval tv;
+      gettimeofday(&tv, 0);
+      return (static_cast<unsigned long long>(tv.tv_sec) * 1000000) + tv.tv_usec;
+#endif
+   }
+
+   int GetProcessorCount()
+   {
+#ifdef WIN32
+      SYSTEM_INFO info;
+      GetSystemInfo(&info);
+      const int count = static_cast<int>(info.dwNumberOfProcessors);
+#else
+      const int count = static_cast<int>(MPProcessorsScheduled());
+#endif
+
+      return (count < 1 ? 1 : count);
+   }
+
+   bool HasSse2()
+   {
+#if defined(_M_X64) || defined(__SSE2__)
+      return true;
+#elif defined(_M_IX86)
+      int info[4];
+      __cpuid(info, 1);
+      return (info[3] & (1 << 26)) != 0;
+#else
+      return false;
+#endif
+   }
+
 
    void ShowError(const std::wstring &err)
    {
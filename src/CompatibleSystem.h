@@ -12,6 +12,17 @@ namespace Compatible
    // Some monotonically increasing value tied to the system
    // clock (but not necessarily based on app-start)
    unsigned long GetMilliseconds();
+
+   // Same as above, but with (ideally) sub-millisecond resolution.
+   // This is meant for profiling, not for game timing.
+   unsigned long long GetMicroseconds();
+
+   // How many processors the OS will schedule our threads on (at least 1)
+   int GetProcessorCount();
+
+   // SSE2 is always there on x64 and Intel Macs, but has to be checked
+   // for on 32-bit Windows.  PowerPC Macs never have it.
+   bool HasSse2();
    
    // Shows an error box with an OK button
    void ShowError(const std::wstring &err);
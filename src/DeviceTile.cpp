@@ -56,6 +56,24 @@ void DeviceTile::Update(const MouseInfo &translated_mouse)
 
 }
 
+void DeviceTile::SetDeviceList(const MidiCommDescriptionList &device_list)
+{
+   std::wstring chosen_name;
+   if (m_device_id >= 0 && m_device_id < static_cast<int>(m_device_list.size())) chosen_name = m_device_list[m_device_id].name;
+
+   m_device_list = device_list;
+   m_device_id = -1;
+
+   if (chosen_name.empty()) return;
+   for (size_t i = 0; i < m_device_list.size(); ++i)
+   {
+      if (m_device_list[i].name != chosen_name) continue;
+
+      m_device_id = static_cast<int>(m_device_list[i].id);
+      break;
+   }
+}
+
 int DeviceTile::LookupGraphic(TrackTileGraphic graphic, bool button_hovering) const
 {
    // There are three sets of graphics
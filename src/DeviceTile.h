@@ -45,6 +45,11 @@ public:
 
    int GetDeviceId() const { return m_device_id; }
 
+   // Replaces the list of devices to choose from (say, after one is
+   // plugged in).  The chosen device stays chosen (by name) if it's
+   // still there.  Otherwise the tile switches to "off".
+   void SetDeviceList(const MidiCommDescriptionList &device_list);
+
    const ButtonState WholeTile() const { return whole_tile; }
    const ButtonState ButtonPreview() const { return button_preview; }
    const ButtonState ButtonLeft() const { return button_mode_left; }
@@ -59,7 +64,7 @@ private:
    bool m_preview_on;
    int m_device_id;
 
-   const MidiCommDescriptionList m_device_list;
+   MidiCommDescriptionList m_device_list;
 
    DeviceTileType m_tile_type;
 
@@ -0,0 +1,129 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "FrameTiming.h"
+#include "RollingHistogram.h"
+#include "string_util.h"
+
+#include <fstream>
+using namespace std;
+
+namespace FrameTiming
+{
+   // About 8 seconds at 60 FPS
+   const static size_t SamplesKept = 512;
+
+   // Power-of-two buckets up through ~1 second
+   const static size_t ExportBucketCount = 21;
+
+   static RollingHistogram g_phases[FrameTimingPhaseCount] =
+   {
+      RollingHistogram(SamplesKept),
+      RollingHistogram(SamplesKept),
+      RollingHistogram(SamplesKept),
+      RollingHistogram(SamplesKept)
+   };
+
+   static unsigned long g_over_budget(0);
+
+   void Record(FrameTimingPhase phase, unsigned long long microseconds)
+   {
+      if (phase >= FrameTimingPhaseCount) return;
+      g_phases[phase].Add(microseconds);
+
+      if (phase == FrameTimingFrame && microseconds > OverBudgetMicroseconds) g_over_budget++;
+   }
+
+   void Clear()
+   {
+      for (int i = 0; i < FrameTimingPhaseCount; ++i) g_phases[i].Clear();
+      g_over_budget = 0;
+   }
+
+   wstring PhaseName(FrameTimingPhase phase)
+   {
+      switch (phase)
+      {
+      case FrameTimingUpdate: return L"Update";
+      case FrameTimingDraw:   return L"Draw";
+      case FrameTimingSwap:   return L"Swap";
+      case FrameTimingFrame:  return L"Frame";
+      default:                return L"Unknown";
+      }
+   }
+
+   size_t SampleCount(FrameTimingPhase phase)
+   {
+      if (phase >= FrameTimingPhaseCount) return 0;
+      return g_phases[phase].Count();
+   }
+
+   void Percentiles(FrameTimingPhase phase, unsigned long long *p50, unsigned long long *p99, unsigned long long *max)
+   {
+      const static double fractions[2] = { 0.50, 0.99 };
+      unsigned long long results[2] = { 0, 0 };
+
+      *max = 0;
+      if (phase < FrameTimingPhaseCount)
+      {
+         g_phases[phase].Percentiles(fractions, results, 2);
+         *max = g_phases[phase].Max();
+      }
+
+      *p50 = results[0];
+      *p99 = results[1];
+   }
+
+   unsigned long OverBudgetCount()
+   {
+      return g_over_budget;
+   }
+
+   void Recent(FrameTimingPhase phase, vector<unsigned long long> &out, size_t count)
+   {
+      if (phase >= FrameTimingPhaseCount) out.clear();
+      else g_phases[phase].Recent(out, count);
+   }
+
+   bool Export(const wstring &filename)
+   {
+#ifdef WIN32
+      wofstream report(reinterpret_cast<const wchar_t*>(filename.c_str()));
+#else
+      // TODO: This isn't Unicode!
+      std::string narrow(filename.begin(), filename.end());
+      wofstream report(narrow.c_str());
+#endif
+      if (!report.good()) return false;
+
+      report << L"Frame timing (microseconds)" << endl;
+      report << L"Frames over " << OverBudgetMicroseconds << L": " << g_over_budget << endl;
+
+      for (int i = 0; i < FrameTimingPhaseCount; ++i)
+      {
+         const FrameTimingPhase phase = static_cast<FrameTimingPhase>(i);
+
+         unsigned long long p50, p99, max;
+         Percentiles(phase, &p50, &p99, &max);
+
+         report << endl << PhaseName(phase) << L": " << SampleCount(phase) << L" samples, "
+            << L"p50 " << p50 << L", p99 " << p99 << L", max " << max << endl;
+
+         const vector<size_t> buckets = g_phases[i].Buckets(ExportBucketCount);
+         for (size_t b = 0; b < buckets.size(); ++b)
+         {
+            if (buckets[b] == 0) continue;
+
+            const unsigned long long low = (b == 0 ? 0 : (1ULL << b));
+            if (b + 1 == buckets.size()) report << L"   " << low << L"+";
+            else report << L"   " << low << L"-" << ((2ULL << b) - 1);
+
+            report << L": " << buckets[b] << endl;
+         }
+      }
+
+      return report.good();
+   }
+
+};
@@ -0,0 +1,56 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __FRAME_TIMING_H
+#define __FRAME_TIMING_H
+
+#include <string>
+#include <vector>
+
+// Every frame the game loop runs is timed in pieces:
+//
+//    Update:  the current state's Update (game logic, MIDI)
+//    Draw:    the current state's Draw, plus any overlays
+//    Swap:    SwapBuffers (sending the last batch of quads and
+//             any wait for vsync)
+//    Frame:   from the start of one frame's Draw to the next
+//
+// An average frame rate hides the occasional long frame, so these keep
+// the most recent samples for percentiles and a graph instead.  All
+// values are in microseconds.
+enum FrameTimingPhase
+{
+   FrameTimingUpdate,
+   FrameTimingDraw,
+   FrameTimingSwap,
+   FrameTimingFrame,
+
+   FrameTimingPhaseCount
+};
+
+namespace FrameTiming
+{
+   // Long enough to have missed a 60 Hz refresh, even with vsync
+   const static unsigned long long OverBudgetMicroseconds = 25000;
+
+   void Record(FrameTimingPhase phase, unsigned long long microseconds);
+   void Clear();
+
+   std::wstring PhaseName(FrameTimingPhase phase);
+   size_t SampleCount(FrameTimingPhase phase);
+
+   void Percentiles(FrameTimingPhase phase, unsigned long long *p50, unsigned long long *p99, unsigned long long *max);
+
+   // Frames (since the last Clear) that took longer than OverBudgetMicroseconds
+   unsigned long OverBudgetCount();
+
+   // The last "count" samples of a phase, oldest first
+   void Recent(FrameTimingPhase phase, std::vector<unsigned long long> &out, size_t count);
+
+   // Writes the percentiles and a histogram of each phase to a text
+   // file.  Returns false if the file couldn't be written.
+   bool Export(const std::wstring &filename);
+};
+
+#endif
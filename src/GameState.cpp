@@ -7,16 +7,38 @@
 #include "Textures.h"
 #include "CompatibleSystem.h"
 #include "Tga.h"
+#include "TextureAtlas.h"
+#include "TgaDecodeJob.h"
+#include "GraphicsArchive.h"
 #include "os_graphics.h"
 
 // For FPS display
 #include "TextWriter.h"
+#include "InputLatency.h"
+#include "FrameTiming.h"
+#include "RenderRecording.h"
+#include "UserSettings.h"
 #include <iomanip>
 
-Tga *GameState::GetTexture(Texture tex_name, bool smooth) const
+// F7 writes the input latency histograms to this file
+const static std::wstring LatencyReportKey = L"Latency Report";
+
+// F8 records frames into this file
+const static std::wstring RenderRecordingKey = L"Render Recording";
+
+// About ten seconds at 60 FPS.  Recording stops on its own after this.
+const static size_t MaxRecordedFrames = 600;
+
+// F9 writes the frame timing histograms to this file
+const static std::wstring FrameTimingReportKey = L"Frame Timing Report";
+
+// One 60 Hz refresh
+const static unsigned long long TargetFrameMicroseconds = 16667;
+
+Tga *GameState::GetTexture(Texture tex_name) const
 {
    if (!m_manager) throw GameStateError("Cannot retrieve texture if manager not set!");
-   return m_manager->GetTexture(tex_name, smooth);
+   return m_manager->GetTexture(tex_name);
 }
 
 void GameState::ChangeState(GameState *new_state)
@@ -62,23 +84,121 @@ void GameState::SetManager(GameStateManager *manager)
 
 GameStateManager::~GameStateManager()
 {
-   for (std::map<Texture, Tga*>::iterator i = m_textures.begin(); i != m_textures.end(); ++i)
+   if (m_recording)
+   {
+      Renderer::Record(0);
+      delete m_recording;
+   }
+
+   delete m_current_state;
+   delete m_next_state;
+
+   delete m_texture_decode;
+   delete m_texture_archive;
+
+   for (int i = 0; i < _TexturePageEnumCount; ++i) delete m_pages[i];
+}
+
+void GameStateManager::OpenTextureSource() const
+{
+   // The packed archive has nothing left to decode.  Without one (or
+   // with one that doesn't match this build), decode the TGAs instead.
+   m_texture_archive = GraphicsArchive::Open();
+   if (m_texture_archive) return;
+
+   std::vector<std::wstring> names;
+   for (int i = 0; i < _TextureEnumCount; ++i) names.push_back(TextureResourceNames[i]);
+
+   m_texture_decode = new TgaDecodeJob(names, TgaDecodeJob::DefaultThreadCount());
+}
+
+void GameStateManager::StartLoadingTextures()
+{
+   // (The source only goes away once every page is built)
+   if (IsLoadingTextures() || m_pages[0]) return;
+   OpenTextureSource();
+}
+
+void GameStateManager::LoadTexturePage(TexturePage page) const
+{
+   if (m_pages[page]) return;
+   if (!IsLoadingTextures()) OpenTextureSource();
+
+   TextureAtlas *atlas = 0;
+   if (m_texture_archive) atlas = m_texture_archive->LoadPage(page);
+   else
+   {
+      // Only the upload (in Build) needs to happen here
+      m_texture_decode->Wait();
+      m_texture_decode_microseconds = m_texture_decode->GetMicroseconds();
+
+      atlas = new TextureAtlas(TexturePageSmooth[page]);
+
+      try
+      {
+         for (int i = 0; i < _TextureEnumCount; ++i)
+         {
+            if (TexturePages[i] == page) atlas->Add(i, m_texture_decode->GetImage(i));
+         }
+
+         atlas->Build();
+      }
+      catch (...)
+      {
+         delete atlas;
+         throw;
+      }
+   }
+
+   m_pages[page] = atlas;
+
+   for (int i = 0; i < _TexturePageEnumCount; ++i)
    {
-      if (i->second) Tga::Release(i->second);
-      i->second = 0;
+      if (!m_pages[i]) return;
    }
+
+   delete m_texture_decode;
+   m_texture_decode = 0;
+
+   delete m_texture_archive;
+   m_texture_archive = 0;
+}
+
+void GameStateManager::LoadTextures(const GameState *state) const
+{
+   // Nothing has asked for graphics yet (e.g. a headless simulation),
+   // or everything is already uploaded
+   if (!IsLoadingTextures()) return;
+
+   TextureList textures;
+   state->DeclareTextures(textures);
+
+   for (TextureList::const_iterator i = textures.begin(); i != textures.end(); ++i) LoadTexturePage(TexturePages[*i]);
 }
 
-Tga *GameStateManager::GetTexture(Texture tex_name, bool smooth) const
+void GameStateManager::PreloadTextures()
 {
-   if (!m_textures[tex_name])
+   if (!IsLoadingTextures()) return;
+
+   // This is between frames, so it must never wait on the workers
+   if (m_texture_decode && !m_texture_decode->IsFinished()) return;
+
+   // One page per frame keeps each hitch small
+   for (int i = 0; i < _TexturePageEnumCount; ++i)
    {
-      m_textures[tex_name] = Tga::Load(TextureResourceNames[tex_name]);
+      if (m_pages[i]) continue;
+
+      LoadTexturePage(static_cast<TexturePage>(i));
+      return;
    }
+}
 
-   m_textures[tex_name]->SetSmooth(smooth);
+Tga *GameStateManager::GetTexture(Texture tex_name) const
+{
+   const TexturePage page = TexturePages[tex_name];
+   if (!m_pages[page]) LoadTexturePage(page);
 
-   return m_textures[tex_name];
+   return m_pages[page]->Get(tex_name);
 }
 
 void GameStateManager::KeyPress(GameKey key)
@@ -142,6 +262,8 @@ void GameStateManager::SetInitialState(GameState *first_state)
 {
    if (m_current_state) throw GameStateError("Cannot set an initial state because GameStateManager already has a state!");
 
+   LoadTextures(first_state);
+
    first_state->SetManager(this);
    m_current_state = first_state;
 }
@@ -170,9 +292,44 @@ void GameStateManager::Update(bool skip_this_update)
    // we've been told to skip this one.
    if (skip_this_update) return;
 
+   const unsigned long long update_start = Compatible::GetMicroseconds();
+   Advance(delta);
+   FrameTiming::Record(FrameTimingUpdate, Compatible::GetMicroseconds() - update_start);
+}
+
+void GameStateManager::Suspend()
+{
+   if (m_current_state) m_current_state->Suspend();
+}
+
+void GameStateManager::Resume()
+{
+   if (m_current_state) m_current_state->Resume();
+}
+
+void GameStateManager::Advance(unsigned long delta)
+{
    m_fps.Frame(delta);
    if (IsKeyReleased(KeyF6)) m_show_fps = !m_show_fps;
 
+   if (IsKeyReleased(KeyF7))
+   {
+      const std::wstring filename = UserSetting::Get(LatencyReportKey, L"latency_report.txt");
+      if (!InputLatency::Export(filename)) Compatible::ShowError(WSTRING(L"Couldn't write latency report '" << filename << L"'."));
+   }
+
+   if (IsKeyReleased(KeyF9))
+   {
+      const std::wstring filename = UserSetting::Get(FrameTimingReportKey, L"frame_timing.txt");
+      if (!FrameTiming::Export(filename)) Compatible::ShowError(WSTRING(L"Couldn't write frame timing report '" << filename << L"'."));
+   }
+
+   if (IsKeyReleased(KeyF8))
+   {
+      if (m_recording) StopRecording();
+      else StartRecording();
+   }
+
    if (m_next_state && m_current_state)
    {
       delete m_current_state;
@@ -189,6 +346,7 @@ void GameStateManager::Update(bool skip_this_update)
       m_current_state = m_next_state;
       m_next_state = 0;
 
+      LoadTextures(m_current_state);
       m_current_state->SetManager(this);
    }
 
@@ -202,6 +360,9 @@ void GameStateManager::Update(bool skip_this_update)
 
    m_inside_update = false;
 
+   // Get the next state's graphics ready while this one runs
+   PreloadTextures();
+
    // Reset our keypresses for the next frame
    m_last_key_presses = m_key_presses;
    m_key_presses = 0;
@@ -215,20 +376,15 @@ void GameStateManager::Draw(Renderer &renderer)
 {
    if (!m_current_state) return;
 
+   const unsigned long long draw_start = Compatible::GetMicroseconds();
+   if (m_last_draw_start != 0) FrameTiming::Record(FrameTimingFrame, draw_start - m_last_draw_start);
+   m_last_draw_start = draw_start;
+
    // NOTE: Sweet transition effects are *very* possible here... rendering
    // the previous state *and* the current state during some transition
    // would be really easy.
 
-   const static float gray = 64.0f / 255.0f;
-   glClearColor(gray, gray, gray, 1.0f);
-
-   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-   glMatrixMode(GL_MODELVIEW);
-   glLoadIdentity();
-   glTranslatef(0., static_cast<GLfloat>(GetStateHeight()), 0.);
-   glScalef (1., -1., 1.);
-   glTranslatef(0.375, 0.375, 0.);
+   renderer.BeginFrame(GetStateHeight(), Renderer::ToColor(64, 64, 64));
 
    m_current_state->Draw(renderer);
 
@@ -236,8 +392,102 @@ void GameStateManager::Draw(Renderer &renderer)
    {
       TextWriter fps_writer(0, 0, renderer);
       fps_writer << Text(WSTRING(L"FPS: "), Gray) << Text(WSTRING(std::setprecision(6) << m_fps.GetFramesPerSecond()), White);
+      fps_writer << newline << Text(L"Draw calls: ", Gray) << Text(WSTRING(Renderer::GetDrawCallCount()), White);
+      if (m_texture_decode_microseconds) fps_writer << newline << Text(L"Graphics decoded in (us): ", Gray) << Text(WSTRING(m_texture_decode_microseconds), White);
+
+      if (m_recording) fps_writer << newline << Text(L"Recording frames: ", Gray) << Text(WSTRING(m_recording->FrameCount()), White);
+
+      fps_writer << newline << Text(L"Frame timing p50 / p99 / max (us)", Gray);
+      for (int i = 0; i < FrameTimingPhaseCount; ++i)
+      {
+         const FrameTimingPhase phase = static_cast<FrameTimingPhase>(i);
+
+         unsigned long long p50, p99, max;
+         FrameTiming::Percentiles(phase, &p50, &p99, &max);
+
+         fps_writer << newline << Text(WSTRING(FrameTiming::PhaseName(phase) << L": "), Gray)
+            << Text(WSTRING(p50 << L" / " << p99 << L" / " << max), White);
+      }
+      fps_writer << newline << Text(WSTRING(L"Frames over " << FrameTiming::OverBudgetMicroseconds / 1000 << L" ms: "), Gray)
+         << Text(WSTRING(FrameTiming::OverBudgetCount()), White);
+
+      DrawFrameGraph(renderer);
+
+      if (InputLatency::SampleCount(InputLatencyQueue) > 0)
+      {
+         fps_writer << newline << Text(L"Input latency p50 / p95 / p99 (us)", Gray);
+         for (int i = 0; i < InputLatencyStageCount; ++i)
+         {
+            const InputLatencyStage stage = static_cast<InputLatencyStage>(i);
+
+            unsigned long long p50, p95, p99;
+            InputLatency::Percentiles(stage, &p50, &p95, &p99);
+
+            fps_writer << newline << Text(WSTRING(InputLatency::StageName(stage) << L": "), Gray)
+               << Text(WSTRING(p50 << L" / " << p95 << L" / " << p99), White);
+         }
+      }
    }
 
-   glFlush ();
+   const unsigned long long swap_start = Compatible::GetMicroseconds();
+   FrameTiming::Record(FrameTimingDraw, swap_start - draw_start);
+
    renderer.SwapBuffers();
+   FrameTiming::Record(FrameTimingSwap, Compatible::GetMicroseconds() - swap_start);
+
+   if (m_recording && m_recording->IsFull()) StopRecording();
+}
+
+void GameStateManager::DrawFrameGraph(Renderer &renderer) const
+{
+   const static size_t GraphFrames = 120;
+   const static int BarWidth = 2;
+   const static int GraphHeight = 100;
+   const static int PixelsPerMillisecond = 2;
+   const static int Margin = 10;
+
+   std::vector<unsigned long long> frames;
+   FrameTiming::Recent(FrameTimingFrame, frames, GraphFrames);
+
+   const int graph_width = static_cast<int>(GraphFrames) * BarWidth;
+   const int graph_x = GetStateWidth() - graph_width - Margin;
+   const int baseline = Margin + GraphHeight;
+
+   renderer.SetColor(0x00, 0x00, 0x00, 0xA0);
+   renderer.DrawQuad(graph_x, Margin, graph_width, GraphHeight);
+
+   // Newest frame on the right
+   const int first_x = graph_x + graph_width - static_cast<int>(frames.size()) * BarWidth;
+   for (size_t i = 0; i < frames.size(); ++i)
+   {
+      const unsigned long long us = frames[i];
+      const int height = std::min(GraphHeight, static_cast<int>(us * PixelsPerMillisecond / 1000));
+
+      if (us > FrameTiming::OverBudgetMicroseconds) renderer.SetColor(0xFF, 0x40, 0x40);
+      else if (us > TargetFrameMicroseconds + TargetFrameMicroseconds / 10) renderer.SetColor(0xFF, 0xD0, 0x40);
+      else renderer.SetColor(0x40, 0xD0, 0x40);
+
+      renderer.DrawQuad(first_x + static_cast<int>(i) * BarWidth, baseline - height, BarWidth, height);
+   }
+
+   // The line a smooth 60 FPS sits on
+   renderer.SetColor(0xFF, 0xFF, 0xFF, 0x80);
+   renderer.DrawQuad(graph_x, baseline - static_cast<int>(TargetFrameMicroseconds * PixelsPerMillisecond / 1000), graph_width, 1);
+}
+
+void GameStateManager::StartRecording()
+{
+   m_recording = new RenderRecording(MaxRecordedFrames, m_screen_x, m_screen_y);
+   Renderer::Record(m_recording);
+}
+
+void GameStateManager::StopRecording()
+{
+   Renderer::Record(0);
+
+   const std::wstring filename = UserSetting::Get(RenderRecordingKey, L"render_recording.bin");
+   if (!m_recording->Save(filename)) Compatible::ShowError(WSTRING(L"Couldn't write render recording '" << filename << L"'."));
+
+   delete m_recording;
+   m_recording = 0;
 }
@@ -7,7 +7,7 @@
 
 #include <exception>
 #include <string>
-#include <map>
+#include <vector>
 
 #include "os.h"
 #include "Textures.h"
@@ -16,6 +16,10 @@
 
 class Renderer;
 class Tga;
+class TextureAtlas;
+class TgaDecodeJob;
+class GraphicsArchive;
+class RenderRecording;
 
 class GameStateError : public std::exception
 {
@@ -44,6 +48,9 @@ enum GameKey
    KeyEnter =  0x0040,
 
    KeyF6 =     0x0080,
+   KeyF7 =     0x0400,
+   KeyF8 =     0x0800,
+   KeyF9 =     0x1000,
 
    KeyPlus =   0x0100,
    KeyMinus =  0x0200
@@ -75,6 +82,8 @@ struct MouseInfo
    MouseButtons released;
 };
 
+typedef std::vector<Texture> TextureList;
+
 class GameState
 {
 public:
@@ -98,6 +107,16 @@ protected:
    // GetStateWidth()) and [0, GetStateHeight())
    virtual void Draw(Renderer &renderer) const = 0;
 
+   // Adds every texture Draw() might ask for.  The manager has them
+   // uploaded before Init(), so the first frame never waits on them.
+   virtual void DeclareTextures(TextureList &) const { }
+
+   // The window lost focus, and Update won't be called again until
+   // Resume.  Anything the state keeps running on its own (off the main
+   // thread) should hold still in between.
+   virtual void Suspend() { }
+   virtual void Resume() { }
+
    // How long has this state been running
    unsigned long GetStateMilliseconds() const { return m_state_milliseconds; }
    
@@ -121,7 +140,7 @@ protected:
    // of the memory to the state handling subsystem.
    void ChangeState(GameState *new_state);
 
-   Tga *GetTexture(Texture tex_name, bool smooth = false) const;
+   Tga *GetTexture(Texture tex_name) const;
 
    // These are usable inside Update()
    bool IsKeyPressed(GameKey key) const;
@@ -150,8 +169,14 @@ public:
    GameStateManager(int screen_width, int screen_height)
       : m_current_state(0), m_screen_x(screen_width), m_screen_y(screen_height),
       m_last_milliseconds(Compatible::GetMilliseconds()), m_next_state(0), m_key_presses(0), m_last_key_presses(0),
-      m_inside_update(false), m_fps(500.0), m_show_fps(false)
-   { }
+      m_inside_update(false), m_fps(500.0), m_show_fps(false), m_recording(0), m_last_draw_start(0)
+   {
+      for (int i = 0; i < _TexturePageEnumCount; ++i) m_pages[i] = 0;
+
+      m_texture_decode = 0;
+      m_texture_archive = 0;
+      m_texture_decode_microseconds = 0;
+   }
    
    ~GameStateManager();
 
@@ -169,12 +194,35 @@ public:
    void MouseMove(int x, int y);
    const MouseInfo &Mouse() const { return m_mouse; }
 
+   // Advances the current state by however much time has
+   // passed on the system clock since the last call.
    void Update(bool skip_this_update);
+
+   // Passed along to the current state when the window loses (or gets
+   // back) focus
+   void Suspend();
+   void Resume();
+
+   // Advances the current state by exactly delta_milliseconds
+   // without looking at the system clock.  This is what Update()
+   // uses internally.  Headless simulations may call it directly
+   // (and never call Draw) to run faster than real time.
+   void Advance(unsigned long delta_milliseconds);
+
    void Draw(Renderer &renderer);
 
    void ChangeState(GameState *new_state);
 
-   Tga *GetTexture(Texture tex_name, bool smooth) const;
+   // True once the current state has called ChangeState, up
+   // until the new state takes over.
+   bool IsChangingState() const { return (m_next_state != 0); }
+
+   Tga *GetTexture(Texture tex_name) const;
+
+   // Maps the packed graphics archive, or if there isn't one, starts
+   // decoding the graphics on worker threads so it can overlap other
+   // startup work.  (Otherwise the first GetTexture does this.)
+   void StartLoadingTextures();
 
    int GetStateWidth() const { return m_screen_x; }
    int GetStateHeight() const { return m_screen_y; }
@@ -194,10 +242,33 @@ private:
    FrameCounter m_fps;
    bool m_show_fps;
 
+   // F8 starts and stops recording what gets drawn (see RenderRecording)
+   void StartRecording();
+   void StopRecording();
+   RenderRecording *m_recording;
+
+   // For FrameTiming (F9 writes a report)
+   void DrawFrameGraph(Renderer &renderer) const;
+   unsigned long long m_last_draw_start;
+
    int m_screen_x;
    int m_screen_y;
 
-   mutable std::map<Texture, Tga*> m_textures;
+   // Every graphic in Textures.h comes from the GraphicsArchive (or is
+   // decoded on worker threads), then is uploaded a page at a time: the
+   // pages a state declares just before it starts, and any others
+   // between frames once they're ready.
+   void OpenTextureSource() const;
+   bool IsLoadingTextures() const { return (m_texture_decode || m_texture_archive); }
+   void LoadTexturePage(TexturePage page) const;
+   void LoadTextures(const GameState *state) const;
+   void PreloadTextures();
+   mutable TextureAtlas *m_pages[_TexturePageEnumCount];
+
+   // Only until every page is built.  At most one of these is set.
+   mutable TgaDecodeJob *m_texture_decode;
+   mutable GraphicsArchive *m_texture_archive;
+   mutable unsigned long long m_texture_decode_microseconds;
 };
 
 
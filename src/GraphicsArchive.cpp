@@ -0,0 +1,315 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "GraphicsArchive.h"
+#include "TextureAtlas.h"
+#include "TgaDecodeJob.h"
+#include "PianoGameError.h"
+#include "string_util.h"
+
+#include <fstream>
+#include <vector>
+#include <cstring>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
+
+using namespace std;
+
+// Bump this whenever the layout changes, so an old archive gets ignored
+const static unsigned long ArchiveVersion = 1;
+const static char ArchiveMagic[4] = { 'P', 'G', 'G', 'A' };
+
+const static unsigned long NameLength = 32;
+const static unsigned long HeaderSize = 16;
+const static unsigned long PageEntrySize = 12;
+const static unsigned long TextureEntrySize = NameLength + 20;
+const static unsigned long IndexSize = HeaderSize + PageEntrySize * _TexturePageEnumCount + TextureEntrySize * _TextureEnumCount;
+
+// Page texels start on a boundary of this many bytes
+const static unsigned long PageAlignment = 4096;
+
+// Anything bigger than this is a damaged file, not a real atlas
+const static unsigned long MaxPageSize = 8192;
+
+static unsigned long ReadNumber(const unsigned char *bytes)
+{
+   return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<unsigned long>(bytes[3]) << 24);
+}
+
+static void WriteNumber(vector<unsigned char> &bytes, unsigned long n)
+{
+   for (int i = 0; i < 4; ++i) bytes.push_back(static_cast<unsigned char>((n >> (i * 8)) & 0xFF));
+}
+
+static unsigned long Align(unsigned long offset)
+{
+   return (offset + PageAlignment - 1) / PageAlignment * PageAlignment;
+}
+
+GraphicsArchive::GraphicsArchive()
+   : m_bytes(0), m_size(0)
+#ifdef WIN32
+   , m_file(INVALID_HANDLE_VALUE), m_mapping(0)
+#endif
+{ }
+
+GraphicsArchive *GraphicsArchive::Open()
+{
+   GraphicsArchive *archive = new GraphicsArchive();
+   if (archive->Map() && archive->ReadIndex()) return archive;
+
+   delete archive;
+   return 0;
+}
+
+#ifdef WIN32
+
+bool GraphicsArchive::Map()
+{
+   // The archive sits next to the executable
+   wchar_t module_path[MAX_PATH];
+   const DWORD length = GetModuleFileName(0, module_path, MAX_PATH);
+   if (length == 0 || length >= MAX_PATH) return false;
+
+   wstring path(module_path, length);
+   path = path.substr(0, path.find_last_of(L'\\') + 1) + L"graphics.pak";
+
+   m_file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+   if (m_file == INVALID_HANDLE_VALUE) return false;
+
+   m_size = GetFileSize(m_file, 0);
+   if (m_size == INVALID_FILE_SIZE || m_size == 0) return false;
+
+   m_mapping = CreateFileMapping(m_file, 0, PAGE_READONLY, 0, 0, 0);
+   if (!m_mapping) return false;
+
+   m_bytes = reinterpret_cast<const unsigned char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+   return (m_bytes != 0);
+}
+
+GraphicsArchive::~GraphicsArchive()
+{
+   if (m_bytes) UnmapViewOfFile(m_bytes);
+   if (m_mapping) CloseHandle(m_mapping);
+   if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+}
+
+#else
+
+bool GraphicsArchive::Map()
+{
+   CFURLRef url = CFBundleCopyResourceURL(CFBundleGetMainBundle(), CFSTR("graphics"), CFSTR("pak"), 0);
+   if (!url) return false;
+
+   UInt8 path[PATH_MAX];
+   const Boolean found = CFURLGetFileSystemRepresentation(url, true, path, sizeof(path));
+   CFRelease(url);
+   if (!found) return false;
+
+   const int file = open(reinterpret_cast<const char*>(path), O_RDONLY);
+   if (file < 0) return false;
+
+   struct stat info;
+   if (fstat(file, &info) != 0 || info.st_size <= 0)
+   {
+      close(file);
+      return false;
+   }
+
+   // The mapping stays valid after the descriptor is closed
+   void *bytes = mmap(0, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+   close(file);
+
+   if (bytes == MAP_FAILED) return false;
+
+   m_bytes = reinterpret_cast<const unsigned char*>(bytes);
+   m_size = static_cast<unsigned long>(info.st_size);
+   return true;
+}
+
+GraphicsArchive::~GraphicsArchive()
+{
+   if (m_bytes) munmap(const_cast<unsigned char*>(m_bytes), m_size);
+}
+
+#endif
+
+bool GraphicsArchive::ReadIndex()
+{
+   if (m_size < IndexSize) return false;
+
+   if (memcmp(m_bytes, ArchiveMagic, sizeof(ArchiveMagic)) != 0) return false;
+   if (ReadNumber(m_bytes + 4) != ArchiveVersion) return false;
+   if (ReadNumber(m_bytes + 8) != _TexturePageEnumCount) return false;
+   if (ReadNumber(m_bytes + 12) != _TextureEnumCount) return false;
+
+   const unsigned char *entry = m_bytes + HeaderSize;
+   for (int i = 0; i < _TexturePageEnumCount; ++i, entry += PageEntrySize)
+   {
+      Page &page = m_pages[i];
+      page.width = ReadNumber(entry + 0);
+      page.height = ReadNumber(entry + 4);
+      page.offset = ReadNumber(entry + 8);
+
+      if (page.width == 0 || page.height == 0 || page.width > MaxPageSize || page.height > MaxPageSize) return false;
+      if (page.offset > m_size || m_size - page.offset < page.width * page.height * 4) return false;
+   }
+
+   // Matched up by name, so an archive from a build where Textures.h
+   // was in a different order still works
+   bool found[_TextureEnumCount] = { false };
+   for (int n = 0; n < _TextureEnumCount; ++n, entry += TextureEntrySize)
+   {
+      wstring name;
+      for (unsigned long c = 0; c < NameLength && entry[c] != 0; ++c) name += static_cast<wchar_t>(entry[c]);
+
+      int texture = -1;
+      for (int i = 0; i < _TextureEnumCount; ++i)
+      {
+         if (name == TextureResourceNames[i]) texture = i;
+      }
+      if (texture < 0 || found[texture]) return false;
+
+      // A graphic that has moved to another page means a stale archive
+      const unsigned long page = ReadNumber(entry + NameLength);
+      if (page != static_cast<unsigned long>(TexturePages[texture])) return false;
+
+      Placement &placement = m_placements[texture];
+      placement.x = ReadNumber(entry + NameLength + 4);
+      placement.y = ReadNumber(entry + NameLength + 8);
+      placement.width = ReadNumber(entry + NameLength + 12);
+      placement.height = ReadNumber(entry + NameLength + 16);
+
+      if (placement.x + placement.width > m_pages[page].width) return false;
+      if (placement.y + placement.height > m_pages[page].height) return false;
+
+      found[texture] = true;
+   }
+
+   return true;
+}
+
+TextureAtlas *GraphicsArchive::LoadPage(TexturePage page) const
+{
+   TextureAtlas *atlas = new TextureAtlas(TexturePageSmooth[page]);
+
+   try
+   {
+      for (int i = 0; i < _TextureEnumCount; ++i)
+      {
+         if (TexturePages[i] != page) continue;
+
+         const Placement &placement = m_placements[i];
+         atlas->Place(i, placement.x, placement.y, placement.width, placement.height);
+      }
+
+      atlas->Upload(m_pages[page].width, m_pages[page].height, m_bytes + m_pages[page].offset);
+   }
+   catch (...)
+   {
+      delete atlas;
+      throw;
+   }
+
+   return atlas;
+}
+
+void GraphicsArchive::Write(const wstring &filename)
+{
+   vector<wstring> names;
+   for (int i = 0; i < _TextureEnumCount; ++i) names.push_back(TextureResourceNames[i]);
+
+   TgaDecodeJob decode(names, TgaDecodeJob::DefaultThreadCount());
+   decode.Wait();
+
+   vector<unsigned char> texels[_TexturePageEnumCount];
+   Page pages[_TexturePageEnumCount];
+   Placement placements[_TextureEnumCount];
+
+   // Arranged exactly the way the game would have at runtime
+   unsigned long offset = Align(IndexSize);
+   for (int p = 0; p < _TexturePageEnumCount; ++p)
+   {
+      TextureAtlas atlas(TexturePageSmooth[p]);
+      for (int i = 0; i < _TextureEnumCount; ++i)
+      {
+         if (TexturePages[i] == p) atlas.Add(i, decode.GetImage(i));
+      }
+
+      atlas.Arrange(texels[p]);
+
+      pages[p].width = atlas.GetWidth();
+      pages[p].height = atlas.GetHeight();
+      pages[p].offset = offset;
+      offset = Align(offset + static_cast<unsigned long>(texels[p].size()));
+
+      for (int i = 0; i < _TextureEnumCount; ++i)
+      {
+         if (TexturePages[i] != p) continue;
+
+         unsigned int x, y, width, height;
+         atlas.GetPlacement(i, &x, &y, &width, &height);
+
+         placements[i].x = x;
+         placements[i].y = y;
+         placements[i].width = width;
+         placements[i].height = height;
+      }
+   }
+
+   vector<unsigned char> index(ArchiveMagic, ArchiveMagic + sizeof(ArchiveMagic));
+   WriteNumber(index, ArchiveVersion);
+   WriteNumber(index, _TexturePageEnumCount);
+   WriteNumber(index, _TextureEnumCount);
+
+   for (int p = 0; p < _TexturePageEnumCount; ++p)
+   {
+      WriteNumber(index, pages[p].width);
+      WriteNumber(index, pages[p].height);
+      WriteNumber(index, pages[p].offset);
+   }
+
+   for (int i = 0; i < _TextureEnumCount; ++i)
+   {
+      const wstring name(TextureResourceNames[i]);
+      if (name.length() >= NameLength) throw PianoGameError(WSTRING(L"Graphic name '" << name << L"' is too long for the graphics archive."));
+
+      for (unsigned long c = 0; c < NameLength; ++c) index.push_back(c < name.length() ? static_cast<unsigned char>(name[c]) : 0);
+
+      WriteNumber(index, TexturePages[i]);
+      WriteNumber(index, placements[i].x);
+      WriteNumber(index, placements[i].y);
+      WriteNumber(index, placements[i].width);
+      WriteNumber(index, placements[i].height);
+   }
+
+#ifdef WIN32
+   ofstream file(reinterpret_cast<const wchar_t*>(filename.c_str()), ios::binary);
+#else
+   // TODO: This isn't Unicode!
+   std::string narrow(filename.begin(), filename.end());
+   ofstream file(narrow.c_str(), ios::binary);
+#endif
+   if (!file.good()) throw PianoGameError(WSTRING(L"Couldn't create graphics archive '" << filename << L"'."));
+
+   file.write(reinterpret_cast<const char*>(&index[0]), static_cast<std::streamsize>(index.size()));
+
+   unsigned long written = static_cast<unsigned long>(index.size());
+   for (int p = 0; p < _TexturePageEnumCount; ++p)
+   {
+      const vector<char> padding(pages[p].offset - written, 0);
+      if (!padding.empty()) file.write(&padding[0], static_cast<std::streamsize>(padding.size()));
+
+      file.write(reinterpret_cast<const char*>(&texels[p][0]), static_cast<std::streamsize>(texels[p].size()));
+      written = pages[p].offset + static_cast<unsigned long>(texels[p].size());
+   }
+
+   if (!file.good()) throw PianoGameError(WSTRING(L"Couldn't write graphics archive '" << filename << L"'."));
+}
@@ -0,0 +1,84 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __GRAPHICS_ARCHIVE_H
+#define __GRAPHICS_ARCHIVE_H
+
+#include <string>
+
+#include "os.h"
+#include "Textures.h"
+
+class TextureAtlas;
+
+// Every graphic in Textures.h, already decoded and arranged into its
+// TextureAtlas page, in a single file.  The build runs
+// "PianoGame --pack-graphics graphics.pak" to write it next to the
+// executable (or it goes in the bundle's Resources on the Mac).  The game
+// maps it and uploads each page straight from the mapped file, so there's
+// nothing left to decode at startup.
+//
+// Every number is an unsigned 32-bit little-endian integer:
+//
+//   "PGGA", version, page count, texture count
+//   each page:    width, height, offset of its texels
+//   each texture: name (32 bytes, ASCII, zero padded), page, x, y, width, height
+//
+// A page's texels are RGBA, bottom row first, starting on a 4K boundary.
+class GraphicsArchive
+{
+public:
+   // Maps the archive that shipped with the game.  Returns zero if there
+   // isn't one or it doesn't match this build's Textures.h, in which case
+   // the TGAs get decoded instead.
+   static GraphicsArchive *Open();
+
+   // Unmaps the file.  Pages already loaded have their own copies.
+   ~GraphicsArchive();
+
+   // The returned atlas is the caller's to delete
+   TextureAtlas *LoadPage(TexturePage page) const;
+
+   // Decodes every TGA resource and writes the archive.  Throws
+   // PianoGameError if something can't be decoded or written.
+   static void Write(const std::wstring &filename);
+
+private:
+   GraphicsArchive();
+
+   // Not copyable
+   GraphicsArchive(const GraphicsArchive &);
+   GraphicsArchive &operator=(const GraphicsArchive &);
+
+   bool Map();
+   bool ReadIndex();
+
+   const unsigned char *m_bytes;
+   unsigned long m_size;
+
+#ifdef WIN32
+   HANDLE m_file;
+   HANDLE m_mapping;
+#endif
+
+   struct Page
+   {
+      unsigned long width;
+      unsigned long height;
+      unsigned long offset;
+   };
+
+   struct Placement
+   {
+      unsigned long x;
+      unsigned long y;
+      unsigned long width;
+      unsigned long height;
+   };
+
+   Page m_pages[_TexturePageEnumCount];
+   Placement m_placements[_TextureEnumCount];
+};
+
+#endif
@@ -0,0 +1,133 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "InputLatency.h"
+#include "RollingHistogram.h"
+#include "string_util.h"
+#include "ThreadLock.h"
+
+#include <fstream>
+#include <vector>
+using namespace std;
+
+namespace InputLatency
+{
+   // A few seconds of steady playing is enough to see the tail
+   const static size_t SamplesKept = 1024;
+
+   // Power-of-two buckets up through ~1 second
+   const static size_t ExportBucketCount = 21;
+
+   static RollingHistogram g_stages[InputLatencyStageCount] =
+   {
+      RollingHistogram(SamplesKept),
+      RollingHistogram(SamplesKept),
+      RollingHistogram(SamplesKept),
+      RollingHistogram(SamplesKept),
+      RollingHistogram(SamplesKept)
+   };
+
+   // Live input is scored on the simulation thread (see
+   // SimulationThread.h) while the overlay reads from the main thread
+   static ThreadLock g_lock;
+
+   void Record(InputLatencyStage stage, unsigned long long microseconds)
+   {
+      if (stage >= InputLatencyStageCount) return;
+
+      g_lock.Lock();
+      g_stages[stage].Add(microseconds);
+      g_lock.Unlock();
+   }
+
+   void Clear()
+   {
+      g_lock.Lock();
+      for (int i = 0; i < InputLatencyStageCount; ++i) g_stages[i].Clear();
+      g_lock.Unlock();
+   }
+
+   wstring StageName(InputLatencyStage stage)
+   {
+      switch (stage)
+      {
+      case InputLatencyDriver: return L"Driver";
+      case InputLatencyQueue:  return L"Queue";
+      case InputLatencyMatch:  return L"Match";
+      case InputLatencyOutput: return L"Output";
+      case InputLatencyTotal:  return L"Total";
+      default:                 return L"Unknown";
+      }
+   }
+
+   size_t SampleCount(InputLatencyStage stage)
+   {
+      if (stage >= InputLatencyStageCount) return 0;
+
+      g_lock.Lock();
+      const size_t count = g_stages[stage].Count();
+      g_lock.Unlock();
+
+      return count;
+   }
+
+   void Percentiles(InputLatencyStage stage, unsigned long long *p50, unsigned long long *p95, unsigned long long *p99)
+   {
+      const static double fractions[3] = { 0.50, 0.95, 0.99 };
+      unsigned long long results[3] = { 0, 0, 0 };
+
+      if (stage < InputLatencyStageCount)
+      {
+         g_lock.Lock();
+         g_stages[stage].Percentiles(fractions, results, 3);
+         g_lock.Unlock();
+      }
+
+      *p50 = results[0];
+      *p95 = results[1];
+      *p99 = results[2];
+   }
+
+   bool Export(const wstring &filename)
+   {
+#ifdef WIN32
+      wofstream report(reinterpret_cast<const wchar_t*>(filename.c_str()));
+#else
+      // TODO: This isn't Unicode!
+      std::string narrow(filename.begin(), filename.end());
+      wofstream report(narrow.c_str());
+#endif
+      if (!report.good()) return false;
+
+      report << L"Input latency (microseconds)" << endl;
+
+      for (int i = 0; i < InputLatencyStageCount; ++i)
+      {
+         const InputLatencyStage stage = static_cast<InputLatencyStage>(i);
+
+         unsigned long long p50, p95, p99;
+         Percentiles(stage, &p50, &p95, &p99);
+
+         report << endl << StageName(stage) << L": " << SampleCount(stage) << L" samples, "
+            << L"p50 " << p50 << L", p95 " << p95 << L", p99 " << p99 << endl;
+
+         g_lock.Lock();
+         const vector<size_t> buckets = g_stages[i].Buckets(ExportBucketCount);
+         g_lock.Unlock();
+         for (size_t b = 0; b < buckets.size(); ++b)
+         {
+            if (buckets[b] == 0) continue;
+
+            const unsigned long long low = (b == 0 ? 0 : (1ULL << b));
+            if (b + 1 == buckets.size()) report << L"   " << low << L"+";
+            else report << L"   " << low << L"-" << ((2ULL << b) - 1);
+
+            report << L": " << buckets[b] << endl;
+         }
+      }
+
+      return report.good();
+   }
+
+};
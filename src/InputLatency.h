@@ -0,0 +1,52 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __INPUT_LATENCY_H
+#define __INPUT_LATENCY_H
+
+#include <string>
+
+// Each live note the player presses (or releases) is timed at every
+// stage between their key and our synth:
+//
+//    Driver:  how long the OS driver held the event before our
+//             input callback saw it
+//    Queue:   from the input callback until the game loop read
+//             the event out of the input buffer
+//    Match:   from being read until the note was ready to be
+//             sent (merging devices, matching it to the song)
+//    Output:  how long the MIDI output Write call took
+//    Total:   every one of the above, end to end
+//
+// A slow driver shows up in the first stage, game loop stalls in the
+// second.  Only the most recent samples of each stage are kept.  All
+// values are in microseconds.
+enum InputLatencyStage
+{
+   InputLatencyDriver,
+   InputLatencyQueue,
+   InputLatencyMatch,
+   InputLatencyOutput,
+   InputLatencyTotal,
+
+   InputLatencyStageCount
+};
+
+namespace InputLatency
+{
+   void Record(InputLatencyStage stage, unsigned long long microseconds);
+   void Clear();
+
+   std::wstring StageName(InputLatencyStage stage);
+   size_t SampleCount(InputLatencyStage stage);
+
+   // Fills in the 50th, 95th, and 99th percentiles of the stage
+   void Percentiles(InputLatencyStage stage, unsigned long long *p50, unsigned long long *p95, unsigned long long *p99);
+
+   // Writes the percentiles and a histogram of each stage to a text
+   // file.  Returns false if the file couldn't be written.
+   bool Export(const std::wstring &filename);
+};
+
+#endif
@@ -5,11 +5,22 @@
 #include "KeyboardDisplay.h"
 #include "TrackProperties.h"
 #include "PianoGameError.h"
-#include "string_util.h"
 
 #include "Renderer.h"
 #include "Textures.h"
 #include "Tga.h"
+#include "CompatibleSystem.h"
+
+#include <cmath>
+#include <map>
+#include <algorithm>
+
+// PowerPC Macs only get the plain version (see Compatible::HasSse2)
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define NOTES_SSE2
+#include <emmintrin.h>
+static const bool HasSse2 = Compatible::HasSse2();
+#endif
 
 using namespace std;
 
@@ -28,70 +39,376 @@ struct KeyTexDimensions
 };
 const KeyboardDisplay::KeyTexDimensions KeyboardDisplay::BlackKeyDimensions = { 32, 128, 8, 20, 15, 109 };
 
+// The note-falling area stops this far above the keys
+const static int PixelsOffKeyboard = 2;
+
+// Note times further out than this (about 17 minutes) are clamped to it,
+// which still puts them far off the screen, so they fit in an int
+const static microseconds_t MaxNoteMicroseconds = 0x3FFFFFFF;
+
+// A fractional number of pixels, kept as its floor and ceiling so the
+// int(y - offset) notes have always been placed with (which rounds
+// toward zero) can be worked out with integers alone
+struct Offset
+{
+   Offset() : down(0), up(0) { }
+   explicit Offset(double offset) : down(static_cast<int>(floor(offset))), up(static_cast<int>(ceil(offset))) { }
+
+   int down;
+   int up;
+};
+
+// int(y - offset)
+static int TruncateSub(int y, const Offset &offset)
+{
+   return (y >= offset.up ? y - offset.up : y - offset.down);
+}
+
+// int(y + offset)
+static int TruncateAdd(int y, const Offset &offset)
+{
+   return (y >= -offset.down ? y + offset.down : y + offset.up);
+}
+
+struct KeyboardDisplay::NoteShape
+{
+   // The texture is stretched so the part between left and right
+   // covers the note's width.  That same scale is used in height
+   // calculations to keep the proportions fixed.
+   NoteShape(const NoteTexDimensions &d, int note_width)
+   {
+      const double width_scale = double(note_width) / double(d.right - d.left);
+
+      left = Offset(d.left * width_scale);
+      width = int(d.tex_width * width_scale);
+
+      // Notes are forced to be at least as tall as the crown and heel
+      const double crown_h = (d.crown_end - d.crown_start) * width_scale;
+      const double heel_h = (d.heel_end - d.heel_start) * width_scale;
+      min_height = Offset(crown_h + heel_h + 1.0);
+
+      crown_start = Offset(d.crown_start * width_scale);
+      crown_end = Offset(d.crown_end * width_scale);
+      heel = Offset(double(d.heel_end - d.heel_start) * width_scale);
+      bottom = Offset(double(d.tex_height - d.heel_end) * width_scale);
+   }
+
+   // From the note's left edge to the texture's, and the texture's width
+   Offset left;
+   int width;
+
+   Offset min_height;
+
+   // From the top of the note to the top of the texture, and from there
+   // to the end of the crown
+   Offset crown_start;
+   Offset crown_end;
+
+   // From the bottom of the note up to the heel, and from there to the
+   // bottom of the texture
+   Offset heel;
+   Offset bottom;
+};
+
 
 KeyboardDisplay::KeyboardDisplay(KeyboardSize size, int pixelWidth, int pixelHeight)
    : m_size(size), m_width(pixelWidth), m_height(pixelHeight)
 {
-}
+   // Anything that doesn't match forces the first build
+   m_layout.size = m_size;
+   m_layout.width = -1;
+   m_layout.height = -1;
+   UpdateLayout();
 
+   ResetActiveKeys();
+}
 
+KeyboardDisplay::~KeyboardDisplay()
+{
+   Renderer::ReleaseLayer(m_guide_layer);
+   Renderer::ReleaseLayer(m_key_layer);
+}
 
-void KeyboardDisplay::Draw(Renderer &renderer, const Tga *key_tex[3], const Tga *note_tex[4], int x, int y,
-                           const TranslatedNoteSet &notes, microseconds_t show_duration, microseconds_t current_time,
-                           const std::vector<Track::Properties> &track_properties)
+void KeyboardDisplay::UpdateLayout()
 {
+   if (m_layout.size == m_size && m_layout.width == m_width && m_layout.height == m_height) return;
+
    // Source: Measured from Yamaha P-70
    const static double WhiteWidthHeightRatio = 6.8181818;
    const static double BlackWidthHeightRatio = 7.9166666;
    const static double WhiteBlackWidthRatio = 0.5454545;
 
-   const int white_key_count = GetWhiteKeyCount();
+   m_layers_valid = false;
+   m_runs.source = 0;
+
+   KeyLayout &l = m_layout;
+   l.size = m_size;
+   l.width = m_width;
+   l.height = m_height;
+
+   l.white_key_count = GetWhiteKeyCount();
+   l.starting_note = GetStartingNote();
+   l.starting_octave = GetStartingOctave();
 
    // Calculate the largest white key size we can, and then
    // leave room for a single pixel space between each key
-   int white_width = (m_width / white_key_count) - 1;
-   int white_space = 1;
+   l.white_width = (m_width / l.white_key_count) - 1;
+   l.white_space = 1;
 
-   int white_height = static_cast<int>(white_width * WhiteWidthHeightRatio);
+   l.white_height = static_cast<int>(l.white_width * WhiteWidthHeightRatio);
 
-   const int black_width = static_cast<int>(white_width * WhiteBlackWidthRatio);
-   const int black_height = static_cast<int>(black_width * BlackWidthHeightRatio);
-   const int black_offset = white_width - (black_width / 2);
+   l.black_width = static_cast<int>(l.white_width * WhiteBlackWidthRatio);
+   l.black_height = static_cast<int>(l.black_width * BlackWidthHeightRatio);
+   l.black_offset = l.white_width - (l.black_width / 2);
 
    // The dimensions given to the keyboard object are bounds.  Because of pixel
    // rounding, the keyboard will usually occupy less than the maximum in
    // either direction.
    //
    // So, we just try to center the keyboard inside the bounds.
-   const int final_width = (white_width + white_space) * white_key_count;
-   const int x_offset = (m_width - final_width) / 2;
-   const int y_offset = (m_height - white_height);
+   const int final_width = (l.white_width + l.white_space) * l.white_key_count;
+   l.x_offset = (m_width - final_width) / 2;
+   l.y_offset = (m_height - l.white_height);
+   l.keyboard_width = l.white_width*l.white_key_count + l.white_space*(l.white_key_count-1);
 
    // Give the notes a little more room to work with so they can roll under
    // the keys without distortion
-   const int y_roll_under = white_height*3/4;
+   l.y_roll_under = l.white_height*3/4;
+
+   // Shiny music domain knowledge
+   const static int NotesPerOctave = 12;
+   const static int WhiteNotesPerOctave = 7;
+   const static bool IsBlackNote[12] = { false, true,  false, true,  false, false,
+                                         true,  false, true,  false, true,  false };
+
+   // The constants used in the switch below refer to the number
+   // of white keys off 'C' that type of piano starts on
+   int keyboard_type_offset = 0;
+   switch (m_size)
+   {
+   case KeyboardSize37: keyboard_type_offset = 4 - WhiteNotesPerOctave; break;
+   case KeyboardSize49: keyboard_type_offset = 0 - WhiteNotesPerOctave; break;
+   case KeyboardSize61: keyboard_type_offset = 7 - WhiteNotesPerOctave; break; // TODO!
+   case KeyboardSize76: keyboard_type_offset = 5 - WhiteNotesPerOctave; break; // TODO!
+   case KeyboardSize88: keyboard_type_offset = 2 - WhiteNotesPerOctave; break;
+   default: throw PianoGameError(Error_BadPianoType);
+   }
+
+   // This array describes how to "stack" notes in a single place.  The IsBlackNote array
+   // then tells which one should be shifted slightly to the right
+   const static int NoteToWhiteNoteOffset[12] = { 0, -1, -1, -2, -2, -2, -3, -3, -4, -4, -5, -5 };
+
+   for (int note = 0; note < 128; ++note)
+   {
+      const int octave = (note / NotesPerOctave) - l.starting_octave;
+      const int octave_base = note % NotesPerOctave;
+      const bool is_black = IsBlackNote[octave_base];
+
+      const int octave_offset = (max(octave - 1, 0) * WhiteNotesPerOctave);
+      const int inner_octave_offset = (octave_base + NoteToWhiteNoteOffset[octave_base]);
+
+      l.is_black[note] = is_black;
+      l.note_width[note] = (is_black ? l.black_width : l.white_width);
+      l.note_x[note] = (octave_offset + inner_octave_offset + keyboard_type_offset) * (l.white_width + l.white_space)
+         + (is_black ? l.black_offset : 0);
+   }
+
+   // Walk the white keys from the left end of the keyboard, placing
+   // each black key just after the white key it follows
+   const static int WhiteKeySemitones[7] = { 9, 11, 0, 2, 4, 5, 7 }; // A through G
+   l.first_key = (l.starting_octave + 1) * NotesPerOctave + WhiteKeySemitones[l.starting_note - 'A'];
+
+   int white_index = -1;
+   NoteId note = l.first_key;
+   for (; note < 128; ++note)
+   {
+      // Stop after the last white key (so there's no very last black key)
+      if (white_index + 1 == l.white_key_count) break;
+      if (!l.is_black[note]) white_index++;
+
+      l.key_x[note] = white_index * (l.white_width + l.white_space) + (l.is_black[note] ? l.black_offset : 0);
+   }
+   l.last_key = note;
+}
+
+
+
+void KeyboardDisplay::UpdateNoteRuns(const TranslatedNoteList &notes, microseconds_t show_duration)
+{
+   NoteRuns &r = m_runs;
+   if (r.source == &notes && r.show_duration == show_duration) return;
+
+   const KeyLayout &l = m_layout;
+   const double scaling_factor = static_cast<double>(max(l.y_offset, 1)) / static_cast<double>(show_duration);
+
+   // Notes are forced to be at least as tall as their crown and heel.
+   // Anything shorter than that (in microseconds at this zoom) is too
+   // short to show where it ends.
+   const NoteShape white(WhiteNoteDimensions, l.white_width + 2);
+   const NoteShape black(BlackNoteDimensions, l.black_width + 2);
+   const microseconds_t min_length[2] = { static_cast<microseconds_t>(ceil(white.min_height.up / scaling_factor)),
+                                          static_cast<microseconds_t>(ceil(black.min_height.up / scaling_factor)) };
+   r.pixel = static_cast<microseconds_t>(ceil(1.0 / scaling_factor));
+
+   r.runs.clear();
+
+   // Which run each note went into, and where each run's latest note ends
+   vector<size_t> run_of(notes.size());
+   vector<microseconds_t> last_end;
+
+   // The latest run of short notes on each key and track
+   typedef map<pair<NoteId, size_t>, size_t> OpenRunMap;
+   OpenRunMap open;
+
+   for (size_t n = 0; n < notes.size(); ++n)
+   {
+      const TranslatedNote &note = notes[n];
+      const bool short_note = (note.note_id < 128 && note.end - note.start < min_length[l.is_black[note.note_id] ? 1 : 0]);
+
+      const pair<NoteId, size_t> key(note.note_id, note.track_id);
+      OpenRunMap::iterator o = open.find(key);
+
+      // A short note starting within a pixel of where the one before it
+      // ended has no boundary left to see.  Each note only has to touch
+      // the one before it, so any stretch of a run is in one piece too.
+      if (short_note && o != open.end() && note.start <= last_end[o->second] + r.pixel)
+      {
+         const size_t run = o->second;
+         r.runs[run].end = max(r.runs[run].end, note.end);
+         last_end[run] = note.end;
+
+         run_of[n] = run;
+         continue;
+      }
+
+      // The list is sorted by start time, so the runs will be too
+      run_of[n] = r.runs.size();
+      if (short_note) open[key] = r.runs.size();
+      else if (o != open.end()) open.erase(o);
+
+      r.runs.push_back(note);
+      last_end.push_back(note.end);
+   }
+
+   // Count each run's notes, then lay them out back to back
+   r.first_member.assign(r.runs.size() + 1, 0);
+   for (size_t n = 0; n < notes.size(); ++n) r.first_member[run_of[n] + 1]++;
+   for (size_t i = 1; i < r.first_member.size(); ++i) r.first_member[i] += r.first_member[i - 1];
+
+   vector<size_t> next(r.first_member.begin(), r.first_member.end() - 1);
+   r.members.resize(notes.size());
+   for (size_t n = 0; n < notes.size(); ++n) r.members[next[run_of[n]]++] = n;
+
+   // Walk each run backward so every member knows how far the rest reaches
+   r.later_end.resize(notes.size());
+   for (size_t run = 0; run < r.runs.size(); ++run)
+   {
+      microseconds_t end = r.runs[run].start;
+      for (size_t i = r.first_member[run + 1]; i > r.first_member[run]; --i)
+      {
+         end = max(end, notes[r.members[i - 1]].end);
+         r.later_end[i - 1] = end;
+      }
+   }
+
+   r.index.Build(r.runs);
+
+   r.source = &notes;
+   r.show_duration = show_duration;
+
+   // The index was rebuilt in place, so the window has to start over
+   m_visible_runs.Reset();
+}
+
+void KeyboardDisplay::Draw(Renderer &renderer, const Tga *key_tex[3], const Tga *note_tex[4], int x, int y,
+                           const TranslatedNoteList &notes, const NoteStateList &note_states, const TranslatedNoteIndex &note_index,
+                           size_t states_begin, size_t states_end, microseconds_t show_duration, microseconds_t current_time,
+                           const std::vector<Track::Properties> &track_properties)
+{
+   UpdateLayout();
+   const KeyLayout &l = m_layout;
+
+   const int white_key_count = l.white_key_count;
+   const int white_width = l.white_width;
+   const int white_space = l.white_space;
+   const int white_height = l.white_height;
+   const int x_offset = l.x_offset;
+   const int y_offset = l.y_offset;
+   const int y_roll_under = l.y_roll_under;
+
+   // Anything that finished before rolling under the keys (or that hasn't
+   // dropped in from the top yet) can't be seen
+   const microseconds_t roll_under_time = show_duration * y_roll_under / max(y_offset, 1);
+
+   const double scaling_factor = static_cast<double>(y_offset) / static_cast<double>(show_duration);
+   const microseconds_t roll_under = static_cast<int>(y_roll_under / scaling_factor);
+
+   m_note_batches[0].Clear();
+   m_note_batches[1].Clear();
+
+   // Zoomed out, short notes that run together are drawn as runs
+   if (show_duration >= RunShowDuration)
+   {
+      UpdateNoteRuns(notes, show_duration);
+      m_visible_runs.Advance(m_runs.index, current_time - roll_under_time, current_time + show_duration + 1);
+      QueueRuns(x + x_offset, notes, note_states, states_begin, states_end, m_visible_runs.Notes(), current_time, roll_under, track_properties);
+   }
+   else
+   {
+      // Zoomed in, every note is far enough apart to be drawn on its own
+      m_visible_notes.Advance(note_index, current_time - roll_under_time, current_time + show_duration + 1);
+      QueueNotes(x + x_offset, notes, note_states, m_visible_notes.Notes(), current_time, roll_under, track_properties);
+   }
 
    // Symbolic names for the arbitrary array passed in here
    enum { Rail, Shadow, BlackKey };
 
-   DrawGuides(renderer, white_key_count, white_width, white_space, x + x_offset, y, y_offset);
+   const Color white = Renderer::ToColor(255, 255, 255);
+
+   // The guides can reach a couple pixels past either side of the keyboard
+   const static int GuideOverhang = 2;
+   const int guide_x = x + x_offset - GuideOverhang;
+   const int guide_width = l.keyboard_width + GuideOverhang*2;
+   const int guide_height = y_offset - PixelsOffKeyboard;
 
-   // Do two passes on the notes, the first for note shadows and the second
-   // for the note blocks themselves.  This is to avoid shadows being drawn
-   // on top of notes.
-   renderer.SetColor(Renderer::ToColor(255, 255, 255));
-   DrawNotePass(renderer, note_tex[0], note_tex[1], white_width, white_space, black_width, black_offset, x + x_offset, y, y_offset, y_roll_under, notes, show_duration, current_time, track_properties);
-   DrawNotePass(renderer, note_tex[2], note_tex[3], white_width, white_space, black_width, black_offset, x + x_offset, y, y_offset, y_roll_under, notes, show_duration, current_time, track_properties);
+   if (m_layers_valid)
+   {
+      renderer.SetColor(white);
+      renderer.DrawLayer(m_guide_layer, guide_x, y);
+   }
+   else
+   {
+      DrawGuides(renderer, white_key_count, white_width, white_space, x + x_offset, y, y_offset);
+      renderer.CaptureLayer(m_guide_layer, guide_x, y, guide_width, guide_height);
+   }
+
+   renderer.SetColor(white);
+   DrawNotes(renderer, note_tex, y, show_duration);
+
+   const int ActualKeyboardWidth = l.keyboard_width;
+
+   if (m_layers_valid)
+   {
+      renderer.SetColor(white);
+      renderer.DrawLayer(m_key_layer, x + x_offset, y+y_offset);
+   }
+   else
+   {
+      // Black out the background of where the keys are about to appear
+      renderer.SetColor(Renderer::ToColor(0, 0, 0));
+      renderer.DrawQuad(x + x_offset, y+y_offset, ActualKeyboardWidth, white_height);
 
-   const int ActualKeyboardWidth = white_width*white_key_count + white_space*(white_key_count-1);
+      DrawWhiteKeys(renderer, KeysUnlit, x+x_offset, y+y_offset);
+      DrawBlackKeys(renderer, key_tex[BlackKey], KeysUnlit, x+x_offset, y+y_offset);
+      renderer.CaptureLayer(m_key_layer, x + x_offset, y+y_offset, ActualKeyboardWidth, white_height);
 
-   // Black out the background of where the keys are about to appear
-   renderer.SetColor(Renderer::ToColor(0, 0, 0));
-   renderer.DrawQuad(x + x_offset, y+y_offset, ActualKeyboardWidth, white_height);
+      m_layers_valid = true;
+   }
 
+   // Pressed keys go on top of the unlit ones
    DrawShadow(renderer, key_tex[Shadow], x+x_offset, y+y_offset+white_height - 10, ActualKeyboardWidth);
-   DrawWhiteKeys(renderer, false, white_key_count, white_width, white_height, white_space, x+x_offset, y+y_offset);
-   DrawBlackKeys(renderer, key_tex[BlackKey], false, white_key_count, white_width, black_width, black_height, white_space, x+x_offset, y+y_offset, black_offset);
+   DrawWhiteKeys(renderer, KeysLit, x+x_offset, y+y_offset);
+   DrawBlackKeys(renderer, key_tex[BlackKey], KeysLit, x+x_offset, y+y_offset);
    DrawShadow(renderer, key_tex[Shadow], x+x_offset, y+y_offset, ActualKeyboardWidth);
    DrawRail(renderer, key_tex[Rail], x+x_offset, y+y_offset, ActualKeyboardWidth);
 
@@ -160,35 +477,23 @@ int KeyboardDisplay::GetWhiteKeyCount() const
    }
 }
 
-void KeyboardDisplay::DrawWhiteKeys(Renderer &renderer, bool active_only, int key_count, int key_width, int key_height,
-   int key_space, int x_offset, int y_offset) const
+void KeyboardDisplay::DrawWhiteKeys(Renderer &renderer, KeyDrawMode mode, int x_offset, int y_offset) const
 {
+   const KeyLayout &l = m_layout;
    Color white = Renderer::ToColor(255, 255, 255);
 
-   char current_white = GetStartingNote();
-   int current_octave = GetStartingOctave() + 1;
-   for (int i = 0; i < key_count; ++i)
+   for (NoteId note = l.first_key; note < l.last_key; ++note)
    {
-      // Check to see if this is one of the active notes
-      const string note_name = STRING(current_white << current_octave);
+      if (l.is_black[note]) continue;
 
-      KeyNames::const_iterator find_result = m_active_keys.find(note_name);
-      bool active = (find_result != m_active_keys.end());
+      const bool active = (mode == KeysLit && m_keys[note].active);
+      if (mode == KeysLit && !active) continue;
 
       Color c = white;
-      if (active) c = Track::ColorNoteWhite[find_result->second];
+      if (active) c = Track::ColorNoteWhite[m_keys[note].color];
 
-      if ((active_only && active) || !active_only)
-      {
-         renderer.SetColor(c);
-
-         const int key_x = i * (key_width + key_space) + x_offset;
-         renderer.DrawQuad(key_x, y_offset, key_width, key_height);
-      }
-
-      current_white++;
-      if (current_white == 'H') current_white = 'A';
-      if (current_white == 'C') current_octave++;
+      renderer.SetColor(c);
+      renderer.DrawQuad(l.key_x[note] + x_offset, y_offset, l.white_width, l.white_height);
    }
    
    renderer.SetColor(white);
@@ -219,47 +524,27 @@ void KeyboardDisplay::DrawBlackKey(Renderer &renderer, const Tga *tex, const Key
    renderer.DrawStretchedTga(tex, dest_x, dest_y, dest_w, dest_h, src_x, 0, d.tex_width, d.tex_height);
 }
 
-void KeyboardDisplay::DrawBlackKeys(Renderer &renderer, const Tga *tex, bool active_only, int white_key_count, int white_width,
-   int black_width, int black_height, int key_space, int x_offset, int y_offset, int black_offset) const
+void KeyboardDisplay::DrawBlackKeys(Renderer &renderer, const Tga *tex, KeyDrawMode mode, int x_offset, int y_offset) const
 {
-   char current_white = GetStartingNote();
-   int current_octave = GetStartingOctave() + 1;
-   for (int i = 0; i < white_key_count; ++i)
-   {
-      // Don't allow a very last black key
-      if (i == white_key_count - 1) break;
+   const KeyLayout &l = m_layout;
 
-      switch (current_white)
-      {
-      case 'A':
-      case 'C':
-      case 'D':
-      case 'F':
-      case 'G':
-         {
-            // Check to see if this is one of the active notes
-            const string note_name = STRING(current_white << '#' << current_octave);
+   for (NoteId note = l.first_key; note < l.last_key; ++note)
+   {
+      if (!l.is_black[note]) continue;
 
-            KeyNames::const_iterator find_result = m_active_keys.find(note_name);
-            bool active = (find_result != m_active_keys.end());
+      const bool active = (mode == KeysLit && m_keys[note].active);
 
-            // In this case, MissedNote isn't actually MissedNote.  In the black key
-            // texture we use this value (which doesn't make any sense in this context)
-            // as the default "Black" color.
-            Track::TrackColor c = Track::MissedNote;
-            if (active) c = find_result->second;
+      // A pressed white key is drawn over the edges of its neighbors
+      const bool covered = (mode == KeysLit && (m_keys[note - 1].active || (note + 1 < 128 && m_keys[note + 1].active)));
+      if (mode == KeysLit && !active && !covered) continue;
 
-            if (!active_only || (active_only && active))
-            {
-               const int start_x = i * (white_width + key_space) + x_offset + black_offset;
-               DrawBlackKey(renderer, tex, BlackKeyDimensions, start_x, y_offset, black_width, black_height, c);
-            }
-         }
-      }
+      // In this case, MissedNote isn't actually MissedNote.  In the black key
+      // texture we use this value (which doesn't make any sense in this context)
+      // as the default "Black" color.
+      Track::TrackColor c = Track::MissedNote;
+      if (active) c = m_keys[note].color;
 
-      current_white++;
-      if (current_white == 'H') current_white = 'A';
-      if (current_white == 'C') current_octave++;
+      DrawBlackKey(renderer, tex, BlackKeyDimensions, l.key_x[note] + x_offset, y_offset, l.black_width, l.black_height, c);
    }
 }
 
@@ -283,7 +568,6 @@ void KeyboardDisplay::DrawShadow(Renderer &renderer, const Tga *tex, int x, int
 void KeyboardDisplay::DrawGuides(Renderer &renderer, int key_count, int key_width, int key_space,
                                  int x_offset, int y, int y_offset) const
 {
-   const static int PixelsOffKeyboard = 2;
    int keyboard_width = key_width*key_count + key_space*(key_count-1);
 
    // Fill the background of the note-falling area
@@ -296,8 +580,8 @@ void KeyboardDisplay::DrawGuides(Renderer &renderer, int key_count, int key_widt
    const Color thick(Renderer::ToColor(0x48,0x48,0x48));
    const Color thin(Renderer::ToColor(0x50,0x50,0x50));
 
-   char current_white = GetStartingNote() - 1;
-   int current_octave = GetStartingOctave() + 1;
+   char current_white = m_layout.starting_note - 1;
+   int current_octave = m_layout.starting_octave + 1;
    for (int i = 0; i < key_count + 1; ++i)
    {
       const int key_x = i * (key_width + key_space) + x_offset - 1;
@@ -337,150 +621,356 @@ void KeyboardDisplay::DrawGuides(Renderer &renderer, int key_count, int key_widt
    }
 }
 
-void KeyboardDisplay::DrawNote(Renderer &renderer, const Tga *tex, const NoteTexDimensions &tex_dimensions, int x, int y, int w, int h, int color_id) const
+void KeyboardDisplay::NoteBatch::Clear()
 {
-   const NoteTexDimensions &d = tex_dimensions;
+   start.clear();
+   end.clear();
+   min_height.clear();
+   left.clear();
+   brush.clear();
+}
 
-   // Width is super-easy
-   const int tex_note_w = d.right - d.left;
+void KeyboardDisplay::QueueNote(NoteBatch &batch, microseconds_t start, microseconds_t end, int left, int brush,
+                                microseconds_t current_time, microseconds_t roll_under)
+{
+   const static int MinNoteHeight = 3;
 
-   const double width_scale = double(w) / double(tex_note_w);
-   const double full_tex_width = d.tex_width * width_scale;
-   const double left_offset = d.left * width_scale;
+   const microseconds_t adjusted_start = max(start - current_time, -roll_under);
+   const microseconds_t adjusted_end   = max(end   - current_time, 0LL);
+   if (adjusted_end < adjusted_start) return;
+
+   // Force a note to be a minimum height at all times
+   // except when scrolling off underneath the keyboard and
+   // coming in from the top of the screen.
+   const bool hitting_bottom = (adjusted_start + current_time != start);
+   const bool hitting_top    = (adjusted_end   + current_time != end);
+
+   batch.start.push_back(static_cast<int>(min(adjusted_start, MaxNoteMicroseconds)));
+   batch.end.push_back(static_cast<int>(min(adjusted_end, MaxNoteMicroseconds)));
+   batch.min_height.push_back(hitting_bottom || hitting_top ? 0 : MinNoteHeight);
+   batch.left.push_back(left);
+   batch.brush.push_back(brush);
+}
 
-   const int src_x = (color_id * d.tex_width);
-   const int dest_x = int(x - left_offset);
-   const int dest_w = int(full_tex_width);
+#ifdef NOTES_SSE2
 
-   // Now we draw the note in three sections:
-   // - Crown (fixed (relative) height)
-   // - Middle (variable height)
-   // - Heel (fixed (relative) height)
+static __m128i Select(__m128i mask, __m128i if_set, __m128i if_clear)
+{
+   return _mm_or_si128(_mm_and_si128(mask, if_set), _mm_andnot_si128(mask, if_clear));
+}
+
+static __m128i Max(__m128i a, __m128i b)
+{
+   return Select(_mm_cmpgt_epi32(a, b), a, b);
+}
+
+// int(time * scale) for four times.  Still done in doubles (two at a
+// time) so the results match the plain version exactly.
+static __m128i ScaleTimes(__m128i times, __m128d scale)
+{
+   const __m128i high_times = _mm_shuffle_epi32(times, _MM_SHUFFLE(1, 0, 3, 2));
+
+   const __m128i low = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(times), scale));
+   const __m128i high = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(high_times), scale));
+
+   return _mm_unpacklo_epi64(low, high);
+}
+
+static __m128i TruncateSub(__m128i y, const Offset &offset)
+{
+   const __m128i up = _mm_set1_epi32(offset.up);
+   return _mm_sub_epi32(y, Select(_mm_cmplt_epi32(y, up), _mm_set1_epi32(offset.down), up));
+}
+
+static __m128i TruncateAdd(__m128i y, const Offset &offset)
+{
+   const __m128i down = _mm_set1_epi32(offset.down);
+   return _mm_add_epi32(y, Select(_mm_cmplt_epi32(y, _mm_set1_epi32(-offset.down)), _mm_set1_epi32(offset.up), down));
+}
+
+#endif
+
+void KeyboardDisplay::FindNoteRows(NoteBatch &batch, const NoteShape &shape, int base_y, double scaling_factor)
+{
+   const size_t count = batch.start.size();
+   for (int r = 0; r < 4; ++r) batch.rows[r].resize(count);
 
-   // Force the note to be at least as large as the crown + heel height
-   const double crown_h = (d.crown_end - d.crown_start) * width_scale;
-   const double heel_h = (d.heel_end - d.heel_start) * width_scale;
-   const double min_height = crown_h + heel_h + 1.0;
-   if (h < min_height)
+   size_t i = 0;
+
+#ifdef NOTES_SSE2
+   if (HasSse2)
    {
-      const int diff = int(min_height - h);
-      h += diff;
-      y -= diff;
+      const __m128d scale = _mm_set1_pd(scaling_factor);
+      const __m128i base = _mm_set1_epi32(base_y);
+      const __m128i min_up = _mm_set1_epi32(shape.min_height.up);
+      const __m128i min_down = _mm_set1_epi32(shape.min_height.down);
+
+      for (; i + 4 <= count; i += 4)
+      {
+         const __m128i start = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&batch.start[i]));
+         const __m128i end = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&batch.end[i]));
+         const __m128i min_height = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&batch.min_height[i]));
+
+         const __m128i y_end = _mm_sub_epi32(base, ScaleTimes(start, scale));
+         const __m128i y_start = _mm_sub_epi32(base, ScaleTimes(end, scale));
+
+         __m128i height = Max(_mm_sub_epi32(y_end, y_start), min_height);
+         __m128i top = y_start;
+
+         // Anything shorter than its crown and heel grows upward
+         const __m128i too_short = _mm_cmplt_epi32(height, min_up);
+         top = _mm_sub_epi32(top, _mm_and_si128(too_short, _mm_sub_epi32(min_down, height)));
+         height = Select(too_short, min_down, height);
+
+         const __m128i crown = TruncateSub(top, shape.crown_start);
+         const __m128i heel = TruncateSub(_mm_add_epi32(top, height), shape.heel);
+
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(&batch.rows[0][i]), crown);
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(&batch.rows[1][i]), TruncateAdd(crown, shape.crown_end));
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(&batch.rows[2][i]), heel);
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(&batch.rows[3][i]), TruncateAdd(heel, shape.bottom));
+      }
    }
+#endif
 
-   // We actually use the width scale in height calculations
-   // to keep the proportions fixed.
-   const double crown_start_offset = d.crown_start * width_scale;
-   const double crown_end_offset = d.crown_end * width_scale;
-   const double heel_height = double(d.heel_end - d.heel_start) * width_scale;
-   const double bottom_height = double(d.tex_height - d.heel_end) * width_scale;
+   for (; i < count; ++i)
+   {
+      const int y_end = base_y - static_cast<int>(batch.start[i] * scaling_factor);
+      const int y_start = base_y - static_cast<int>(batch.end[i] * scaling_factor);
+
+      int height = max(y_end - y_start, batch.min_height[i]);
+      int top = y_start;
 
-   const int dest_y1 = int(y - crown_start_offset);
-   const int dest_y2 = int(dest_y1 + crown_end_offset);
-   const int dest_y3 = int((y+h) - heel_height);
-   const int dest_y4 = int(dest_y3 + bottom_height);
+      if (height < shape.min_height.up)
+      {
+         top -= shape.min_height.down - height;
+         height = shape.min_height.down;
+      }
 
-   renderer.DrawStretchedTga(tex, dest_x, dest_y1, dest_w, dest_y2 - dest_y1, src_x, 0, d.tex_width, d.crown_end);
-   renderer.DrawStretchedTga(tex, dest_x, dest_y2, dest_w, dest_y3 - dest_y2, src_x, d.crown_end, d.tex_width, d.heel_start - d.crown_end);
-   renderer.DrawStretchedTga(tex, dest_x, dest_y3, dest_w, dest_y4 - dest_y3, src_x, d.heel_start, d.tex_width, d.tex_height - d.heel_start);
+      batch.rows[0][i] = TruncateSub(top, shape.crown_start);
+      batch.rows[1][i] = TruncateAdd(batch.rows[0][i], shape.crown_end);
+      batch.rows[2][i] = TruncateSub(top + height, shape.heel);
+      batch.rows[3][i] = TruncateAdd(batch.rows[2][i], shape.bottom);
+   }
 }
 
+void KeyboardDisplay::QueueNotes(int x_offset, const TranslatedNoteList &notes, const NoteStateList &note_states,
+   const vector<size_t> &visible_notes, microseconds_t current_time, microseconds_t roll_under,
+   const std::vector<Track::Properties> &track_properties)
+{
+   const KeyLayout &l = m_layout;
+
+   for (vector<size_t>::const_iterator v = visible_notes.begin(); v != visible_notes.end(); ++v)
+   {
+      const size_t n = *v;
+      const TranslatedNote &note = notes[n];
+
+      if (note_states[n] == Retired) continue;
+
+      const Track::Mode mode = track_properties[note.track_id].mode;
+      if (mode == Track::ModeNotPlayed) continue;
+      if (mode == Track::ModePlayedButHidden) continue;
+
+      if (note.note_id >= 128) continue;
 
-void KeyboardDisplay::DrawNotePass(Renderer &renderer, const Tga *tex_white, const Tga *tex_black, int white_width,
-   int key_space, int black_width, int black_offset, int x_offset, int y, int y_offset, int y_roll_under, 
-   const TranslatedNoteSet &notes, microseconds_t show_duration, microseconds_t current_time,
-   const std::vector<Track::Properties> &track_properties) const
+      const Track::TrackColor color = track_properties[note.track_id].color;
+      QueueNote(m_note_batches[l.is_black[note.note_id] ? 1 : 0], note.start, note.end, l.note_x[note.note_id] + x_offset - 1,
+         note_states[n] == UserMissed ? Track::MissedNote : color, current_time, roll_under);
+   }
+}
+
+void KeyboardDisplay::QueueRuns(int x_offset, const TranslatedNoteList &notes, const NoteStateList &note_states,
+   size_t states_begin, size_t states_end, const vector<size_t> &visible_runs,
+   microseconds_t current_time, microseconds_t roll_under,
+   const std::vector<Track::Properties> &track_properties)
 {
-   // Shiny music domain knowledge
-   const static unsigned int NotesPerOctave = 12;
-   const static unsigned int WhiteNotesPerOctave = 7;
-   const static bool IsBlackNote[12] = { false, true,  false, true,  false, false,
-                                         true,  false, true,  false, true,  false };
+   const KeyLayout &l = m_layout;
+   const vector<size_t> &members = m_runs.members;
 
-   // The constants used in the switch below refer to the number
-   // of white keys off 'C' that type of piano starts on
-   int keyboard_type_offset = 0;
-   switch (m_size)
+   for (vector<size_t>::const_iterator v = visible_runs.begin(); v != visible_runs.end(); ++v)
    {
-   case KeyboardSize37: keyboard_type_offset = 4 - WhiteNotesPerOctave; break;
-   case KeyboardSize49: keyboard_type_offset = 0 - WhiteNotesPerOctave; break;
-   case KeyboardSize61: keyboard_type_offset = 7 - WhiteNotesPerOctave; break; // TODO!
-   case KeyboardSize76: keyboard_type_offset = 5 - WhiteNotesPerOctave; break; // TODO!
-   case KeyboardSize88: keyboard_type_offset = 2 - WhiteNotesPerOctave; break;
-   default: throw PianoGameError(Error_BadPianoType);
+      const size_t r = *v;
+      const TranslatedNote &run = m_runs.runs[r];
+
+      const Track::Mode mode = track_properties[run.track_id].mode;
+      if (mode == Track::ModeNotPlayed) continue;
+      if (mode == Track::ModePlayedButHidden) continue;
+
+      if (run.note_id >= 128) continue;
+
+      NoteBatch &batch = m_note_batches[l.is_black[run.note_id] ? 1 : 0];
+      const int left = l.note_x[run.note_id] + x_offset - 1;
+      const Track::TrackColor color = track_properties[run.track_id].color;
+
+      const size_t first = m_runs.first_member[r];
+      const size_t last = m_runs.first_member[r + 1];
+
+      // Nothing in the run has been played, missed, or retired yet
+      if (members[first] >= states_end)
+      {
+         QueueNote(batch, run.start, run.end, left, color, current_time, roll_under);
+         continue;
+      }
+
+      // Everything in the run has retired
+      if (members[last - 1] < states_begin) continue;
+
+      // Retired notes drop out of the run and missed notes change color,
+      // so the notes that might have changed are joined back together the
+      // same way the run was built.  The notes after them are untouched
+      // and stay in one piece.
+      const size_t live_begin = lower_bound(members.begin() + first, members.begin() + last, states_begin) - members.begin();
+      const size_t live_end = lower_bound(members.begin() + live_begin, members.begin() + last, states_end) - members.begin();
+
+      bool joining = false;
+      microseconds_t start = 0;
+      microseconds_t end = 0;
+      int brush = 0;
+
+      for (size_t m = live_begin; m < live_end; ++m)
+      {
+         const size_t n = members[m];
+         if (note_states[n] == Retired) continue;
+
+         const TranslatedNote &note = notes[n];
+         const int note_brush = (note_states[n] == UserMissed ? Track::MissedNote : color);
+
+         if (joining && note_brush == brush && note.start <= end + m_runs.pixel)
+         {
+            end = max(end, note.end);
+            continue;
+         }
+
+         if (joining) QueueNote(batch, start, end, left, brush, current_time, roll_under);
+
+         joining = true;
+         start = note.start;
+         end = note.end;
+         brush = note_brush;
+      }
+
+      if (live_end < last)
+      {
+         const TranslatedNote &note = notes[members[live_end]];
+         if (joining && brush == color && note.start <= end + m_runs.pixel)
+         {
+            end = max(end, m_runs.later_end[live_end]);
+         }
+         else
+         {
+            if (joining) QueueNote(batch, start, end, left, brush, current_time, roll_under);
+
+            joining = true;
+            start = note.start;
+            end = m_runs.later_end[live_end];
+            brush = color;
+         }
+      }
+
+      if (joining) QueueNote(batch, start, end, left, brush, current_time, roll_under);
    }
+}
 
-   // This array describes how to "stack" notes in a single place.  The IsBlackNote array
-   // then tells which one should be shifted slightly to the right
-   const static int NoteToWhiteNoteOffset[12] = { 0, -1, -1, -2, -2, -2, -3, -3, -4, -4, -5, -5 };
+void KeyboardDisplay::DrawNotes(Renderer &renderer, const Tga *note_tex[4], int y, microseconds_t show_duration)
+{
+   const KeyLayout &l = m_layout;
+   const int y_offset = l.y_offset;
 
-   const static int MinNoteHeight = 3;
+   const double scaling_factor = static_cast<double>(y_offset) / static_cast<double>(show_duration);
+
+   enum { White, Black };
+
+   // Every note of a kind is the same width
+   const NoteShape shapes[2] = { NoteShape(WhiteNoteDimensions, l.white_width + 2), NoteShape(BlackNoteDimensions, l.black_width + 2) };
 
-   bool drawing_black = false;
-   for (int toggle = 0; toggle < 2; ++toggle)
+   for (int i = 0; i < 4; ++i) m_note_quads[i].clear();
+
+   for (int kind = White; kind <= Black; ++kind)
    {
-      for (TranslatedNoteSet::const_iterator i = notes.begin(); i != notes.end(); ++i)
+      NoteBatch &batch = m_note_batches[kind];
+      const NoteShape &shape = shapes[kind];
+      const NoteTexDimensions &d = (kind == Black ? BlackNoteDimensions : WhiteNoteDimensions);
+
+      FindNoteRows(batch, shape, y + y_offset, scaling_factor);
+
+      // Each brush is a column of the texture, cut into its crown,
+      // middle, and heel.  The shadow (layer 0) and color (layer 1)
+      // textures are laid out the same way.
+      const int section_rows[4] = { 0, d.crown_end, d.heel_start, d.tex_height };
+
+      TexturedQuad sections[2][Track::ColorCount][3];
+      for (int layer = 0; layer < 2; ++layer)
       {
-         // This list is sorted by note start time.  The moment we encounter
-         // a note scrolled off the window, we're done drawing
-         if (i->start > current_time + show_duration) break;
-
-         const Track::Mode mode = track_properties[i->track_id].mode;
-         if (mode == Track::ModeNotPlayed) continue;
-         if (mode == Track::ModePlayedButHidden) continue;
-
-         const int octave = (i->note_id / NotesPerOctave) - GetStartingOctave();
-         const int octave_base = i->note_id % NotesPerOctave;
-         const int stack_offset = NoteToWhiteNoteOffset[octave_base];
-         const bool is_black = IsBlackNote[octave_base];
-
-         if (drawing_black != is_black) continue;
-
-         const int octave_offset = (max(octave - 1, 0) * WhiteNotesPerOctave);
-         const int inner_octave_offset = (octave_base + stack_offset);
-         const int generalized_black_offset = (is_black?black_offset:0);
-
-         const double scaling_factor = static_cast<double>(y_offset) / static_cast<double>(show_duration);
-
-         const long long roll_under = static_cast<int>(y_roll_under / scaling_factor);
-         const long long adjusted_start = max(i->start - current_time, -roll_under);
-         const long long adjusted_end   = max(i->end   - current_time, 0LL);
-         if (adjusted_end < adjusted_start) continue;
-
-         // Convert our times to pixel coordinates
-         const int y_end   = y - static_cast<int>(adjusted_start * scaling_factor) + y_offset;
-         const int y_start = y - static_cast<int>(adjusted_end   * scaling_factor) + y_offset;
-
-         const int start_x = (octave_offset + inner_octave_offset + keyboard_type_offset) * (white_width + key_space)
-            + generalized_black_offset + x_offset;
-
-         const int left = start_x - 1;
-         const int top = y_start;
-         const int width = (is_black?black_width:white_width) + 2;
-         int height = y_end - y_start;
-
-         // Force a note to be a minimum height at all times
-         // except when scrolling off underneath the keyboard and
-         // coming in from the top of the screen.
-         const bool hitting_bottom = (adjusted_start + current_time != i->start);
-         const bool hitting_top    = (adjusted_end   + current_time != i->end);
-         if (!hitting_bottom && !hitting_top)
+         const Tga *tex = note_tex[layer*2 + kind];
+         for (int brush = 0; brush < Track::ColorCount; ++brush)
          {
-            while ( (height) < MinNoteHeight) height++;
+            for (int s = 0; s < 3; ++s)
+            {
+               TexturedQuad &q = sections[layer][brush][s];
+               tex->TexCoords(brush * d.tex_width, section_rows[s], d.tex_width, section_rows[s+1] - section_rows[s], &q.tx, &q.ty, &q.tw, &q.th);
+            }
          }
+      }
+
+      for (size_t i = 0; i < batch.start.size(); ++i)
+      {
+         const int x = TruncateSub(batch.left[i], shape.left);
 
-         const Track::TrackColor color = track_properties[i->track_id].color;
-         const int &brush_id = (i->state == UserMissed ? Track::MissedNote : color);
+         for (int layer = 0; layer < 2; ++layer)
+         {
+            QuadList &quads = m_note_quads[layer*2 + kind];
+            for (int s = 0; s < 3; ++s)
+            {
+               TexturedQuad q = sections[layer][batch.brush[i]][s];
+               q.x = x;
+               q.y = batch.rows[s][i];
+               q.w = shape.width;
+               q.h = batch.rows[s+1][i] - batch.rows[s][i];
 
-         DrawNote(renderer, (drawing_black ? tex_black : tex_white), (drawing_black ? BlackNoteDimensions : WhiteNoteDimensions), left, top, width, height, brush_id);
+               quads.push_back(q);
+            }
+         }
       }
+   }
 
-      drawing_black = !drawing_black;
+   for (int i = 0; i < 4; ++i) renderer.DrawQuads(note_tex[i]->GetId(), m_note_quads[i]);
+}
+
+void KeyboardDisplay::SetKeyActive(NoteId note, bool active, Track::TrackColor color)
+{
+   if (note >= 128) return;
+
+   m_keys[note].active = active;
+   m_keys[note].color = color;
+}
+
+void KeyboardDisplay::ResetActiveKeys()
+{
+   for (NoteId note = 0; note < 128; ++note)
+   {
+      m_keys[note].active = false;
+      m_keys[note].color = Track::FlatGray;
    }
 }
 
-void KeyboardDisplay::SetKeyActive(const string &key_name, bool active, Track::TrackColor color)
+void KeyboardDisplay::SetKeys(const KeyStates &keys)
 {
-   if (active) m_active_keys[key_name] = color;
-   else m_active_keys.erase(key_name);
+   for (NoteId note = 0; note < 128; ++note) SetKeyActive(note, keys.active[note], keys.color[note]);
+}
+
+void KeyStates::Reset()
+{
+   for (NoteId note = 0; note < 128; ++note)
+   {
+      active[note] = false;
+      color[note] = Track::FlatGray;
+   }
+}
+
+void KeyStates::Set(NoteId note, bool is_active, Track::TrackColor key_color)
+{
+   if (note >= 128) return;
+
+   active[note] = is_active;
+   color[note] = key_color;
 }
@@ -5,14 +5,13 @@
 #ifndef __KEYBOARDDISPLAY_H
 #define __KEYBOARDDISPLAY_H
 
-#include <map>
 #include <vector>
-#include <string>
 
 #include "TrackTile.h"
 #include "TrackProperties.h"
 
 #include "libmidi/Note.h"
+#include "libmidi/NoteIndex.h"
 #include "libmidi/MidiTypes.h"
 
 enum KeyboardSize
@@ -25,25 +24,54 @@ enum KeyboardSize
 };
 
 
-typedef std::map<std::string, Track::TrackColor> KeyNames;
+#include "Renderer.h"
 
-class Renderer;
 class Tga;
 
+// Which keys are lit (and in what color), kept apart from any
+// KeyboardDisplay so they can be changed on one thread and drawn on
+// another.  (See PlayingState.)
+struct KeyStates
+{
+   KeyStates() { Reset(); }
+
+   void Reset();
+
+   // Notes outside the 128 MIDI notes are ignored
+   void Set(NoteId note, bool active, Track::TrackColor color);
+
+   bool active[128];
+   Track::TrackColor color[128];
+};
+
 class KeyboardDisplay
 {
 public:
    const static microseconds_t NoteWindowLength = 330000;
 
+   // Zoomed out at least this far, runs of short notes on one key are
+   // drawn as a single note (see NoteRuns)
+   const static microseconds_t RunShowDuration = 5000000;
+
    KeyboardDisplay(KeyboardSize size, int pixelWidth, int pixelHeight);
+   ~KeyboardDisplay();
 
+   // Only notes the index finds on screen are considered.  Notes
+   // marked Retired in note_states are skipped.  Every note before
+   // states_begin must be Retired, and every note from states_end on must
+   // still be in the state it started the song in.
    void Draw(Renderer &renderer, const Tga *key_tex[3], const Tga *note_tex[4], int x, int y,
-      const TranslatedNoteSet &notes, microseconds_t show_duration, microseconds_t current_time,
+      const TranslatedNoteList &notes, const NoteStateList &note_states, const TranslatedNoteIndex &note_index,
+      size_t states_begin, size_t states_end, microseconds_t show_duration, microseconds_t current_time,
       const std::vector<Track::Properties> &track_properties);
 
-   void SetKeyActive(const std::string &key_name, bool active, Track::TrackColor color);
+   // Notes outside the 128 MIDI notes (e.g. after octave sliding) are ignored
+   void SetKeyActive(NoteId note, bool active, Track::TrackColor color);
+
+   void ResetActiveKeys();
 
-   void ResetActiveKeys() { m_active_keys.clear(); }
+   // Lights (or unlights) every key to match
+   void SetKeys(const KeyStates &keys);
 
 private:
 
@@ -77,12 +105,98 @@ private:
    };
    const static KeyTexDimensions BlackKeyDimensions;
 
+   // Everything about where keys and notes go that only depends on the
+   // keyboard size and the pixel dimensions.  Rebuilt only when one of
+   // those changes instead of every frame.
+   struct KeyLayout
+   {
+      // What this layout was built for
+      KeyboardSize size;
+      int width;
+      int height;
+
+      int white_key_count;
+      char starting_note;
+      int starting_octave;
+
+      int white_width;
+      int white_space;
+      int white_height;
+
+      int black_width;
+      int black_height;
+      int black_offset;
+
+      // Where the keyboard sits inside the bounds, and how wide it is
+      int x_offset;
+      int y_offset;
+      int keyboard_width;
+
+      // How far notes may roll under the keys
+      int y_roll_under;
+
+      // Per MIDI note: the left edge (relative to x_offset) and width of
+      // its key and of the notes that fall onto it
+      int note_x[128];
+      int note_width[128];
+      bool is_black[128];
+
+      // The notes in [first_key, last_key) have a key on this keyboard,
+      // with its left edge (relative to x_offset) at key_x
+      NoteId first_key;
+      NoteId last_key;
+      int key_x[128];
+   };
+
+   void UpdateLayout();
+
+   // Level of detail for zoomed-out views (see RunShowDuration).  Notes
+   // too short to fit their own crown and heel are stretched until they
+   // do, so when one of those starts within a pixel of where the last one
+   // on its key and track ended, there's no boundary left to see between
+   // them.  Those are kept as a single note, so the notes drawn each frame
+   // are limited by the screen instead of by the song.  Longer notes are
+   // always runs of their own.
+   struct NoteRuns
+   {
+      NoteRuns() : source(0), show_duration(0), pixel(0) { }
+
+      // What these runs were built for.  Cleared when the layout changes.
+      const TranslatedNoteList *source;
+      microseconds_t show_duration;
+
+      // The height of a pixel, in microseconds at this zoom
+      microseconds_t pixel;
+
+      // Each run as one note covering all of it, sorted by start time
+      TranslatedNoteList runs;
+      TranslatedNoteIndex index;
+
+      // The notes (in list order) making up run r are members[i] for
+      // first_member[r] <= i < first_member[r+1]
+      std::vector<size_t> first_member;
+      std::vector<size_t> members;
+
+      // The latest end of members[i] and every member after it in its run
+      std::vector<microseconds_t> later_end;
+   };
+
+   // Rebuilds m_runs if the zoom, layout, or song changed since last time
+   void UpdateNoteRuns(const TranslatedNoteList &notes, microseconds_t show_duration);
 
-   void DrawWhiteKeys(Renderer &renderer, bool active_only, int key_count, int key_width, int key_height, 
-      int key_space, int x_offset, int y_offset) const;
+   enum KeyDrawMode
+   {
+      // Every key, as if none were pressed
+      KeysUnlit,
+
+      // Only keys that are pressed (plus the black keys a pressed
+      // white key would otherwise be drawn on top of)
+      KeysLit
+   };
 
-   void DrawBlackKeys(Renderer &renderer, const Tga *tex, bool active_only,int white_key_count, int white_width,
-      int black_width, int black_height, int key_space, int x_offset, int y_offset, int black_offset) const;
+
+   void DrawWhiteKeys(Renderer &renderer, KeyDrawMode mode, int x_offset, int y_offset) const;
+   void DrawBlackKeys(Renderer &renderer, const Tga *tex, KeyDrawMode mode, int x_offset, int y_offset) const;
 
    void DrawRail(Renderer &renderer, const Tga *tex, int x, int y, int width) const;
    void DrawShadow(Renderer &renderer, const Tga *tex, int x, int y, int width) const;
@@ -90,17 +204,63 @@ private:
    void DrawGuides(Renderer &renderer, int key_count, int key_width, int key_space,
       int x_offset, int y, int y_offset) const;
 
-   void DrawNotePass(Renderer &renderer, const Tga *tex_white, const Tga *tex_black, int white_width,
-      int key_space, int black_width, int black_offset, int x_offset, int y, int y_offset, int y_roll_under,
-      const TranslatedNoteSet &notes, microseconds_t show_duration, microseconds_t current_time,
-      const std::vector<Track::Properties> &track_properties) const;
+   // The visible notes of one kind (white or black), copied out of the
+   // note list into parallel arrays so their rows can be worked out a
+   // few notes at a time
+   struct NoteBatch
+   {
+      void Clear();
+
+      // Microseconds from now, clamped to what can be seen
+      std::vector<int> start;
+      std::vector<int> end;
+
+      // Zero when the note is cut off by the top or bottom
+      std::vector<int> min_height;
+
+      // Where the note's rectangle starts, and its Track::TrackColor
+      // (or MissedNote)
+      std::vector<int> left;
+      std::vector<int> brush;
+
+      // Filled in by FindNoteRows: where each of a note's three sections
+      // (crown, middle, heel) starts, and where the heel ends
+      std::vector<int> rows[4];
+   };
+
+   // How one kind of note (white or black) is cut into its crown, middle,
+   // and heel at the current key width
+   struct NoteShape;
+
+   // Fills in the batch's rows, four notes at a time where SSE2 is around
+   static void FindNoteRows(NoteBatch &batch, const NoteShape &shape, int base_y, double scaling_factor);
+
+   // Adds one note (or run) to the batch, as seen from current_time
+   static void QueueNote(NoteBatch &batch, microseconds_t start, microseconds_t end, int left, int brush,
+      microseconds_t current_time, microseconds_t roll_under);
+
+   // Queues every visible note on its own
+   void QueueNotes(int x_offset, const TranslatedNoteList &notes, const NoteStateList &note_states,
+      const std::vector<size_t> &visible_notes, microseconds_t current_time, microseconds_t roll_under,
+      const std::vector<Track::Properties> &track_properties);
+
+   // Queues every visible run.  Runs nobody has reached yet are queued
+   // whole.  Otherwise only the notes in [states_begin, states_end) are
+   // looked at, and the run is only split where one of them has been
+   // retired or missed.
+   void QueueRuns(int x_offset, const TranslatedNoteList &notes, const NoteStateList &note_states,
+      size_t states_begin, size_t states_end, const std::vector<size_t> &visible_runs,
+      microseconds_t current_time, microseconds_t roll_under,
+      const std::vector<Track::Properties> &track_properties);
 
-   // This takes the rectangle where the actual note block should appear and transforms
-   // it to the multi-quad (with relatively complicated texture coordinates) using the
-   // passed-in texture descriptor, and then draws the result
-   void DrawNote(Renderer &renderer, const Tga *tex, const NoteTexDimensions &tex_dimensions, int x, int y, int w, int h, int color_id) const;
+   // Every queued note's shadow and color is drawn in one trip through the
+   // batches.  The quads go into four lists (white shadows, black shadows,
+   // white notes, black notes) that are drawn in that order, so no shadow
+   // lands on top of a note.
+   void DrawNotes(Renderer &renderer, const Tga *note_tex[4], int y, microseconds_t show_duration);
 
-   // This works very much like DrawNote
+   // Stretches the key texture over the key's rectangle the way notes
+   // are, but in both directions
    void DrawBlackKey(Renderer &renderer, const Tga *tex, const KeyTexDimensions &tex_dimensions, int x, int y, int w, int h, Track::TrackColor color) const;
 
    // Retrieves which white-key a piano with the given key count
@@ -116,7 +276,34 @@ private:
    int GetWhiteKeyCount() const;
 
    KeyboardSize m_size;
-   KeyNames m_active_keys;
+   KeyLayout m_layout;
+
+   struct KeyState
+   {
+      bool active;
+      Track::TrackColor color;
+   };
+   KeyState m_keys[128];
+
+   // The guides (behind the notes) and the unlit keys (in front of them)
+   // look the same every frame, so they're drawn once and then copied
+   // back each frame.  Rebuilt whenever the layout changes.
+   RenderLayer m_guide_layer;
+   RenderLayer m_key_layer;
+   bool m_layers_valid;
+
+   NoteRuns m_runs;
+
+   // Follow the notes (or, zoomed out, the runs) overlapping the
+   // note-falling area from frame to frame
+   TranslatedNoteWindow m_visible_notes;
+   TranslatedNoteWindow m_visible_runs;
+
+   // Scratch space for QueueNotes, QueueRuns, and DrawNotes (white and
+   // black, then the four quad lists) kept so it isn't reallocated every
+   // frame
+   NoteBatch m_note_batches[2];
+   QuadList m_note_quads[4];
 
    int m_width;
    int m_height;
@@ -0,0 +1,270 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "PerformanceLog.h"
+#include "SharedState.h"
+#include "PianoGameError.h"
+#include "string_util.h"
+
+#include "libmidi/Midi.h"
+
+#include <algorithm>
+using namespace std;
+
+const static char PerformanceLogMagic[4] = { 'P', 'G', 'P', 'L' };
+const static unsigned char PerformanceLogVersion = 3;
+
+// Both file streams are opened the same way Midi::ReadFromFile does it
+static void OpenStream(fstream &file, const wstring &filename, ios::openmode mode)
+{
+#if defined WIN32
+   file.open(reinterpret_cast<const wchar_t*>((filename).c_str()), mode | ios::binary);
+#else
+   // TODO: This isn't Unicode!
+   std::string narrow(filename.begin(), filename.end());
+   file.open(narrow.c_str(), mode | ios::binary);
+#endif
+}
+
+// Returns how many bytes follow the type byte of the given record
+// type, or 0 if the type isn't recognized.
+static size_t RecordPayloadSize(unsigned char type)
+{
+   switch (type)
+   {
+   case PerformanceRecordFrame:      return 4;
+   case PerformanceRecordInput:      return 12;
+   case PerformanceRecordNoteOffset: return 4;
+   case PerformanceRecordSpeed:      return 4;
+   case PerformanceRecordPause:      return 1;
+   default:                          return 0;
+   }
+}
+
+unsigned long PerformanceSongHash(const TranslatedNoteList &notes)
+{
+   // 32-bit FNV-1a over the fields that matter for scoring
+   const static unsigned long FnvOffsetBasis = 2166136261UL;
+   const static unsigned long FnvPrime = 16777619UL;
+
+   unsigned long hash = FnvOffsetBasis;
+   for (TranslatedNoteList::const_iterator i = notes.begin(); i != notes.end(); ++i)
+   {
+      const unsigned long long fields[4] = { i->start, i->end, i->note_id, i->track_id };
+      for (int f = 0; f < 4; ++f)
+      {
+         for (int b = 0; b < 8; ++b)
+         {
+            hash ^= static_cast<unsigned char>(fields[f] >> (b * 8));
+            hash = (hash * FnvPrime) & 0xFFFFFFFFUL;
+         }
+      }
+   }
+
+   return hash;
+}
+
+
+
+
+PerformanceLog::PerformanceLog(const wstring &filename, const SharedState &state, size_t input_device_count)
+{
+   OpenStream(m_file, filename, ios::out | ios::trunc);
+   if (!m_file.good()) throw PianoGameError(WSTRING(L"Couldn't create performance log '" << filename << L"'."));
+
+   m_file.write(PerformanceLogMagic, sizeof(PerformanceLogMagic));
+   WriteInt(PerformanceLogVersion, 1);
+   WriteInt(PerformanceSongHash(state.midi->Notes()), 4);
+   WriteInt(input_device_count, 1);
+   WriteInt(state.latency_compensation, 4);
+   WriteInt(state.song_speed, 2);
+
+   WriteInt(state.track_properties.size(), 2);
+   for (size_t i = 0; i < state.track_properties.size(); ++i)
+   {
+      WriteInt(state.track_properties[i].mode, 1);
+   }
+}
+
+PerformanceLog::~PerformanceLog()
+{
+   m_file.close();
+}
+
+void PerformanceLog::WriteInt(unsigned long long value, int byte_count)
+{
+   for (int i = 0; i < byte_count; ++i)
+   {
+      m_file.put(static_cast<char>(value >> (i * 8)));
+   }
+}
+
+void PerformanceLog::Frame(unsigned long delta_milliseconds)
+{
+   WriteInt(PerformanceRecordFrame, 1);
+   WriteInt(delta_milliseconds, 4);
+}
+
+void PerformanceLog::Input(microseconds_t song_position, size_t device, const MidiEventSimple &ev)
+{
+   WriteInt(PerformanceRecordInput, 1);
+   WriteInt(song_position, 8);
+   WriteInt(device, 1);
+   WriteInt(ev.status, 1);
+   WriteInt(ev.byte1, 1);
+   WriteInt(ev.byte2, 1);
+}
+
+void PerformanceLog::NoteOffset(int note_offset)
+{
+   WriteInt(PerformanceRecordNoteOffset, 1);
+   WriteInt(note_offset, 4);
+}
+
+void PerformanceLog::Speed(int song_speed)
+{
+   WriteInt(PerformanceRecordSpeed, 1);
+   WriteInt(song_speed, 4);
+}
+
+void PerformanceLog::Pause(bool paused)
+{
+   WriteInt(PerformanceRecordPause, 1);
+   WriteInt(paused ? 1 : 0, 1);
+}
+
+
+
+
+PerformanceReplay::PerformanceReplay(const wstring &filename)
+   : m_position(0), m_song_hash(0), m_input_device_count(0), m_latency_compensation(0), m_song_speed(100)
+{
+   fstream file;
+   OpenStream(file, filename, ios::in);
+   if (!file.good()) throw PianoGameError(WSTRING(L"Couldn't open performance log '" << filename << L"'."));
+
+   char buffer[4096];
+   while (file.good())
+   {
+      file.read(buffer, sizeof(buffer));
+      m_data.insert(m_data.end(), buffer, buffer + file.gcount());
+   }
+   file.close();
+
+   const wstring malformed = WSTRING(L"Performance log '" << filename << L"' is malformed.");
+
+   // The fixed-size part of the header
+   if (m_data.size() < sizeof(PerformanceLogMagic) + 14) throw PianoGameError(malformed);
+   if (!equal(PerformanceLogMagic, PerformanceLogMagic + sizeof(PerformanceLogMagic), m_data.begin())) throw PianoGameError(malformed);
+   m_position += sizeof(PerformanceLogMagic);
+
+   if (ReadInt(1) != PerformanceLogVersion) throw PianoGameError(WSTRING(L"Performance log '" << filename << L"' is from a different version."));
+
+   m_song_hash = static_cast<unsigned long>(ReadInt(4));
+   m_input_device_count = static_cast<size_t>(ReadInt(1));
+   m_latency_compensation = static_cast<microseconds_t>(ReadInt(4));
+   m_song_speed = static_cast<int>(ReadInt(2));
+
+   const size_t track_count = static_cast<size_t>(ReadInt(2));
+   if (m_data.size() < m_position + track_count) throw PianoGameError(malformed);
+   for (size_t i = 0; i < track_count; ++i)
+   {
+      const unsigned long long mode = ReadInt(1);
+      if (mode >= Track::ModeCount) throw PianoGameError(malformed);
+
+      m_track_modes.push_back(static_cast<Track::Mode>(mode));
+   }
+
+   // Make sure the rest of the records are well-formed now so the
+   // playback functions don't have to worry about running off the end
+   size_t pos = m_position;
+   while (pos < m_data.size())
+   {
+      const size_t payload_size = RecordPayloadSize(m_data[pos]);
+      if (payload_size == 0) throw PianoGameError(malformed);
+
+      // A log cut short in the middle of a record (say, from a
+      // crash) is still good up until that record.
+      if (pos + 1 + payload_size > m_data.size())
+      {
+         m_data.resize(pos);
+         break;
+      }
+
+      // The device index comes right after the 8-byte song position
+      if (m_data[pos] == PerformanceRecordInput && m_data[pos + 9] >= m_input_device_count) throw PianoGameError(malformed);
+
+      pos += 1 + payload_size;
+   }
+}
+
+unsigned long long PerformanceReplay::ReadInt(int byte_count)
+{
+   unsigned long long value = 0;
+   for (int i = 0; i < byte_count; ++i)
+   {
+      value |= static_cast<unsigned long long>(m_data[m_position++]) << (i * 8);
+   }
+
+   return value;
+}
+
+bool PerformanceReplay::Peek(PerformanceRecordType type) const
+{
+   if (m_position >= m_data.size()) return false;
+   return (m_data[m_position] == type);
+}
+
+bool PerformanceReplay::NextFrame(unsigned long *delta_milliseconds)
+{
+   // Skip anything from the previous frame that wasn't consumed
+   while (m_position < m_data.size() && !Peek(PerformanceRecordFrame))
+   {
+      m_position += 1 + RecordPayloadSize(m_data[m_position]);
+   }
+
+   if (!Peek(PerformanceRecordFrame)) return false;
+
+   m_position++;
+   *delta_milliseconds = static_cast<unsigned long>(ReadInt(4));
+   return true;
+}
+
+bool PerformanceReplay::NextInput(microseconds_t *song_position, size_t *device, MidiEventSimple *ev)
+{
+   if (!Peek(PerformanceRecordInput)) return false;
+
+   m_position++;
+   *song_position = static_cast<microseconds_t>(ReadInt(8));
+   *device = static_cast<size_t>(ReadInt(1));
+   ev->status = static_cast<unsigned char>(ReadInt(1));
+   ev->byte1 = static_cast<unsigned char>(ReadInt(1));
+   ev->byte2 = static_cast<unsigned char>(ReadInt(1));
+   return true;
+}
+
+bool PerformanceReplay::NextChange(PerformanceRecordType *type, int *value)
+{
+   // Input records always come before change records in a frame
+   while (Peek(PerformanceRecordInput)) m_position += 1 + RecordPayloadSize(PerformanceRecordInput);
+
+   if (Peek(PerformanceRecordNoteOffset) || Peek(PerformanceRecordSpeed))
+   {
+      *type = static_cast<PerformanceRecordType>(m_data[m_position++]);
+
+      // Sign-extend from the 4 stored bytes
+      *value = static_cast<int>(static_cast<unsigned int>(ReadInt(4)));
+      return true;
+   }
+
+   if (Peek(PerformanceRecordPause))
+   {
+      m_position++;
+      *type = PerformanceRecordPause;
+      *value = static_cast<int>(ReadInt(1));
+      return true;
+   }
+
+   return false;
+}
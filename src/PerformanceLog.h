@@ -0,0 +1,113 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __PERFORMANCE_LOG_H
+#define __PERFORMANCE_LOG_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "TrackProperties.h"
+#include "libmidi/Note.h"
+#include "libmidi/MidiEvent.h"
+#include "libmidi/MidiTypes.h"
+
+struct SharedState;
+
+// A performance log is a compact, append-only binary record of everything
+// that influences a PlayingState's scoring: the length of each frame, every
+// raw input event (stamped with the song position it was read at), and the
+// player's note offset, speed, and pause changes.  Feeding a log back through
+// PlayingState reproduces the original run exactly.
+//
+// All values are stored little-endian, regardless of platform.
+//
+// Layout:
+//    Header:  "PGPL", version (1 byte), song hash (4), input device count (1),
+//             latency compensation (4), song speed (2), track count (2), one
+//             track mode per track (1 each)
+//    Records: record type (1 byte), followed by:
+//             Frame:      delta milliseconds (4)
+//             Input:      song position (8), device (1), status (1), data1 (1), data2 (1)
+//             NoteOffset: new offset (4, signed)
+//             Speed:      new speed (4, signed)
+//             Pause:      paused (1)
+enum PerformanceRecordType
+{
+   PerformanceRecordFrame = 1,
+   PerformanceRecordInput,
+   PerformanceRecordNoteOffset,
+   PerformanceRecordSpeed,
+   PerformanceRecordPause
+};
+
+// Returns a hash of the translated note list.  Logs are only
+// replayed against the song they were recorded with.
+unsigned long PerformanceSongHash(const TranslatedNoteList &notes);
+
+class PerformanceLog
+{
+public:
+   // Throws PianoGameError if the file can't be created
+   PerformanceLog(const std::wstring &filename, const SharedState &state, size_t input_device_count);
+   ~PerformanceLog();
+
+   // Call once at the start of every PlayingState update
+   void Frame(unsigned long delta_milliseconds);
+
+   // device is the index of the input device (see SharedState::device_stats)
+   void Input(microseconds_t song_position, size_t device, const MidiEventSimple &ev);
+
+   void NoteOffset(int note_offset);
+   void Speed(int song_speed);
+   void Pause(bool paused);
+
+private:
+   void WriteInt(unsigned long long value, int byte_count);
+
+   std::fstream m_file;
+};
+
+class PerformanceReplay
+{
+public:
+   // The entire log is read into memory up front.  Throws
+   // PianoGameError if the file is missing or malformed.
+   PerformanceReplay(const std::wstring &filename);
+
+   unsigned long SongHash() const { return m_song_hash; }
+   size_t InputDeviceCount() const { return m_input_device_count; }
+   microseconds_t LatencyCompensation() const { return m_latency_compensation; }
+   int SongSpeed() const { return m_song_speed; }
+   const std::vector<Track::Mode> &TrackModes() const { return m_track_modes; }
+
+   // Moves to the start of the next recorded frame.  Returns false
+   // once the log is exhausted.  Any records left over from the
+   // previous frame are skipped.
+   bool NextFrame(unsigned long *delta_milliseconds);
+
+   // Returns the next input event recorded during the current frame,
+   // or false if there are no more.
+   bool NextInput(microseconds_t *song_position, size_t *device, MidiEventSimple *ev);
+
+   // Returns the next note offset, speed, or pause change recorded
+   // during the current frame, or false if there are no more.
+   bool NextChange(PerformanceRecordType *type, int *value);
+
+private:
+   bool Peek(PerformanceRecordType type) const;
+   unsigned long long ReadInt(int byte_count);
+
+   std::vector<unsigned char> m_data;
+   size_t m_position;
+
+   unsigned long m_song_hash;
+   size_t m_input_device_count;
+   microseconds_t m_latency_compensation;
+   int m_song_speed;
+   std::vector<Track::Mode> m_track_modes;
+};
+
+#endif
@@ -0,0 +1,296 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "RenderRecording.h"
+#include "Renderer.h"
+#include "CompatibleSystem.h"
+#include "PianoGameError.h"
+#include "string_util.h"
+
+#include <fstream>
+#include <cstring>
+#include <iomanip>
+#include <algorithm>
+using namespace std;
+
+const static unsigned long RecordingMagic = 0x52524750; // "PGRR"
+const static unsigned long RecordingVersion = 1;
+
+// Anything bigger than this is a damaged file, not a real screen
+const static int MaxScreenSize = 16384;
+
+template<class T> static void WriteValue(ostream &out, const T &value)
+{
+   out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<class T> static void ReadValue(istream &in, T &value)
+{
+   in.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+RenderRecording::RenderRecording(size_t max_frames, int screen_width, int screen_height)
+   : m_max_frames(max_frames), m_screen_width(screen_width), m_screen_height(screen_height),
+   m_have_state(false), m_texture(0)
+{
+   m_frame_starts.push_back(0);
+   m_color[0] = m_color[1] = m_color[2] = m_color[3] = 0;
+}
+
+void RenderRecording::Quad(unsigned int texture_id, const unsigned char color[4], int x, int y, int w, int h, float tx, float ty, float tw, float th)
+{
+   if (IsFull()) return;
+
+   RenderCommand command;
+   memset(&command, 0, sizeof(RenderCommand));
+
+   // Each frame starts from scratch so it can be replayed on its own
+   if (!m_have_state || texture_id != m_texture)
+   {
+      command.type = RenderCommandTexture;
+      command.value = texture_id;
+      Add(command);
+
+      m_texture = texture_id;
+      m_current.texture_switches++;
+   }
+
+   if (!m_have_state || memcmp(color, m_color, sizeof(m_color)) != 0)
+   {
+      command.type = RenderCommandColor;
+      command.value = 0;
+      memcpy(command.color, color, sizeof(command.color));
+      Add(command);
+
+      memcpy(m_color, color, sizeof(m_color));
+      m_current.color_changes++;
+   }
+
+   m_have_state = true;
+
+   command.type = RenderCommandQuad;
+   command.value = 0;
+   command.x = x;
+   command.y = y;
+   command.w = w;
+   command.h = h;
+   command.tx = tx;
+   command.ty = ty;
+   command.tw = tw;
+   command.th = th;
+   Add(command);
+
+   m_current.quads++;
+}
+
+void RenderRecording::TextRun(unsigned int glyph_count)
+{
+   if (IsFull()) return;
+
+   RenderCommand command;
+   memset(&command, 0, sizeof(RenderCommand));
+   command.type = RenderCommandTextRun;
+   command.value = glyph_count;
+   Add(command);
+
+   m_current.text_runs++;
+}
+
+void RenderRecording::EndFrame(unsigned int draw_calls)
+{
+   if (IsFull()) return;
+
+   m_current.draw_calls = draw_calls;
+   m_stats.push_back(m_current);
+   m_frame_starts.push_back(m_commands.size());
+
+   m_current = RenderFrameStats();
+   m_have_state = false;
+}
+
+set<unsigned int> RenderRecording::TextureIds() const
+{
+   set<unsigned int> ids;
+   for (size_t i = 0; i < m_commands.size(); ++i)
+   {
+      if (m_commands[i].type == RenderCommandTexture && m_commands[i].value != 0) ids.insert(m_commands[i].value);
+   }
+
+   return ids;
+}
+
+void RenderRecording::Replay(size_t frame, Renderer &renderer, const map<unsigned int, unsigned int> &textures) const
+{
+   if (frame >= m_stats.size()) return;
+
+   unsigned int texture = 0;
+   for (size_t i = m_frame_starts[frame]; i < m_frame_starts[frame + 1]; ++i)
+   {
+      const RenderCommand &c = m_commands[i];
+      switch (c.type)
+      {
+      case RenderCommandTexture:
+         {
+            map<unsigned int, unsigned int>::const_iterator stand_in = textures.find(c.value);
+            texture = (stand_in == textures.end() ? c.value : stand_in->second);
+            break;
+         }
+
+      case RenderCommandColor:
+         renderer.SetColor(c.color[0], c.color[1], c.color[2], c.color[3]);
+         break;
+
+      case RenderCommandQuad:
+         renderer.DrawTexture(texture, c.x, c.y, c.w, c.h, c.tx, c.ty, c.tw, c.th);
+         break;
+
+      default:
+         break;
+      }
+   }
+}
+
+bool RenderRecording::Save(const wstring &filename) const
+{
+#ifdef WIN32
+   ofstream file(reinterpret_cast<const wchar_t*>(filename.c_str()), ios::binary);
+#else
+   // TODO: This isn't Unicode!
+   std::string narrow(filename.begin(), filename.end());
+   ofstream file(narrow.c_str(), ios::binary);
+#endif
+   if (!file.good()) return false;
+
+   WriteValue(file, RecordingMagic);
+   WriteValue(file, RecordingVersion);
+   WriteValue(file, m_screen_width);
+   WriteValue(file, m_screen_height);
+
+   const unsigned long frame_count = static_cast<unsigned long>(m_stats.size());
+   WriteValue(file, frame_count);
+
+   for (size_t f = 0; f < m_stats.size(); ++f)
+   {
+      const unsigned long command_count = static_cast<unsigned long>(m_frame_starts[f + 1] - m_frame_starts[f]);
+
+      WriteValue(file, m_stats[f]);
+      WriteValue(file, command_count);
+      if (command_count > 0) file.write(reinterpret_cast<const char*>(&m_commands[m_frame_starts[f]]), command_count * sizeof(RenderCommand));
+   }
+
+   return file.good();
+}
+
+RenderRecording RenderRecording::Load(const wstring &filename)
+{
+#ifdef WIN32
+   ifstream file(reinterpret_cast<const wchar_t*>(filename.c_str()), ios::binary);
+#else
+   // TODO: This isn't Unicode!
+   std::string narrow(filename.begin(), filename.end());
+   ifstream file(narrow.c_str(), ios::binary);
+#endif
+   if (!file.good()) throw PianoGameError(WSTRING(L"Couldn't open render recording '" << filename << L"'."));
+
+   // Every count in the file is checked against what's left of it before
+   // anything is allocated, so a damaged file can't ask for gigabytes
+   file.seekg(0, ios::end);
+   const unsigned long long file_size = static_cast<unsigned long long>(file.tellg());
+   file.seekg(0, ios::beg);
+
+   unsigned long magic = 0;
+   unsigned long version = 0;
+   ReadValue(file, magic);
+   ReadValue(file, version);
+   if (magic != RecordingMagic || version != RecordingVersion) throw PianoGameError(WSTRING(L"'" << filename << L"' isn't a render recording this version can read."));
+
+   int screen_width = 0;
+   int screen_height = 0;
+   unsigned long frame_count = 0;
+   ReadValue(file, screen_width);
+   ReadValue(file, screen_height);
+   ReadValue(file, frame_count);
+
+   const wstring truncated = WSTRING(L"Render recording '" << filename << L"' is truncated or damaged.");
+   if (!file.good()) throw PianoGameError(truncated);
+
+   if (screen_width <= 0 || screen_height <= 0 || screen_width > MaxScreenSize || screen_height > MaxScreenSize) throw PianoGameError(truncated);
+
+   const unsigned long long frame_size = sizeof(RenderFrameStats) + sizeof(unsigned long);
+   if (frame_count > (file_size - static_cast<unsigned long long>(file.tellg())) / frame_size) throw PianoGameError(truncated);
+
+   RenderRecording recording(frame_count, screen_width, screen_height);
+   for (unsigned long f = 0; f < frame_count; ++f)
+   {
+      RenderFrameStats stats;
+      unsigned long command_count = 0;
+      ReadValue(file, stats);
+      ReadValue(file, command_count);
+      if (!file.good()) throw PianoGameError(truncated);
+
+      const unsigned long long remaining = file_size - static_cast<unsigned long long>(file.tellg());
+      if (command_count > remaining / sizeof(RenderCommand)) throw PianoGameError(truncated);
+
+      const size_t start = recording.m_commands.size();
+      recording.m_commands.resize(start + command_count);
+      if (command_count > 0) file.read(reinterpret_cast<char*>(&recording.m_commands[start]), command_count * sizeof(RenderCommand));
+      if (!file.good()) throw PianoGameError(truncated);
+
+      recording.m_stats.push_back(stats);
+      recording.m_frame_starts.push_back(recording.m_commands.size());
+   }
+
+   return recording;
+}
+
+wstring BenchmarkRecording(const RenderRecording &recording, Renderer &renderer,
+                           const map<unsigned int, unsigned int> &textures, int passes)
+{
+   passes = max(passes, 1);
+
+   wostringstream report;
+   report << L"Frames: " << recording.FrameCount() << L", passes: " << passes << endl << endl;
+   report << L"frame, quads, texture switches, color changes, text runs, draw calls, mean us, worst us" << endl;
+
+   unsigned long long total = 0;
+   unsigned long long worst = 0;
+   size_t worst_frame = 0;
+
+   for (size_t f = 0; f < recording.FrameCount(); ++f)
+   {
+      unsigned long long frame_total = 0;
+      unsigned long long frame_worst = 0;
+
+      for (int pass = 0; pass < passes; ++pass)
+      {
+         const unsigned long long start = Compatible::GetMicroseconds();
+
+         renderer.BeginFrame(recording.GetScreenHeight(), Renderer::ToColor(64, 64, 64));
+         recording.Replay(f, renderer, textures);
+         renderer.SwapBuffers();
+
+         const unsigned long long elapsed = Compatible::GetMicroseconds() - start;
+         frame_total += elapsed;
+         frame_worst = max(frame_worst, elapsed);
+      }
+
+      total += frame_total;
+      if (frame_worst > worst)
+      {
+         worst = frame_worst;
+         worst_frame = f;
+      }
+
+      const RenderFrameStats &stats = recording.Stats(f);
+      report << f << L", " << stats.quads << L", " << stats.texture_switches << L", " << stats.color_changes << L", "
+         << stats.text_runs << L", " << stats.draw_calls << L", "
+         << fixed << setprecision(1) << double(frame_total) / passes << L", " << frame_worst << endl;
+   }
+
+   const size_t replayed = recording.FrameCount() * passes;
+   report << endl << L"Mean frame: " << fixed << setprecision(1) << (replayed == 0 ? 0.0 : double(total) / replayed) << L" us" << endl;
+   report << L"Worst frame: " << worst << L" us (frame " << worst_frame << L")" << endl;
+
+   return report.str();
+}
@@ -0,0 +1,113 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __RENDER_RECORDING_H
+#define __RENDER_RECORDING_H
+
+#include <vector>
+#include <string>
+#include <set>
+#include <map>
+
+class Renderer;
+
+enum RenderCommandType
+{
+   RenderCommandTexture,
+   RenderCommandColor,
+   RenderCommandQuad,
+
+   // Marks where a string starts (the glyph quads follow)
+   RenderCommandTextRun
+};
+
+struct RenderCommand
+{
+   unsigned char type;
+   unsigned char color[4];
+
+   // The texture for RenderCommandTexture, the glyph
+   // count for RenderCommandTextRun
+   unsigned int value;
+
+   int x, y, w, h;
+   float tx, ty, tw, th;
+};
+
+struct RenderFrameStats
+{
+   RenderFrameStats() : quads(0), texture_switches(0), color_changes(0), text_runs(0), draw_calls(0) { }
+
+   unsigned long quads;
+   unsigned long texture_switches;
+   unsigned long color_changes;
+   unsigned long text_runs;
+   unsigned long draw_calls;
+};
+
+// Everything the Renderer was asked to draw for a run of frames (see
+// Renderer::Record), kept as a compact list of commands per frame so
+// the same frames can be saved, loaded, and drawn again later without
+// any of the game logic that produced them.
+//
+// Texture ids are whatever they were while recording.  Replaying in a
+// different session takes a map to stand-in textures.
+class RenderRecording
+{
+public:
+   RenderRecording(size_t max_frames, int screen_width, int screen_height);
+
+   int GetScreenWidth() const { return m_screen_width; }
+   int GetScreenHeight() const { return m_screen_height; }
+
+   // Once full, further frames are ignored
+   bool IsFull() const { return m_stats.size() >= m_max_frames; }
+
+   void Quad(unsigned int texture_id, const unsigned char color[4], int x, int y, int w, int h, float tx, float ty, float tw, float th);
+   void TextRun(unsigned int glyph_count);
+   void EndFrame(unsigned int draw_calls);
+
+   size_t FrameCount() const { return m_stats.size(); }
+   const RenderFrameStats &Stats(size_t frame) const { return m_stats[frame]; }
+
+   // Every texture drawn with anywhere in the recording
+   std::set<unsigned int> TextureIds() const;
+
+   // Draws a recorded frame (without clearing or swapping).  Textures
+   // missing from the map are drawn with their recorded id.
+   void Replay(size_t frame, Renderer &renderer, const std::map<unsigned int, unsigned int> &textures) const;
+
+   // The file format is raw and only meant to be read back on the same
+   // kind of machine.  Load throws PianoGameError on a bad file.
+   bool Save(const std::wstring &filename) const;
+   static RenderRecording Load(const std::wstring &filename);
+
+private:
+   void Add(const RenderCommand &command) { if (!IsFull()) m_commands.push_back(command); }
+
+   size_t m_max_frames;
+   int m_screen_width;
+   int m_screen_height;
+
+   std::vector<RenderCommand> m_commands;
+
+   // Where each frame's commands begin in m_commands
+   std::vector<size_t> m_frame_starts;
+   std::vector<RenderFrameStats> m_stats;
+
+   // For the frame being recorded
+   RenderFrameStats m_current;
+   bool m_have_state;
+   unsigned int m_texture;
+   unsigned char m_color[4];
+};
+
+// Draws every frame in the recording some number of times with the given
+// renderer and describes how long each frame took, along with its
+// counters.  (--bench hands it the software rasterizer with stand-in
+// textures, so its times are for drawing on the CPU, not on the card.)
+std::wstring BenchmarkRecording(const RenderRecording &recording, Renderer &renderer,
+   const std::map<unsigned int, unsigned int> &textures, int passes);
+
+#endif
@@ -4,19 +4,144 @@
 
 #include "Renderer.h"
 #include "Tga.h"
+#include "SoftwareRasterizer.h"
+#include "RenderRecording.h"
 #include "os_graphics.h"
 
-#include <limits>
+#include <vector>
 
 
+// Rather than an immediate-mode glBegin/glEnd per quad, everything drawn
+// is appended to a single client-side vertex array and sent to OpenGL in
+// one glDrawArrays call per run of quads that share a texture.  Draw order
+// is kept as-is (quads are blended, so they can't be re-sorted), but most
+// drawing already happens in long same-texture passes, so this works out
+// to a handful of draw calls per frame.
+//
 // These are static because OpenGL is (essentially) static
-static unsigned int last_texture_id = std::numeric_limits<unsigned int>::max();
-void SelectTexture(unsigned int texture_id)
+struct BatchVertex
 {
-   if (texture_id == last_texture_id) return;
-   
-   glBindTexture(GL_TEXTURE_2D, texture_id);
-   last_texture_id = texture_id;
+   GLfloat x, y;
+   GLfloat u, v;
+   GLubyte r, g, b, a;
+};
+
+static std::vector<BatchVertex> batch;
+static unsigned int batch_texture = 0;
+static GLubyte batch_color[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+
+// When set, batches are drawn here instead of by OpenGL
+static SoftwareRasterizer *software = 0;
+
+// When set, every quad is also added here
+static RenderRecording *recording = 0;
+
+static unsigned int draw_calls = 0;
+static unsigned int last_frame_draw_calls = 0;
+
+static void BatchVertexAt(GLfloat x, GLfloat y, GLfloat u, GLfloat v)
+{
+   BatchVertex vertex;
+   vertex.x = x;
+   vertex.y = y;
+   vertex.u = u;
+   vertex.v = v;
+   vertex.r = batch_color[0];
+   vertex.g = batch_color[1];
+   vertex.b = batch_color[2];
+   vertex.a = batch_color[3];
+
+   batch.push_back(vertex);
+}
+
+static void BatchQuad(unsigned int texture_id, int x, int y, int w, int h, double tx, double ty, double tw, double th)
+{
+   if (texture_id != batch_texture) Renderer::Flush();
+   batch_texture = texture_id;
+
+   if (recording)
+   {
+      recording->Quad(texture_id, batch_color, x, y, w, h, static_cast<float>(tx),
+         static_cast<float>(ty), static_cast<float>(tw), static_cast<float>(th));
+   }
+
+   if (batch.capacity() == 0) batch.reserve(4096);
+
+   const GLfloat u0 = static_cast<GLfloat>(tx);
+   const GLfloat v0 = static_cast<GLfloat>(ty);
+   const GLfloat u1 = static_cast<GLfloat>(tx + tw);
+   const GLfloat v1 = static_cast<GLfloat>(ty + th);
+
+   BatchVertexAt(static_cast<GLfloat>(  x), static_cast<GLfloat>(  y), u0, v0);
+   BatchVertexAt(static_cast<GLfloat>(  x), static_cast<GLfloat>(y+h), u0, v1);
+   BatchVertexAt(static_cast<GLfloat>(x+w), static_cast<GLfloat>(y+h), u1, v1);
+   BatchVertexAt(static_cast<GLfloat>(x+w), static_cast<GLfloat>(  y), u1, v0);
+}
+
+void Renderer::Flush()
+{
+   if (batch.empty()) return;
+
+   if (software)
+   {
+      // Opposite corners are all a quad needs (see BatchQuad)
+      for (size_t i = 0; i + 3 < batch.size(); i += 4)
+      {
+         const BatchVertex &a = batch[i];
+         const BatchVertex &b = batch[i + 2];
+         software->DrawQuad(batch_texture, a.x, a.y, b.x, b.y, a.u, a.v, b.u, b.v, &a.r);
+      }
+      draw_calls++;
+
+      batch.clear();
+      return;
+   }
+
+   // Something else (Tga::SetSmooth, glyph uploads) may have bound
+   // another texture since the last flush, so always bind ours.
+   glBindTexture(GL_TEXTURE_2D, batch_texture);
+
+   const GLsizei stride = sizeof(BatchVertex);
+   glEnableClientState(GL_VERTEX_ARRAY);
+   glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+   glEnableClientState(GL_COLOR_ARRAY);
+
+   glVertexPointer(2, GL_FLOAT, stride, &batch[0].x);
+   glTexCoordPointer(2, GL_FLOAT, stride, &batch[0].u);
+   glColorPointer(4, GL_UNSIGNED_BYTE, stride, &batch[0].r);
+
+   glDrawArrays(GL_QUADS, 0, static_cast<GLsizei>(batch.size()));
+   draw_calls++;
+
+   glDisableClientState(GL_COLOR_ARRAY);
+   glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+   glDisableClientState(GL_VERTEX_ARRAY);
+
+   // The current color is undefined after drawing with a color
+   // array, but anything drawn with OpenGL directly expects it.
+   glColor4ubv(batch_color);
+
+   batch.clear();
+}
+
+unsigned int Renderer::GetDrawCallCount()
+{
+   return last_frame_draw_calls;
+}
+
+void Renderer::Record(RenderRecording *new_recording)
+{
+   recording = new_recording;
+}
+
+RenderRecording *Renderer::GetRecording()
+{
+   return recording;
+}
+
+void Renderer::RecordTextRun(unsigned int glyph_count)
+{
+   if (recording) recording->TextRun(glyph_count);
 }
 
 
@@ -24,6 +149,36 @@ Renderer::Renderer(Context context) : m_context(context), m_xoffset(0), m_yoffse
 {
 }
 
+void Renderer::UseSoftwareRasterizer(SoftwareRasterizer *rasterizer)
+{
+   Flush();
+   software = rasterizer;
+   batch_texture = 0;
+}
+
+SoftwareRasterizer *Renderer::GetSoftwareRasterizer()
+{
+   return software;
+}
+
+void Renderer::BeginFrame(int screen_height, Color clear_color)
+{
+   if (software)
+   {
+      software->Clear(clear_color.r, clear_color.g, clear_color.b);
+      return;
+   }
+
+   glClearColor(clear_color.r / 255.0f, clear_color.g / 255.0f, clear_color.b / 255.0f, 1.0f);
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+   glMatrixMode(GL_MODELVIEW);
+   glLoadIdentity();
+   glTranslatef(0., static_cast<GLfloat>(screen_height), 0.);
+   glScalef (1., -1., 1.);
+   glTranslatef(0.375, 0.375, 0.);
+}
+
 Color Renderer::ToColor(int r, int g, int b, int a)
 {
    Color c;
@@ -37,6 +192,8 @@ Color Renderer::ToColor(int r, int g, int b, int a)
 
 void Renderer::SetVSyncInterval(int interval)
 {
+   if (software) return;
+
 #ifdef WIN32
 
    const char *extensions = reinterpret_cast<const char*>(static_cast<const unsigned char*>(glGetString( GL_EXTENSIONS )));
@@ -63,6 +220,18 @@ void Renderer::SetVSyncInterval(int interval)
 
 void Renderer::SwapBuffers()
 {
+   Flush();
+
+   last_frame_draw_calls = draw_calls;
+   draw_calls = 0;
+
+   if (recording) recording->EndFrame(last_frame_draw_calls);
+
+   // The finished frame just stays in the rasterizer's framebuffer
+   if (software) return;
+
+   glFlush();
+
 #ifdef WIN32
    ::SwapBuffers(m_context);
 #else
@@ -72,8 +241,10 @@ void Renderer::SwapBuffers()
 
 void Renderer::ForceTexture(unsigned int texture_id)
 {
-   last_texture_id = std::numeric_limits<unsigned int>::max();
-   SelectTexture(texture_id);
+   Flush();
+
+   batch_texture = texture_id;
+   if (!software) glBindTexture(GL_TEXTURE_2D, texture_id);
 }
 
 void Renderer::SetColor(Color c)
@@ -83,19 +254,17 @@ void Renderer::SetColor(Color c)
 
 void Renderer::SetColor(int r, int g, int b, int a)
 {
-   glColor4f(r / 255.0f, g / 255.0f, b / 255.0f, a / 255.0f);
+   batch_color[0] = static_cast<GLubyte>(r);
+   batch_color[1] = static_cast<GLubyte>(g);
+   batch_color[2] = static_cast<GLubyte>(b);
+   batch_color[3] = static_cast<GLubyte>(a);
+
+   if (!software) glColor4ubv(batch_color);
 }
 
 void Renderer::DrawQuad(int x, int y, int w, int h)
 {
-   SelectTexture(0);
-
-   glBegin(GL_QUADS);
-   glVertex3i(   x + m_xoffset,   y + m_yoffset, 0);
-   glVertex3i( x+w + m_xoffset,   y + m_yoffset, 0);
-   glVertex3i( x+w + m_xoffset, y+h + m_yoffset, 0);
-   glVertex3i(   x + m_xoffset, y+h + m_yoffset, 0);
-   glEnd();
+   BatchQuad(0, x + m_xoffset, y + m_yoffset, w, h, 0.0, 0.0, 0.0, 0.0);
 }
 
 void Renderer::DrawTga(const Tga *tga, int x, int y) const
@@ -108,19 +277,112 @@ void Renderer::DrawTga(const Tga *tga, int in_x, int in_y, int width, int height
    const int x = in_x + m_xoffset;
    const int y = in_y + m_yoffset;
 
-   const double tx = static_cast<double>(src_x) / static_cast<double>(tga->GetWidth());
-   const double ty = -static_cast<double>(src_y) / static_cast<double>(tga->GetHeight());
-   const double tw = static_cast<double>(width) / static_cast<double>(tga->GetWidth());
-   const double th = -static_cast<double>(height)/ static_cast<double>(tga->GetHeight());
+   double tx, ty, tw, th;
+   tga->TexCoords(src_x, src_y, width, height, &tx, &ty, &tw, &th);
+
+   BatchQuad(tga->GetId(), x, y, width, height, tx, ty, tw, th);
+}
+
+static int NextPowerOfTwo(int n)
+{
+   int p = 1;
+   while (p < n) p *= 2;
+   return p;
+}
+
+void Renderer::CaptureLayer(RenderLayer &layer, int x, int y, int w, int h) const
+{
+   // The rectangle has to actually be drawn before we can copy it
+   Flush();
+
+   if (software)
+   {
+      if (layer.texture_id == 0 || NextPowerOfTwo(w) != layer.tex_width || NextPowerOfTwo(h) != layer.tex_height)
+      {
+         ReleaseLayer(layer);
+
+         layer.tex_width = NextPowerOfTwo(w);
+         layer.tex_height = NextPowerOfTwo(h);
+         layer.texture_id = software->CreateTexture(layer.tex_width, layer.tex_height, 3, 0);
+      }
+
+      layer.width = w;
+      layer.height = h;
+
+      software->CopyToTexture(layer.texture_id, x + m_xoffset, y + m_yoffset, w, h);
+      return;
+   }
+
+   if (layer.texture_id == 0 || NextPowerOfTwo(w) != layer.tex_width || NextPowerOfTwo(h) != layer.tex_height)
+   {
+      ReleaseLayer(layer);
+
+      layer.tex_width = NextPowerOfTwo(w);
+      layer.tex_height = NextPowerOfTwo(h);
+
+      GLuint id;
+      glGenTextures(1, &id);
+      layer.texture_id = id;
 
-   SelectTexture(tga->GetId());
+      glBindTexture(GL_TEXTURE_2D, layer.texture_id);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, layer.tex_width, layer.tex_height, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
+   }
+
+   layer.width = w;
+   layer.height = h;
+
+   // Window coordinates start at the bottom left, ours at the top left
+   GLint viewport[4];
+   glGetIntegerv(GL_VIEWPORT, viewport);
+   const int window_x = x + m_xoffset;
+   const int window_y = viewport[3] - (y + m_yoffset + h);
+
+   glBindTexture(GL_TEXTURE_2D, layer.texture_id);
+   glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, window_x, window_y, w, h);
+}
+
+void Renderer::DrawLayer(const RenderLayer &layer, int x, int y) const
+{
+   if (layer.texture_id == 0) return;
+
+   // The bottom row of the frame was copied into the first row of the texture
+   const double tw = static_cast<double>(layer.width) / static_cast<double>(layer.tex_width);
+   const double th = static_cast<double>(layer.height) / static_cast<double>(layer.tex_height);
+
+   BatchQuad(layer.texture_id, x + m_xoffset, y + m_yoffset, layer.width, layer.height, 0.0, th, tw, -th);
+}
+
+void Renderer::ReleaseLayer(RenderLayer &layer)
+{
+   if (layer.texture_id == 0) return;
+
+   Flush();
 
-   glBegin(GL_QUADS);
-   glTexCoord2d(   tx,    ty); glVertex3i(      x,        y, 0);
-   glTexCoord2d(   tx, ty+th); glVertex3i(      x, y+height, 0);
-   glTexCoord2d(tx+tw, ty+th); glVertex3i(x+width, y+height, 0);
-   glTexCoord2d(tx+tw,    ty); glVertex3i(x+width,        y, 0);
-   glEnd();
+   if (software) software->ReleaseTexture(layer.texture_id);
+   else
+   {
+      GLuint id = layer.texture_id;
+      glDeleteTextures(1, &id);
+   }
+
+   layer = RenderLayer();
+}
+
+void Renderer::DrawTexture(unsigned int texture_id, int x, int y, int w, int h, double tx, double ty, double tw, double th) const
+{
+   BatchQuad(texture_id, x + m_xoffset, y + m_yoffset, w, h, tx, ty, tw, th);
+}
+
+void Renderer::DrawQuads(unsigned int texture_id, const QuadList &quads) const
+{
+   if (batch.capacity() < batch.size() + quads.size() * 4) batch.reserve(batch.size() + quads.size() * 4);
+
+   for (QuadList::const_iterator q = quads.begin(); q != quads.end(); ++q)
+   {
+      BatchQuad(texture_id, q->x + m_xoffset, q->y + m_yoffset, q->w, q->h, q->tx, q->ty, q->tw, q->th);
+   }
 }
 
 void Renderer::DrawStretchedTga(const Tga *tga, int x, int y, int w, int h) const
@@ -133,17 +395,8 @@ void Renderer::DrawStretchedTga(const Tga *tga, int x, int y, int w, int h, int
    const int sx = x + m_xoffset;
    const int sy = y + m_yoffset;
 
-   const double tx =  static_cast<double>(src_x) / static_cast<double>(tga->GetWidth());
-   const double ty = -static_cast<double>(src_y) / static_cast<double>(tga->GetHeight());
-   const double tw =  static_cast<double>(src_w) / static_cast<double>(tga->GetWidth());
-   const double th = -static_cast<double>(src_h) / static_cast<double>(tga->GetHeight());
-
-   SelectTexture(tga->GetId());
+   double tx, ty, tw, th;
+   tga->TexCoords(src_x, src_y, src_w, src_h, &tx, &ty, &tw, &th);
 
-   glBegin(GL_QUADS);
-   glTexCoord2d(   tx,    ty); glVertex3i(  sx,   sy, 0);
-   glTexCoord2d(   tx, ty+th); glVertex3i(  sx, sy+h, 0);
-   glTexCoord2d(tx+tw, ty+th); glVertex3i(sx+w, sy+h, 0);
-   glTexCoord2d(tx+tw,    ty); glVertex3i(sx+w,   sy, 0);
-   glEnd();
+   BatchQuad(tga->GetId(), sx, sy, w, h, tx, ty, tw, th);
 }
@@ -5,6 +5,8 @@
 #ifndef __RENDERER_H
 #define __RENDERER_H
 
+#include <vector>
+
 #include "os_graphics.h"
 
 #ifdef WIN32
@@ -14,6 +16,8 @@ typedef AGLContext Context;
 #endif
 
 class Tga;
+class SoftwareRasterizer;
+class RenderRecording;
 class Text;
 class TextWriter;
 
@@ -22,6 +26,30 @@ struct Color
    int r, g, b, a;
 };
 
+// A copy of part of the frame (see Renderer::CaptureLayer)
+struct RenderLayer
+{
+   RenderLayer() : texture_id(0), width(0), height(0), tex_width(0), tex_height(0) { }
+
+   unsigned int texture_id;
+
+   int width;
+   int height;
+
+   // The texture is rounded up to power-of-two dimensions
+   int tex_width;
+   int tex_height;
+};
+
+// A quad worked out ahead of time, for Renderer::DrawQuads.  The texture
+// coordinates are in the same form DrawTexture takes.
+struct TexturedQuad
+{
+   int x, y, w, h;
+   double tx, ty, tw, th;
+};
+typedef std::vector<TexturedQuad> QuadList;
+
 class Renderer
 {
 public:
@@ -30,6 +58,17 @@ public:
 
    Renderer(Context context);
 
+   // Sends all drawing (from every Renderer) to the given rasterizer
+   // instead of OpenGL, or back to OpenGL when given 0.  Call this
+   // before any textures are loaded; textures from one can't be drawn
+   // with the other.  The context may be 0 while a rasterizer is in use.
+   static void UseSoftwareRasterizer(SoftwareRasterizer *rasterizer);
+   static SoftwareRasterizer *GetSoftwareRasterizer();
+
+   // Clears the screen and sets up the top-left-origin coordinate
+   // system everything else is drawn in
+   void BeginFrame(int screen_height, Color clear_color);
+
    void SwapBuffers();
 
    // 0 will disable vsync, 1 will enable.  (In Windows, >1 will skip frames.)
@@ -40,6 +79,21 @@ public:
 
    void ForceTexture(unsigned int texture_id);
 
+   // Quads are collected and drawn in batches.  Anything that draws
+   // with OpenGL directly should Flush first so it lands on top.
+   static void Flush();
+
+   // Number of batches sent to OpenGL during the last complete frame
+   static unsigned int GetDrawCallCount();
+
+   // Adds everything drawn (from every Renderer) to the recording, one
+   // frame per SwapBuffers, until given 0.
+   static void Record(RenderRecording *recording);
+   static RenderRecording *GetRecording();
+
+   // Lets a recording tell strings apart from other quads
+   static void RecordTextRun(unsigned int glyph_count);
+
    void SetColor(Color c);
    void SetColor(int r, int g, int b, int a = 0xFF);
    void DrawQuad(int x, int y, int w, int h);
@@ -50,6 +104,22 @@ public:
    void DrawStretchedTga(const Tga *tga, int x, int y, int w, int h) const;
    void DrawStretchedTga(const Tga *tga, int x, int y, int w, int h, int src_x, int src_y, int src_w, int src_h) const;
 
+   // Draws part of any texture (given in texture coordinates) with the current color
+   void DrawTexture(unsigned int texture_id, int x, int y, int w, int h, double tx, double ty, double tw, double th) const;
+
+   // Same as a DrawTexture for each quad, in order.  This lets something
+   // that draws a lot of quads build a few lists at once and then draw
+   // them in whatever order they need to stack.
+   void DrawQuads(unsigned int texture_id, const QuadList &quads) const;
+
+   // Copies everything drawn so far this frame inside the given rectangle
+   // into the layer, so drawing that never changes can be done once and
+   // then put back each frame with a single DrawLayer.  Layers are drawn
+   // (pixel for pixel) with the current color, so that's usually white.
+   void CaptureLayer(RenderLayer &layer, int x, int y, int w, int h) const;
+   void DrawLayer(const RenderLayer &layer, int x, int y) const;
+   static void ReleaseLayer(RenderLayer &layer);
+
 private:
 
    // NOTE: These are used externally by the friend
@@ -0,0 +1,109 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __ROLLING_HISTOGRAM_H
+#define __ROLLING_HISTOGRAM_H
+
+#include <vector>
+#include <algorithm>
+
+// Keeps the most recent "capacity" samples of some measurement (usually a
+// duration in microseconds) so percentiles can be pulled from a window
+// that follows recent behavior instead of averaging over all time.
+class RollingHistogram
+{
+public:
+   RollingHistogram(size_t capacity)
+      : m_capacity(capacity), m_next(0)
+   {
+      if (m_capacity < 1) m_capacity = 1;
+      m_samples.reserve(m_capacity);
+   }
+
+   void Add(unsigned long long sample)
+   {
+      if (m_samples.size() < m_capacity) m_samples.push_back(sample);
+      else m_samples[m_next] = sample;
+
+      m_next = (m_next + 1) % m_capacity;
+   }
+
+   void Clear()
+   {
+      m_samples.clear();
+      m_next = 0;
+   }
+
+   size_t Count() const { return m_samples.size(); }
+
+   // The largest sample in the window (0 if it's empty)
+   unsigned long long Max() const
+   {
+      if (m_samples.empty()) return 0;
+      return *std::max_element(m_samples.begin(), m_samples.end());
+   }
+
+   // Copies up to the last "count" samples into out, oldest first
+   void Recent(std::vector<unsigned long long> &out, size_t count) const
+   {
+      count = std::min(count, m_samples.size());
+      out.resize(count);
+
+      // m_next is always just past the newest sample
+      const size_t size = m_samples.size();
+      for (size_t i = 0; i < count; ++i) out[i] = m_samples[(m_next + size - count + i) % size];
+   }
+
+   // Fills out[i] with the sample at or below which fractions[i] of the
+   // window falls (e.g. 0.95 for the 95th percentile).  fractions must be
+   // in [0, 1].  An empty window gives all zeros.
+   void Percentiles(const double *fractions, unsigned long long *out, size_t count) const
+   {
+      if (m_samples.empty())
+      {
+         std::fill(out, out + count, 0ULL);
+         return;
+      }
+
+      // Sorting once is cheaper than a selection per percentile
+      m_sorted = m_samples;
+      std::sort(m_sorted.begin(), m_sorted.end());
+
+      for (size_t i = 0; i < count; ++i)
+      {
+         size_t index = static_cast<size_t>(fractions[i] * (m_sorted.size() - 1) + 0.5);
+         out[i] = m_sorted[std::min(index, m_sorted.size() - 1)];
+      }
+   }
+
+   // Counts the samples that fall in each power-of-two bucket:
+   // [0,1], [2,3], [4,7], [8,15], and so on.  The last bucket
+   // collects everything larger.
+   std::vector<size_t> Buckets(size_t bucket_count) const
+   {
+      std::vector<size_t> buckets(bucket_count, 0);
+      if (bucket_count == 0) return buckets;
+
+      for (std::vector<unsigned long long>::const_iterator i = m_samples.begin(); i != m_samples.end(); ++i)
+      {
+         size_t bucket = 0;
+         for (unsigned long long v = *i; v > 1; v >>= 1) bucket++;
+
+         buckets[std::min(bucket, bucket_count - 1)]++;
+      }
+
+      return buckets;
+   }
+
+private:
+   size_t m_capacity;
+   size_t m_next;
+
+   std::vector<unsigned long long> m_samples;
+
+   // Scratch space for Percentiles so it doesn't allocate every call
+   mutable std::vector<unsigned long long> m_sorted;
+};
+
+#endif
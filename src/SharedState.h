@@ -8,6 +8,7 @@
 #include <string>
 #include <vector>
 #include "TrackProperties.h"
+#include "libmidi/MidiTypes.h"
 
 class Midi;
 class MidiCommOut;
@@ -35,18 +36,35 @@ struct SongStatistics
 
 };
 
+typedef std::vector<MidiCommIn*> MidiCommInList;
+
 struct SharedState
 {
    SharedState()
-      : midi(0), midi_out(0), midi_in(0), song_speed(100)
+      : midi(0), midi_out(0), midi_in(0), latency_compensation(0), song_speed(100)
    { }
 
    Midi *midi;
    MidiCommOut *midi_out;
    MidiCommIn *midi_in;
 
+   // Any input devices beyond the one chosen on the title screen
+   // (e.g. a pedal unit, or a second player's keyboard).
+   MidiCommInList extra_midi_in;
+
+   // The measured round-trip latency of midi_out and midi_in together
+   // (see TitleState's calibration).  Live input is scored as if it
+   // arrived this much earlier.
+   microseconds_t latency_compensation;
+
    SongStatistics stats;
 
+   // One entry per input device: midi_in (if there is one) followed
+   // by each of extra_midi_in.  Only the fields about what was pressed
+   // on that device (score, notes played, stray notes, and notes
+   // pressed) are filled in.
+   std::vector<SongStatistics> device_stats;
+
    int song_speed;
 
    std::vector<Track::Properties> track_properties;
@@ -0,0 +1,172 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "SimulationThread.h"
+#include "CompatibleSystem.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+// After falling this many steps behind (the machine was busy, or a
+// Step took too long) the rest of the missed time is made up in one
+// larger step instead of a long burst of small ones.
+const static int MaxCatchUpSteps = 8;
+
+// The shortest the thread ever sleeps between checks
+const static unsigned long MinSleepMicroseconds = 1000;
+
+FixedStepThread::FixedStepThread()
+   : m_target(0), m_step(0), m_running(false), m_stopping(false), m_paused(false)
+{ }
+
+FixedStepThread::~FixedStepThread()
+{
+   Stop();
+}
+
+void FixedStepThread::Run()
+{
+   unsigned long long next_step = Compatible::GetMicroseconds();
+
+   while (true)
+   {
+      Lock();
+      const bool stopping = m_stopping;
+      if (m_paused)
+      {
+         // Nothing is owed for the time spent paused
+         next_step = Compatible::GetMicroseconds();
+      }
+      else if (!stopping)
+      {
+         const unsigned long long now = Compatible::GetMicroseconds();
+
+         int steps = 0;
+         while (next_step + m_step <= now && steps < MaxCatchUpSteps)
+         {
+            m_target->Step(m_step);
+            next_step += m_step;
+            ++steps;
+         }
+
+         if (next_step + m_step <= now)
+         {
+            m_target->Step(static_cast<unsigned long>(now - next_step));
+            next_step = now;
+         }
+      }
+      Unlock();
+
+      if (stopping) break;
+
+      // Sleep until the next step is due, but always for at least a
+      // millisecond (even if it's due already) so this thread never spins
+      // and the main thread gets the lock.  Any steps missed while asleep
+      // are caught up above.
+      const unsigned long long now = Compatible::GetMicroseconds();
+      const unsigned long long due = next_step + m_step;
+      const unsigned long wait = (due > now + MinSleepMicroseconds ? static_cast<unsigned long>(due - now) : MinSleepMicroseconds);
+
+#ifdef WIN32
+      // timeBeginPeriod (in Start) keeps this from rounding up to 15ms
+      Sleep((wait + 999) / 1000);
+#else
+      usleep(wait);
+#endif
+   }
+}
+
+void FixedStepThread::Pause()
+{
+   Lock();
+   m_paused = true;
+   Unlock();
+}
+
+void FixedStepThread::Resume()
+{
+   Lock();
+   m_paused = false;
+   Unlock();
+}
+
+#ifdef WIN32
+
+DWORD WINAPI FixedStepThread::ThreadMain(LPVOID self)
+{
+   static_cast<FixedStepThread*>(self)->Run();
+   return 0;
+}
+
+void FixedStepThread::Start(FixedStepTarget *target, unsigned long step_microseconds)
+{
+   if (m_running) return;
+
+   m_target = target;
+   m_step = step_microseconds;
+   m_stopping = false;
+   m_paused = false;
+
+   // Sleep(1) is closer to 15ms without this
+   timeBeginPeriod(1);
+
+   m_thread = CreateThread(0, 0, ThreadMain, this, 0, 0);
+   SetThreadPriority(m_thread, THREAD_PRIORITY_ABOVE_NORMAL);
+
+   m_running = true;
+}
+
+void FixedStepThread::Stop()
+{
+   if (!m_running) return;
+
+   Lock();
+   m_stopping = true;
+   Unlock();
+
+   WaitForSingleObject(m_thread, INFINITE);
+   CloseHandle(m_thread);
+
+   timeEndPeriod(1);
+
+   m_running = false;
+}
+
+#else
+
+void *FixedStepThread::ThreadMain(void *self)
+{
+   static_cast<FixedStepThread*>(self)->Run();
+   return 0;
+}
+
+void FixedStepThread::Start(FixedStepTarget *target, unsigned long step_microseconds)
+{
+   if (m_running) return;
+
+   m_target = target;
+   m_step = step_microseconds;
+   m_stopping = false;
+   m_paused = false;
+
+   pthread_create(&m_thread, 0, ThreadMain, this);
+
+   m_running = true;
+}
+
+void FixedStepThread::Stop()
+{
+   if (!m_running) return;
+
+   Lock();
+   m_stopping = true;
+   Unlock();
+
+   pthread_join(m_thread, 0);
+
+   m_running = false;
+}
+
+#endif
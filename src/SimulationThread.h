@@ -0,0 +1,124 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __SIMULATION_THREAD_H
+#define __SIMULATION_THREAD_H
+
+#include <algorithm>
+
+#include "ThreadLock.h"
+
+// Hands whole values from one writer thread to one reader thread
+// without either ever waiting on the other for more than a swap.
+//
+// The writer fills in Back() (completely -- it holds whatever stale
+// value was there last) and then publishes it.  The reader's Latest()
+// is the most recently published value, which stays put until the
+// reader asks again.
+template<class T> class TripleBuffer
+{
+public:
+   TripleBuffer() : m_back(0), m_ready(1), m_front(2), m_fresh(false) { }
+
+   T &Back() { return m_buffers[m_back]; }
+
+   void Publish()
+   {
+      m_lock.Lock();
+      std::swap(m_back, m_ready);
+      m_fresh = true;
+      m_lock.Unlock();
+   }
+
+   const T &Latest()
+   {
+      m_lock.Lock();
+      if (m_fresh)
+      {
+         std::swap(m_front, m_ready);
+         m_fresh = false;
+      }
+      m_lock.Unlock();
+
+      return m_buffers[m_front];
+   }
+
+private:
+   T m_buffers[3];
+
+   // Only the writer touches m_back and only the reader touches m_front.
+   // Either one may trade its buffer for m_ready (under the lock).
+   int m_back;
+   int m_ready;
+   int m_front;
+   bool m_fresh;
+
+   ThreadLock m_lock;
+};
+
+class FixedStepTarget
+{
+public:
+   virtual ~FixedStepTarget() { }
+
+   // Advances the simulation by this much real time.  Called on the
+   // FixedStepThread with its lock held.
+   virtual void Step(unsigned long step_microseconds) = 0;
+};
+
+// Runs a FixedStepTarget on its own thread, once for every step of
+// real time that passes, so the simulation keeps a steady pace no
+// matter how long the main thread spends drawing (or waiting on vsync).
+//
+// Anything the target shares with the main thread can be protected by
+// holding this thread's lock, which every Step is called under.
+class FixedStepThread
+{
+public:
+   FixedStepThread();
+   ~FixedStepThread();
+
+   // Stop waits for the current Step (if any) to finish
+   void Start(FixedStepTarget *target, unsigned long step_microseconds);
+   void Stop();
+
+   bool IsRunning() const { return m_running; }
+
+   // No Steps are taken between these.  Resuming picks up from the
+   // current time instead of catching up on the time spent paused.
+   // Pause waits for the current Step (if any) to finish.
+   void Pause();
+   void Resume();
+
+   void Lock() { m_lock.Lock(); }
+   void Unlock() { m_lock.Unlock(); }
+
+private:
+   // Not copyable
+   FixedStepThread(const FixedStepThread &);
+   FixedStepThread &operator=(const FixedStepThread &);
+
+   void Run();
+
+#ifdef WIN32
+   static DWORD WINAPI ThreadMain(LPVOID self);
+   HANDLE m_thread;
+#else
+   static void *ThreadMain(void *self);
+   pthread_t m_thread;
+#endif
+
+   FixedStepTarget *m_target;
+   unsigned long m_step;
+
+   bool m_running;
+
+   // Protected by m_lock
+   bool m_stopping;
+   bool m_paused;
+
+   ThreadLock m_lock;
+};
+
+#endif
@@ -0,0 +1,277 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "SoftwareRasterizer.h"
+
+#include <cmath>
+#include <fstream>
+#include <algorithm>
+using namespace std;
+
+// Matches the glTranslatef(0.375, 0.375, 0) in Renderer::BeginFrame
+const static float PixelOffset = 0.375f;
+
+static int Wrap(int i, int size)
+{
+   i %= size;
+   return (i < 0 ? i + size : i);
+}
+
+static unsigned char Blend(int source, int dest, int alpha)
+{
+   return static_cast<unsigned char>((source * alpha + dest * (255 - alpha) + 127) / 255);
+}
+
+SoftwareRasterizer::SoftwareRasterizer(int width, int height)
+   : m_width(max(width, 1)), m_height(max(height, 1))
+{
+   m_pixels.resize(static_cast<size_t>(m_width) * m_height * 4);
+   Clear(0, 0, 0);
+}
+
+void SoftwareRasterizer::Clear(int r, int g, int b)
+{
+   for (size_t i = 0; i < m_pixels.size(); i += 4)
+   {
+      m_pixels[i + 0] = static_cast<unsigned char>(r);
+      m_pixels[i + 1] = static_cast<unsigned char>(g);
+      m_pixels[i + 2] = static_cast<unsigned char>(b);
+      m_pixels[i + 3] = 0xFF;
+   }
+}
+
+unsigned int SoftwareRasterizer::CreateTexture(int width, int height, int components, const unsigned char *texels)
+{
+   unsigned int id;
+   if (m_free_ids.empty())
+   {
+      m_textures.push_back(Texture());
+      id = static_cast<unsigned int>(m_textures.size());
+   }
+   else
+   {
+      id = m_free_ids.back();
+      m_free_ids.pop_back();
+   }
+
+   Texture &texture = m_textures[id - 1];
+   texture.width = max(width, 1);
+   texture.height = max(height, 1);
+   texture.smooth = false;
+
+   const size_t texel_count = static_cast<size_t>(texture.width) * texture.height;
+   texture.texels.assign(texel_count * 4, 0);
+
+   for (size_t i = 0; i < texel_count; ++i)
+   {
+      unsigned char *out = &texture.texels[i * 4];
+      if (!texels)
+      {
+         out[3] = 0xFF;
+         continue;
+      }
+
+      const unsigned char *in = texels + i * components;
+      switch (components)
+      {
+      case 1:
+         out[0] = out[1] = out[2] = 0xFF;
+         out[3] = in[0];
+         break;
+
+      case 3:
+         out[0] = in[0];
+         out[1] = in[1];
+         out[2] = in[2];
+         out[3] = 0xFF;
+         break;
+
+      default:
+         out[0] = in[0];
+         out[1] = in[1];
+         out[2] = in[2];
+         out[3] = in[3];
+         break;
+      }
+   }
+
+   return id;
+}
+
+void SoftwareRasterizer::ReleaseTexture(unsigned int texture_id)
+{
+   if (texture_id == 0 || texture_id > m_textures.size()) return;
+
+   Texture &texture = m_textures[texture_id - 1];
+   if (texture.texels.empty()) return;
+
+   texture = Texture();
+   m_free_ids.push_back(texture_id);
+}
+
+void SoftwareRasterizer::SetSmooth(unsigned int texture_id, bool smooth)
+{
+   if (texture_id == 0 || texture_id > m_textures.size()) return;
+   m_textures[texture_id - 1].smooth = smooth;
+}
+
+void SoftwareRasterizer::CopyToTexture(unsigned int texture_id, int x, int y, int w, int h)
+{
+   if (texture_id == 0 || texture_id > m_textures.size()) return;
+   Texture &texture = m_textures[texture_id - 1];
+
+   for (int row = 0; row < h && row < texture.height; ++row)
+   {
+      const int source_y = y + h - 1 - row;
+      if (source_y < 0 || source_y >= m_height) continue;
+
+      for (int column = 0; column < w && column < texture.width; ++column)
+      {
+         const int source_x = x + column;
+         if (source_x < 0 || source_x >= m_width) continue;
+
+         const unsigned char *in = &m_pixels[(static_cast<size_t>(source_y) * m_width + source_x) * 4];
+         unsigned char *out = &texture.texels[(static_cast<size_t>(row) * texture.width + column) * 4];
+
+         out[0] = in[0];
+         out[1] = in[1];
+         out[2] = in[2];
+         out[3] = 0xFF;
+      }
+   }
+}
+
+void SoftwareRasterizer::Sample(const Texture &texture, float u, float v, unsigned char out[4]) const
+{
+   if (!texture.smooth)
+   {
+      const int x = Wrap(static_cast<int>(floor(u * texture.width)), texture.width);
+      const int y = Wrap(static_cast<int>(floor(v * texture.height)), texture.height);
+
+      const unsigned char *texel = &texture.texels[(static_cast<size_t>(y) * texture.width + x) * 4];
+      out[0] = texel[0];
+      out[1] = texel[1];
+      out[2] = texel[2];
+      out[3] = texel[3];
+      return;
+   }
+
+   const float fx = u * texture.width - 0.5f;
+   const float fy = v * texture.height - 0.5f;
+   const float left = floor(fx);
+   const float top = floor(fy);
+
+   const int x0 = Wrap(static_cast<int>(left), texture.width);
+   const int y0 = Wrap(static_cast<int>(top), texture.height);
+   const int x1 = Wrap(x0 + 1, texture.width);
+   const int y1 = Wrap(y0 + 1, texture.height);
+
+   const float ax = fx - left;
+   const float ay = fy - top;
+
+   const unsigned char *t00 = &texture.texels[(static_cast<size_t>(y0) * texture.width + x0) * 4];
+   const unsigned char *t10 = &texture.texels[(static_cast<size_t>(y0) * texture.width + x1) * 4];
+   const unsigned char *t01 = &texture.texels[(static_cast<size_t>(y1) * texture.width + x0) * 4];
+   const unsigned char *t11 = &texture.texels[(static_cast<size_t>(y1) * texture.width + x1) * 4];
+
+   for (int c = 0; c < 4; ++c)
+   {
+      const float upper = t00[c] + (t10[c] - t00[c]) * ax;
+      const float lower = t01[c] + (t11[c] - t01[c]) * ax;
+      out[c] = static_cast<unsigned char>(upper + (lower - upper) * ay + 0.5f);
+   }
+}
+
+void SoftwareRasterizer::DrawQuad(unsigned int texture_id, float x0, float y0, float x1, float y1,
+                                  float u0, float v0, float u1, float v1, const unsigned char color[4])
+{
+   if (x0 == x1 || y0 == y1) return;
+
+   const Texture *texture = 0;
+   if (texture_id > 0 && texture_id <= m_textures.size() && !m_textures[texture_id - 1].texels.empty())
+   {
+      texture = &m_textures[texture_id - 1];
+   }
+
+   // A pixel is covered when its center falls inside the (offset) quad
+   const float left = min(x0, x1) + PixelOffset;
+   const float right = max(x0, x1) + PixelOffset;
+   const float top = min(y0, y1) + PixelOffset;
+   const float bottom = max(y0, y1) + PixelOffset;
+
+   const int first_x = max(0, static_cast<int>(ceil(left - 0.5f)));
+   const int last_x = min(m_width, static_cast<int>(ceil(right - 0.5f)));
+   const int first_y = max(0, static_cast<int>(ceil(top - 0.5f)));
+   const int last_y = min(m_height, static_cast<int>(ceil(bottom - 0.5f)));
+
+   const float du = (u1 - u0) / (x1 - x0);
+   const float dv = (v1 - v0) / (y1 - y0);
+
+   for (int y = first_y; y < last_y; ++y)
+   {
+      const float v = v0 + dv * (y + 0.5f - (y0 + PixelOffset));
+      unsigned char *pixel = &m_pixels[(static_cast<size_t>(y) * m_width + first_x) * 4];
+
+      for (int x = first_x; x < last_x; ++x, pixel += 4)
+      {
+         int source[4] = { color[0], color[1], color[2], color[3] };
+
+         if (texture)
+         {
+            const float u = u0 + du * (x + 0.5f - (x0 + PixelOffset));
+
+            unsigned char texel[4];
+            Sample(*texture, u, v, texel);
+
+            for (int c = 0; c < 4; ++c) source[c] = (source[c] * texel[c] + 127) / 255;
+         }
+
+         const int alpha = source[3];
+         if (alpha == 0) continue;
+
+         pixel[0] = Blend(source[0], pixel[0], alpha);
+         pixel[1] = Blend(source[1], pixel[1], alpha);
+         pixel[2] = Blend(source[2], pixel[2], alpha);
+         pixel[3] = Blend(source[3], pixel[3], alpha);
+      }
+   }
+}
+
+bool SoftwareRasterizer::SaveTga(const wstring &filename) const
+{
+#ifdef WIN32
+   ofstream file(reinterpret_cast<const wchar_t*>(filename.c_str()), ios::binary);
+#else
+   // TODO: This isn't Unicode!
+   std::string narrow(filename.begin(), filename.end());
+   ofstream file(narrow.c_str(), ios::binary);
+#endif
+   if (!file.good()) return false;
+
+   unsigned char header[18] = { 0 };
+   header[2] = 2;
+   header[12] = static_cast<unsigned char>(m_width & 0xFF);
+   header[13] = static_cast<unsigned char>(m_width >> 8);
+   header[14] = static_cast<unsigned char>(m_height & 0xFF);
+   header[15] = static_cast<unsigned char>(m_height >> 8);
+   header[16] = 24;
+   file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+   // TGAs start at the bottom row and store BGR
+   vector<unsigned char> row(static_cast<size_t>(m_width) * 3);
+   for (int y = m_height - 1; y >= 0; --y)
+   {
+      const unsigned char *in = &m_pixels[static_cast<size_t>(y) * m_width * 4];
+      for (int x = 0; x < m_width; ++x)
+      {
+         row[x*3 + 0] = in[x*4 + 2];
+         row[x*3 + 1] = in[x*4 + 1];
+         row[x*3 + 2] = in[x*4 + 0];
+      }
+
+      file.write(reinterpret_cast<const char*>(&row[0]), static_cast<std::streamsize>(row.size()));
+   }
+
+   return file.good();
+}
@@ -0,0 +1,80 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __SOFTWARE_RASTERIZER_H
+#define __SOFTWARE_RASTERIZER_H
+
+#include <vector>
+#include <string>
+
+// Draws the Renderer's quads into an RGBA framebuffer in memory instead of
+// through OpenGL, so frames can be rendered (and timed, and compared with
+// known-good images) without a window or a graphics card.  See
+// Renderer::UseSoftwareRasterizer.
+//
+// This follows what the OpenGL setup in main() does closely enough to
+// compare frames: alpha blending, textures that wrap, nearest or linear
+// filtering per texture, and the same pixel coverage for quads drawn at
+// integer coordinates.
+//
+// Texture ids handed out here have nothing to do with OpenGL texture
+// names.  While a rasterizer is in use, everything that would create a
+// texture (Tga, the glyph atlases, render layers) creates it here.
+class SoftwareRasterizer
+{
+public:
+   SoftwareRasterizer(int width, int height);
+
+   int GetWidth() const { return m_width; }
+   int GetHeight() const { return m_height; }
+
+   // RGBA, top row first
+   const std::vector<unsigned char> &GetPixels() const { return m_pixels; }
+
+   void Clear(int r, int g, int b);
+
+   // Texels are tightly packed with 1 (alpha only, drawn as white), 3
+   // (RGB) or 4 (RGBA) components each, in the same row order they
+   // would be given to glTexImage2D.  Texels may be 0 for a black texture.
+   unsigned int CreateTexture(int width, int height, int components, const unsigned char *texels);
+   void ReleaseTexture(unsigned int texture_id);
+   void SetSmooth(unsigned int texture_id, bool smooth);
+
+   // Copies part of the framebuffer into the bottom-left corner of the
+   // texture, bottom row first (like glCopyTexSubImage2D)
+   void CopyToTexture(unsigned int texture_id, int x, int y, int w, int h);
+
+   // The corners are (x0,y0) and (x1,y1), with texture coordinates (u0,v0)
+   // and (u1,v1).  Texture 0 draws in the flat color.
+   void DrawQuad(unsigned int texture_id, float x0, float y0, float x1, float y1,
+      float u0, float v0, float u1, float v1, const unsigned char color[4]);
+
+   // Writes the framebuffer out as an uncompressed 24-bit TGA
+   bool SaveTga(const std::wstring &filename) const;
+
+private:
+   struct Texture
+   {
+      Texture() : width(0), height(0), smooth(false) { }
+
+      int width;
+      int height;
+      bool smooth;
+
+      // Always expanded to RGBA
+      std::vector<unsigned char> texels;
+   };
+
+   void Sample(const Texture &texture, float u, float v, unsigned char out[4]) const;
+
+   int m_width;
+   int m_height;
+   std::vector<unsigned char> m_pixels;
+
+   // Indexed by texture id - 1.  Released slots are reused.
+   std::vector<Texture> m_textures;
+   std::vector<unsigned int> m_free_ids;
+};
+
+#endif
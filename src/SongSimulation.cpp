@@ -0,0 +1,173 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "SongSimulation.h"
+#include "State_Playing.h"
+#include "Renderer.h"
+#include "SoftwareRasterizer.h"
+#include "PerformanceLog.h"
+#include "PianoGameError.h"
+#include "CompatibleSystem.h"
+#include "string_util.h"
+
+#include <map>
+#include <iomanip>
+
+#include "libmidi/Midi.h"
+#include "libmidi/MidiTrack.h"
+#include "libmidi/MidiEvent.h"
+
+using namespace std;
+
+// Presses every "You Play" note the moment it starts and
+// releases it the moment it ends.
+class PerfectPlayer : public VirtualInput
+{
+public:
+   PerfectPlayer(const TranslatedNoteList &notes, const vector<Track::Properties> &track_properties)
+      : m_notes(notes), m_track_properties(track_properties), m_next_note(0)
+   { }
+
+   bool Read(microseconds_t song_position, MidiEvent *ev)
+   {
+      // Releases go first so a key that is struck again
+      // immediately is let up before it is pressed.
+      if (!m_held_notes.empty() && m_held_notes.begin()->first <= song_position)
+      {
+         const NoteId note_id = m_held_notes.begin()->second;
+         m_held_notes.erase(m_held_notes.begin());
+
+         *ev = MidiEvent::Build(MidiEventSimple(0x80, static_cast<unsigned char>(note_id), 0));
+         return true;
+      }
+
+      while (m_next_note < m_notes.size() && m_notes[m_next_note].start <= song_position)
+      {
+         const TranslatedNote &n = m_notes[m_next_note++];
+         if (m_track_properties[n.track_id].mode != Track::ModeYouPlay) continue;
+
+         m_held_notes.insert(make_pair(n.end, n.note_id));
+
+         const unsigned char velocity = static_cast<unsigned char>(max(1, min(n.velocity, 127)));
+         *ev = MidiEvent::Build(MidiEventSimple(0x90, static_cast<unsigned char>(n.note_id), velocity));
+         return true;
+      }
+
+      return false;
+   }
+
+private:
+   const TranslatedNoteList &m_notes;
+   const vector<Track::Properties> &m_track_properties;
+
+   size_t m_next_note;
+
+   // Release time -> note
+   multimap<microseconds_t, NoteId> m_held_notes;
+};
+
+SimulationReport SimulateSong(Midi *midi, unsigned long frame_milliseconds, PerformanceReplay *replay, SoftwareRasterizer *rasterizer)
+{
+   if (!midi) throw PianoGameError(L"Cannot simulate a null MIDI.");
+
+   // PlayingState lays out its keyboard based on the screen size
+   // even when nothing is drawn.
+   int screen_width = 1024;
+   int screen_height = 768;
+   if (rasterizer)
+   {
+      screen_width = rasterizer->GetWidth();
+      screen_height = rasterizer->GetHeight();
+
+      // Before the state loads any textures
+      Renderer::UseSoftwareRasterizer(rasterizer);
+   }
+
+   // A safety net in case the state never finishes (e.g. a
+   // replay that leaves the song paused).  At 60 FPS this is
+   // more than four hours of song.
+   const static unsigned long MaxFrames = 1000000;
+
+   SharedState state;
+   state.midi = midi;
+   state.song_title = L"Simulation";
+
+   for (size_t i = 0; i < midi->Tracks().size(); ++i)
+   {
+      Track::Properties props;
+      if (midi->Tracks()[i].hasNotes()) props.mode = Track::ModeYouPlay;
+
+      state.track_properties.push_back(props);
+   }
+
+   PerfectPlayer perfect_player(midi->Notes(), state.track_properties);
+
+   PlayingState *playing = new PlayingState(state);
+   if (replay) playing->SetReplay(replay);
+   else playing->SetVirtualInput(&perfect_player);
+
+   SimulationReport report;
+
+   // The manager owns (and will delete) the state from here on out
+   GameStateManager manager(screen_width, screen_height);
+   manager.SetInitialState(playing);
+
+   Renderer renderer(0);
+
+   while (!manager.IsChangingState())
+   {
+      if (report.frame_count >= MaxFrames) throw PianoGameError(L"Simulation did not finish.");
+
+      const unsigned long long start = Compatible::GetMicroseconds();
+      manager.Advance(frame_milliseconds);
+      const unsigned long long elapsed = Compatible::GetMicroseconds() - start;
+
+      report.frame_count++;
+      report.total_update_microseconds += elapsed;
+      report.worst_update_microseconds = max(report.worst_update_microseconds, elapsed);
+
+      if (rasterizer)
+      {
+         const unsigned long long draw_start = Compatible::GetMicroseconds();
+         manager.Draw(renderer);
+         const unsigned long long draw_elapsed = Compatible::GetMicroseconds() - draw_start;
+
+         report.total_draw_microseconds += draw_elapsed;
+         report.worst_draw_microseconds = max(report.worst_draw_microseconds, draw_elapsed);
+      }
+   }
+
+   report.stats = playing->GetSharedState().stats;
+   return report;
+}
+
+wstring SimulationReport::Describe() const
+{
+   const double mean_update = (frame_count == 0 ? 0.0 : double(total_update_microseconds) / frame_count);
+   const double mean_draw = (frame_count == 0 ? 0.0 : double(total_draw_microseconds) / frame_count);
+
+   wstring draw_times;
+   if (total_draw_microseconds > 0)
+   {
+      draw_times = WSTRING(
+         L"Total draw time: " << total_draw_microseconds << L" us\n" <<
+         L"Mean draw time: " << fixed << setprecision(2) << mean_draw << L" us\n" <<
+         L"Worst draw time: " << worst_draw_microseconds << L" us\n");
+   }
+
+   return WSTRING(
+      L"Score: " << static_cast<int>(stats.score) << L"\n" <<
+      L"Notes hit: " << stats.notes_user_actually_played << L" / " << stats.notes_user_could_have_played << L"\n" <<
+      L"Total notes: " << stats.total_note_count << L"\n" <<
+      L"Stray notes: " << stats.stray_notes << L"\n" <<
+      L"Notes pressed: " << stats.total_notes_user_pressed << L"\n" <<
+      L"Longest combo: " << stats.longest_combo << L"\n" <<
+      L"Speed integral: " << stats.speed_integral << L"\n" <<
+      L"\n" <<
+      L"Frames: " << frame_count << L"\n" <<
+      L"Total update time: " << total_update_microseconds << L" us\n" <<
+      L"Mean update time: " << fixed << setprecision(2) << mean_update << L" us\n" <<
+      L"Worst update time: " << worst_update_microseconds << L" us\n" <<
+      draw_times);
+}
@@ -0,0 +1,52 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __SONG_SIMULATION_H
+#define __SONG_SIMULATION_H
+
+#include <string>
+#include "SharedState.h"
+
+class Midi;
+class PerformanceReplay;
+class SoftwareRasterizer;
+
+struct SimulationReport
+{
+   SimulationReport() : frame_count(0), total_update_microseconds(0), worst_update_microseconds(0),
+      total_draw_microseconds(0), worst_draw_microseconds(0) { }
+
+   SongStatistics stats;
+
+   unsigned long frame_count;
+
+   // Measured on the real clock.  This is the cost of the game logic
+   // alone (PlayingState::Update, including Play and Listen).
+   unsigned long long total_update_microseconds;
+   unsigned long long worst_update_microseconds;
+
+   // Only when the frames were drawn
+   unsigned long long total_draw_microseconds;
+   unsigned long long worst_draw_microseconds;
+
+   std::wstring Describe() const;
+};
+
+// Runs a PlayingState over an entire song with no window, no
+// rendering, and no MIDI devices.  The state is driven by a virtual
+// clock that advances frame_milliseconds per update, so a whole song
+// runs as fast as the game logic allows.
+//
+// Input comes from the given performance log if there is one (in which
+// case the log's frame lengths are used instead of frame_milliseconds).
+// Otherwise every track with notes is set to "You Play" and a perfect
+// player presses every note right on time.  The replay, if given, is
+// owned by the simulation from here on out.
+//
+// Given a rasterizer, every frame is also drawn into it (at its size) and
+// the drawing is timed.  The last frame is left in the rasterizer, and the
+// rasterizer is left in use by the Renderer.
+SimulationReport SimulateSong(Midi *midi, unsigned long frame_milliseconds, PerformanceReplay *replay, SoftwareRasterizer *rasterizer = 0);
+
+#endif
@@ -8,6 +8,10 @@
 #include "Renderer.h"
 #include "Textures.h"
 #include "CompatibleSystem.h"
+#include "UserSettings.h"
+#include "PianoGameError.h"
+#include "PerformanceLog.h"
+#include "InputLatency.h"
 
 #include <string>
 #include <iomanip>
@@ -24,26 +28,40 @@ using namespace std;
 
 #include "libmidi/MidiComm.h"
 
+// If either of these is set to a filename, the next song played will be
+// recorded to (or replayed from) that performance log.
+const static wstring RecordPerformanceKey = L"Record Performance";
+const static wstring ReplayPerformanceKey = L"Replay Performance";
+
+// Set to "on" to echo live input from the MIDI input thread
+const static wstring MidiThruKey = L"MIDI Thru";
+
+// How often live play is simulated (see SimulationThread.h)
+const static unsigned long SimulationStepMicroseconds = 1000;
+
+// Draw never guesses further ahead of the latest snapshot than this
+const static unsigned long long MaxInterpolationMicroseconds = 50000;
+
 void PlayingState::SetupNoteState()
 {
-   TranslatedNoteSet old = m_notes;
-   m_notes.clear();
+   const TranslatedNoteList &notes = m_state.midi->Notes();
 
-   for (TranslatedNoteSet::const_iterator i = old.begin(); i != old.end(); ++i)
-   {
-      TranslatedNote n = *i;
+   // After the first attempt, this reuses the existing allocation
+   m_note_states.assign(notes.size(), AutoPlayed);
 
-      n.state = AutoPlayed;
-      if (m_state.track_properties[n.track_id].mode == Track::ModeYouPlay) n.state = UserPlayable;
-      
-      m_notes.insert(n);
+   for (size_t i = 0; i < notes.size(); ++i)
+   {
+      if (m_state.track_properties[notes[i].track_id].mode == Track::ModeYouPlay) m_note_states[i] = UserPlayable;
    }
+
+   m_notes_begin = 0;
+   m_notes_end = 0;
 }
 
 void PlayingState::ResetSong()
 {
    if (m_state.midi_out) m_state.midi_out->Reset();
-   if (m_state.midi_in) m_state.midi_in->Reset();
+   ResetInputDevices();
 
    // TODO: These should be moved to a configuration file
    // along with ALL other "const static something" variables.
@@ -54,26 +72,93 @@ void PlayingState::ResetSong()
 
    m_state.midi->Reset(LeadIn, LeadOut);
 
-   m_notes = m_state.midi->Notes();
    SetupNoteState();
 
    m_state.stats = SongStatistics();
-   m_state.stats.total_note_count = static_cast<int>(m_notes.size());
+   m_state.stats.total_note_count = static_cast<int>(m_note_states.size());
+   m_state.device_stats.assign(InputDeviceCount(), SongStatistics());
 
    m_current_combo = 0;
 
    m_note_offset = 0;
    m_max_allowed_title_alpha = 1.0;
+
+   m_drawn_note_states = m_note_states;
+   m_drawn_notes_begin = 0;
+   PublishSnapshot();
 }
 
 PlayingState::PlayingState(const SharedState &state)
-   : m_state(state), m_keyboard(0), m_first_update(true), m_paused(false), m_any_you_play_tracks(false)
+   : m_state(state), m_keyboard(0), m_first_update(true), m_paused(false), m_any_you_play_tracks(false),
+   m_notes_begin(0), m_notes_end(0), m_log(0), m_replay(0), m_virtual_input(0), m_thru(false), m_drawn_notes_begin(0)
 { }
 
 void PlayingState::Init()
 {
    if (!m_state.midi) throw GameStateError("PlayingState: Init was passed a null MIDI!");
 
+   if (m_state.midi_in) m_input_devices.push_back(m_state.midi_in);
+   m_input_devices.insert(m_input_devices.end(), m_state.extra_midi_in.begin(), m_state.extra_midi_in.end());
+
+   // A replay handed in with SetReplay (by a headless simulation, for
+   // instance) may have nobody around to click through an error box
+   const bool replay_handed_in = (m_replay != 0);
+
+   const wstring replay_filename = UserSetting::Get(ReplayPerformanceKey, L"");
+   if (!m_replay && !m_virtual_input && !replay_filename.empty())
+   {
+      try
+      {
+         m_replay = new PerformanceReplay(replay_filename);
+      }
+      catch (const PianoGameError &e)
+      {
+         // Just play the song normally
+         Compatible::ShowError(e.GetErrorDescription());
+      }
+   }
+
+   if (m_replay)
+   {
+      if (m_replay->SongHash() != PerformanceSongHash(m_state.midi->Notes())
+         || m_replay->TrackModes().size() != m_state.track_properties.size())
+      {
+         delete m_replay;
+         m_replay = 0;
+
+         const wstring error = L"The performance log to replay was recorded with a different song.";
+         if (replay_handed_in) throw PianoGameError(error);
+
+         Compatible::ShowError(error);
+      }
+      else
+      {
+         // The replay needs to start out exactly like the recording did
+         m_state.song_speed = m_replay->SongSpeed();
+         m_state.latency_compensation = m_replay->LatencyCompensation();
+         for (size_t i = 0; i < m_state.track_properties.size(); ++i)
+         {
+            m_state.track_properties[i].mode = m_replay->TrackModes()[i];
+         }
+      }
+   }
+
+   // Virtual input has no devices to be late
+   if (m_virtual_input) m_state.latency_compensation = 0;
+
+   const wstring record_filename = UserSetting::Get(RecordPerformanceKey, L"");
+   if (!m_replay && !m_virtual_input && !record_filename.empty())
+   {
+      try
+      {
+         m_log = new PerformanceLog(record_filename, m_state, m_input_devices.size());
+      }
+      catch (const PianoGameError &e)
+      {
+         Compatible::ShowError(e.GetErrorDescription());
+      }
+   }
+
    m_look_ahead_you_play_note_count = 0;
    for (size_t i = 0; i < m_state.track_properties.size(); ++i)
    {
@@ -95,13 +180,46 @@ void PlayingState::Init()
    Compatible::HideMouseCursor();
 
    ResetSong();
+
+   // Replays and virtual input are played by Listen, same as always
+   if (!m_replay && !m_virtual_input && UserSetting::Get(MidiThruKey, L"off") == L"on") StartThru();
+
+   // Performance logs (and replays of them) record and play back one
+   // step per frame, so those stay on the main thread with the frames.
+   if (!m_log && !m_replay && !m_virtual_input) m_simulation.Start(this, SimulationStepMicroseconds);
 }
 
 PlayingState::~PlayingState()
 {
+   m_simulation.Stop();
+   StopThru();
+
+   delete m_log;
+   delete m_replay;
+
    Compatible::ShowMouseCursor();
 }
 
+void PlayingState::Suspend()
+{
+   // The song holds still while the window is in the background, the
+   // same as it does when playing on the main thread
+   m_simulation.Pause();
+}
+
+void PlayingState::Resume()
+{
+   if (!m_simulation.IsRunning()) return;
+
+   // Otherwise Draw would think the last snapshot was as old as the
+   // time spent away and move the notes ahead to make up for it
+   m_simulation.Lock();
+   PublishSnapshot();
+   m_simulation.Unlock();
+
+   m_simulation.Resume();
+}
+
 int PlayingState::CalcKeyboardHeight() const
 {
    // Start with the size of the screen
@@ -148,9 +266,7 @@ void PlayingState::Play(microseconds_t delta_microseconds)
       if (draw && (ev.Type() == MidiEventType_NoteOn || ev.Type() == MidiEventType_NoteOff))
       {
          int vel = ev.NoteVelocity();
-         const string name = MidiEvent::NoteName(ev.NoteNumber());
-
-         m_keyboard->SetKeyActive(name, (vel > 0), m_state.track_properties[track_id].color);
+         m_keys.Set(ev.NoteNumber(), (vel > 0), m_state.track_properties[track_id].color);
       }
 
       if (play && m_state.midi_out) m_state.midi_out->Write(ev);
@@ -168,14 +284,201 @@ double PlayingState::CalculateScoreMultiplier() const
    return std::min(MaxMultiplier, multiplier);
 }
 
+size_t PlayingState::FirstOpenNote(microseconds_t time) const
+{
+   // A note's window is closed once start + half the window <= time
+   return m_state.midi->NoteIndex().FirstStartingAt(time - KeyboardDisplay::NoteWindowLength / 2 + 1);
+}
+
+size_t PlayingState::InputDeviceCount() const
+{
+   if (m_replay) return m_replay->InputDeviceCount();
+   if (m_virtual_input) return 1;
+   return m_input_devices.size();
+}
+
+bool PlayingState::HasInput() const
+{
+   return (InputDeviceCount() > 0);
+}
+
+void PlayingState::ResetInputDevices()
+{
+   for (MidiCommInList::iterator i = m_input_devices.begin(); i != m_input_devices.end(); ++i) (*i)->Reset();
+}
+
+static bool InputArrivedEarlier(const PlayerInputEvent &lhs, const PlayerInputEvent &rhs)
+{
+   return lhs.timestamp < rhs.timestamp;
+}
+
+void PlayingState::GatherInput()
+{
+   m_input.clear();
+
+   if (m_replay)
+   {
+      PlayerInputEvent in;
+      in.timestamp = 0;
+      in.driver_delay = 0;
+      in.dequeued = 0;
+
+      MidiEventSimple simple;
+      while (m_replay->NextInput(&in.song_position, &in.device, &simple))
+      {
+         in.ev = MidiEvent::Build(simple);
+         m_input.push_back(in);
+      }
+
+      return;
+   }
+
+   PlayerInputEvent in;
+   in.timestamp = 0;
+   in.driver_delay = 0;
+   in.dequeued = 0;
+   in.song_position = m_state.midi->GetSongPositionInMicroseconds();
+   in.device = 0;
+
+   if (m_virtual_input)
+   {
+      while (m_virtual_input->Read(in.song_position, &in.ev)) m_input.push_back(in);
+      return;
+   }
+
+   // Score live input against when the player actually pressed the key
+   in.song_position -= m_state.latency_compensation;
+
+   for (size_t device = 0; device < m_input_devices.size(); ++device)
+   {
+      MidiCommIn *midi_in = m_input_devices[device];
+      in.device = device;
+
+      // Each device's events are already in the order they arrived,
+      // so merging each one into the (also already ordered) events
+      // from the devices before it keeps everything in arrival order.
+      const size_t merge_point = m_input.size();
+      while (midi_in->KeepReading())
+      {
+         in.ev = midi_in->Read(&in.timestamp, &in.driver_delay);
+         in.dequeued = Compatible::GetMicroseconds();
+
+         InputLatency::Record(InputLatencyDriver, in.driver_delay);
+         InputLatency::Record(InputLatencyQueue, in.dequeued - in.timestamp);
+
+         m_input.push_back(in);
+      }
+
+      if (merge_point > 0) inplace_merge(m_input.begin(), m_input.begin() + merge_point, m_input.end(), InputArrivedEarlier);
+   }
+
+   if (m_log)
+   {
+      MidiEventSimple simple;
+      for (PlayerInputList::const_iterator i = m_input.begin(); i != m_input.end(); ++i)
+      {
+         if (i->ev.GetSimpleEvent(&simple)) m_log->Input(i->song_position, i->device, simple);
+      }
+   }
+}
+
+void PlayingState::StartThru()
+{
+   if (!m_state.midi_out || m_input_devices.empty()) return;
+
+   for (MidiCommInList::iterator i = m_input_devices.begin(); i != m_input_devices.end(); ++i) (*i)->Thru().Start(m_state.midi_out);
+   m_thru = true;
+}
+
+void PlayingState::StopThru()
+{
+   if (!m_thru) return;
+
+   for (MidiCommInList::iterator i = m_input_devices.begin(); i != m_input_devices.end(); ++i) (*i)->Thru().Stop();
+   m_thru = false;
+}
+
+void PlayingState::UpdateThru(microseconds_t look_ahead)
+{
+   if (!m_thru) return;
+
+   const static unsigned int KeyCount = 128;
+   const TranslatedNote *targets[KeyCount];
+   for (unsigned int k = 0; k < KeyCount; ++k) targets[k] = 0;
+
+   // Listen eats input while paused, so the thru stays quiet too
+   if (!m_paused)
+   {
+      const TranslatedNoteList &notes = m_state.midi->Notes();
+      const microseconds_t cur_time = m_state.midi->GetSongPositionInMicroseconds() - m_state.latency_compensation;
+
+      // A long held note can keep m_notes_begin far behind, so skip
+      // straight to the first note whose window is still open
+      const size_t first = max(m_notes_begin, FirstOpenNote(cur_time));
+      for (size_t n = first; n < notes.size(); ++n)
+      {
+         const TranslatedNote &note = notes[n];
+
+         const microseconds_t window_start = note.start - (KeyboardDisplay::NoteWindowLength / 2);
+         const microseconds_t window_end = note.start + (KeyboardDisplay::NoteWindowLength / 2);
+
+         if (window_start > cur_time + look_ahead) break;
+         if (m_note_states[n] != UserPlayable || window_end <= cur_time) continue;
+
+         // Undo the octave sliding to find the key that would play this note
+         const int key = note.note_id - m_note_offset;
+         if (key < 0 || key >= static_cast<int>(KeyCount)) continue;
+
+         // The earliest note is the one that's about to be missed
+         if (!targets[key]) targets[key] = &note;
+      }
+   }
+
+   for (MidiCommInList::iterator i = m_input_devices.begin(); i != m_input_devices.end(); ++i)
+   {
+      MidiThru &thru = (*i)->Thru();
+      for (unsigned int k = 0; k < KeyCount; ++k)
+      {
+         const TranslatedNote *t = targets[k];
+         if (!t) thru.ClearKey(static_cast<unsigned char>(k));
+         else thru.SetKey(static_cast<unsigned char>(k), static_cast<unsigned char>(t->note_id),
+            static_cast<unsigned char>(t->channel), static_cast<unsigned char>(max(0, min(t->velocity, 127))));
+      }
+   }
+}
+
+void PlayingState::PlayInput(const PlayerInputEvent &in)
+{
+   if (!m_state.midi_out) return;
+
+   // The input thread already sent it
+   if (m_thru && in.timestamp != 0) return;
+
+   if (in.timestamp == 0)
+   {
+      m_state.midi_out->Write(in.ev);
+      return;
+   }
+
+   const unsigned long long matched = Compatible::GetMicroseconds();
+   m_state.midi_out->Write(in.ev);
+   const unsigned long long written = Compatible::GetMicroseconds();
+
+   InputLatency::Record(InputLatencyMatch, matched - in.dequeued);
+   InputLatency::Record(InputLatencyOutput, written - matched);
+   InputLatency::Record(InputLatencyTotal, in.driver_delay + (written - in.timestamp));
+}
+
 void PlayingState::Listen()
 {
-   if (!m_state.midi_in) return;
+   if (!HasInput()) return;
 
-   while (m_state.midi_in->KeepReading())
+   GatherInput();
+   for (PlayerInputList::iterator in = m_input.begin(); in != m_input.end(); ++in)
    {
-      microseconds_t cur_time = m_state.midi->GetSongPositionInMicroseconds();
-      MidiEvent ev = m_state.midi_in->Read();
+      const microseconds_t cur_time = in->song_position;
+      SongStatistics &device_stats = m_state.device_stats[in->device];
+      MidiEvent &ev = in->ev;
 
       // Just eat input if we're paused
       if (m_paused) continue;
@@ -186,8 +489,6 @@ void PlayingState::Listen()
       // Octave Sliding
       ev.ShiftNote(m_note_offset);
 
-      string note_name = MidiEvent::NoteName(ev.NoteNumber());
-
       // On key release we have to look for existing "active" notes and turn them off.
       if (ev.Type() == MidiEventType_NoteOff || ev.NoteVelocity() == 0)
       {
@@ -198,25 +499,38 @@ void PlayingState::Listen()
          for (ActiveNoteSet::iterator i = m_active_notes.begin(); i != m_active_notes.end(); ++i)
          {
             if (ev.NoteNumber() != i->note_id) continue;
+            if (in->device != i->device) continue;
 
             // Play it on the correct channel to turn the note we started
             // previously, off.
             ev.SetChannel(i->channel);
-            if (m_state.midi_out) m_state.midi_out->Write(ev);
+            PlayInput(*in);
 
             m_active_notes.erase(i);
             break;
          }
 
-         m_keyboard->SetKeyActive(note_name, false, Track::FlatGray);
+         // Another device may still be holding the same key down
+         bool still_held = false;
+         for (ActiveNoteSet::const_iterator i = m_active_notes.begin(); i != m_active_notes.end(); ++i)
+         {
+            if (ev.NoteNumber() == i->note_id) still_held = true;
+         }
+
+         if (!still_held) m_keys.Set(ev.NoteNumber(), false, Track::FlatGray);
          continue;
       }
 
       bool any_found = false;
 
-      TranslatedNoteSet::iterator closest_match = m_notes.end();
-      for (TranslatedNoteSet::iterator i = m_notes.begin(); i != m_notes.end(); ++i)
+      const TranslatedNoteList &notes = m_state.midi->Notes();
+
+      size_t closest_index = notes.size();
+      const TranslatedNote *closest_match = 0;
+      for (size_t n = max(m_notes_begin, FirstOpenNote(cur_time)); n < notes.size(); ++n)
       {
+         const TranslatedNote *i = &notes[n];
+
          const microseconds_t window_start = i->start - (KeyboardDisplay::NoteWindowLength / 2);
          const microseconds_t window_end = i->start + (KeyboardDisplay::NoteWindowLength / 2);
 
@@ -224,13 +538,14 @@ void PlayingState::Listen()
          // have been played yet, we're done.
          if (window_start > cur_time) break;
 
-         if (i->state != UserPlayable) continue;
+         if (m_note_states[n] != UserPlayable) continue;
 
          if (window_end > cur_time && i->note_id == ev.NoteNumber())
          {
-            if (closest_match == m_notes.end())
+            if (closest_match == 0)
             {
                closest_match = i;
+               closest_index = n;
                continue;
             }
 
@@ -240,13 +555,17 @@ void PlayingState::Listen()
             microseconds_t known_best = cur_time - closest_match->start;
             if (closest_match->start > cur_time) known_best = closest_match->start - cur_time;
 
-            if (this_distance < known_best) closest_match = i;
+            if (this_distance < known_best)
+            {
+               closest_match = i;
+               closest_index = n;
+            }
          }
       }
 
       Track::TrackColor note_color = Track::FlatGray;
 
-      if (closest_match != m_notes.end())
+      if (closest_match != 0)
       {
          any_found = true;
          note_color = m_state.track_properties[closest_match->track_id].color;
@@ -257,59 +576,45 @@ void PlayingState::Listen()
          n.channel = closest_match->channel;
          n.note_id = closest_match->note_id;
          n.velocity = closest_match->velocity;
+         n.device = in->device;
          m_active_notes.insert(n);
 
          // Play it
          ev.SetChannel(n.channel);
          ev.SetVelocity(n.velocity);
-         if (m_state.midi_out) m_state.midi_out->Write(ev);
+         PlayInput(*in);
 
          // Adjust our statistics
          const static double NoteValue = 100.0;
-         m_state.stats.score += NoteValue * CalculateScoreMultiplier() * (m_state.song_speed / 100.0);
+         const double note_score = NoteValue * CalculateScoreMultiplier() * (m_state.song_speed / 100.0);
+         m_state.stats.score += note_score;
+         device_stats.score += note_score;
 
          m_state.stats.notes_user_could_have_played++;
          m_state.stats.speed_integral += m_state.song_speed;
 
          m_state.stats.notes_user_actually_played++;
+         device_stats.notes_user_actually_played++;
          m_current_combo++;
          m_state.stats.longest_combo = max(m_current_combo, m_state.stats.longest_combo);
 
-         TranslatedNote replacement = *closest_match;
-         replacement.state = UserHit;
-         
-         m_notes.erase(closest_match);
-         m_notes.insert(replacement);
+         m_note_states[closest_index] = UserHit;
       }
       else
       {
          m_state.stats.stray_notes++;
+         device_stats.stray_notes++;
       }
 
       m_state.stats.total_notes_user_pressed++;
-      m_keyboard->SetKeyActive(note_name, true, note_color);
+      device_stats.total_notes_user_pressed++;
+      m_keys.Set(ev.NoteNumber(), true, note_color);
    }
 }
 
-void PlayingState::Update()
+void PlayingState::Step(unsigned long step_microseconds)
 {
-   // Calculate how visible the title bar should be
-   const static double fade_in_ms = 350.0;
-   const static double stay_ms = 2500.0;
-   const static double fade_ms = 500.0;
-
-   m_title_alpha = 0.0;
-   unsigned long ms = GetStateMilliseconds() * max(m_state.song_speed, 50) / 100;
-   if (double(ms) <= stay_ms) m_title_alpha = std::min(1.0, ms / fade_in_ms);
-   if (double(ms) >= stay_ms) m_title_alpha = std::min(std::max((fade_ms - (ms - stay_ms)) / fade_ms, 0.0), 1.0);
-
-   // Lock down the alpha so that if you are slowing the song down as it
-   // fades out, it doesn't cut back into a much higher alpha value
-   m_title_alpha = std::min(m_title_alpha, m_max_allowed_title_alpha);
-   if (double(ms) > stay_ms) m_max_allowed_title_alpha = m_title_alpha;
-
-
-   microseconds_t delta_microseconds = static_cast<microseconds_t>(GetDeltaMilliseconds()) * 1000;
+   microseconds_t delta_microseconds = static_cast<microseconds_t>(step_microseconds);
 
    // The 100 term is really paired with the playback speed, but this
    // formation is less likely to produce overflow errors.
@@ -329,32 +634,29 @@ void PlayingState::Update()
 
 
    microseconds_t cur_time = m_state.midi->GetSongPositionInMicroseconds();
+   const TranslatedNoteList &notes = m_state.midi->Notes();
 
-   // Delete notes that are finished playing (and are no longer available to hit)
-   TranslatedNoteSet::iterator i = m_notes.begin();
-   while (i != m_notes.end())
-   {
-      TranslatedNoteSet::iterator note = i++;
+   // Song position only ever moves forward (until the next ResetSong),
+   // so the end cursor can just keep sliding along behind it.
+   while (m_notes_end < notes.size() && notes[m_notes_end].start <= cur_time) m_notes_end++;
 
-      const microseconds_t window_end = note->start + (KeyboardDisplay::NoteWindowLength / 2);
+   // Input is scored this far behind the song (see Listen)
+   const microseconds_t player_time = cur_time - m_state.latency_compensation;
 
-      if (m_state.midi_in && note->state == UserPlayable && window_end <= cur_time)
-      {
-         TranslatedNote note_copy = *note;
-         note_copy.state = UserMissed;
-         
-         m_notes.erase(note);
-         m_notes.insert(note_copy);
-         
-         // Re-connect the (now-invalid) iterator to the replacement
-         note = m_notes.find(note_copy);
-      }
+   // Retire notes that are finished playing (and are no longer available to hit)
+   for (size_t n = m_notes_begin; n < m_notes_end; ++n)
+   {
+      unsigned char &state = m_note_states[n];
+      if (state == Retired) continue;
+
+      const TranslatedNote &note = notes[n];
+      const microseconds_t window_end = note.start + (KeyboardDisplay::NoteWindowLength / 2);
 
-      if (note->start > cur_time) break;
+      if (HasInput() && state == UserPlayable && window_end <= player_time) state = UserMissed;
 
-      if (note->end < cur_time && window_end < cur_time)
+      if (note.end < player_time && window_end < player_time)
       {
-         if (note->state == UserMissed)
+         if (state == UserMissed)
          {
             // They missed a note, reset the combo counter
             m_current_combo = 0;
@@ -363,16 +665,93 @@ void PlayingState::Update()
             m_state.stats.speed_integral += m_state.song_speed;
          }
 
-         m_notes.erase(note);
+         state = Retired;
+      }
+   }
+
+   while (m_notes_begin < m_notes_end && m_note_states[m_notes_begin] == Retired) m_notes_begin++;
+
+   UpdateThru(delta_microseconds);
+
+   PublishSnapshot();
+}
+
+void PlayingState::PublishSnapshot()
+{
+   const microseconds_t cur_time = m_state.midi->GetSongPositionInMicroseconds();
+
+   PlayingSnapshot &snapshot = m_snapshots.Back();
+   snapshot.song_position = cur_time;
+   snapshot.taken = Compatible::GetMicroseconds();
+   snapshot.percentage_complete = m_state.midi->GetSongPercentageComplete();
+   snapshot.stats = m_state.stats;
+   snapshot.combo = m_current_combo;
+   snapshot.score_multiplier = CalculateScoreMultiplier();
+   snapshot.keys = m_keys;
+
+   // Listen can't touch a note before its scoring window opens, so
+   // nothing past this point has changed yet
+   const size_t notes_end = max(m_notes_end, m_state.midi->NoteIndex().FirstStartingAt(cur_time + KeyboardDisplay::NoteWindowLength));
+
+   snapshot.notes_begin = m_notes_begin;
+   snapshot.note_states.assign(m_note_states.begin() + m_notes_begin, m_note_states.begin() + notes_end);
+
+   m_snapshots.Publish();
+}
+
+void PlayingState::Update()
+{
+   // Calculate how visible the title bar should be
+   const static double fade_in_ms = 350.0;
+   const static double stay_ms = 2500.0;
+   const static double fade_ms = 500.0;
+
+   m_title_alpha = 0.0;
+   unsigned long ms = GetStateMilliseconds() * max(m_state.song_speed, 50) / 100;
+   if (double(ms) <= stay_ms) m_title_alpha = std::min(1.0, ms / fade_in_ms);
+   if (double(ms) >= stay_ms) m_title_alpha = std::min(std::max((fade_ms - (ms - stay_ms)) / fade_ms, 0.0), 1.0);
+
+   // Lock down the alpha so that if you are slowing the song down as it
+   // fades out, it doesn't cut back into a much higher alpha value
+   m_title_alpha = std::min(m_title_alpha, m_max_allowed_title_alpha);
+   if (double(ms) > stay_ms) m_max_allowed_title_alpha = m_title_alpha;
+
+
+   const bool simulating = m_simulation.IsRunning();
+   if (simulating)
+   {
+      // The simulation thread takes care of the song.  All that's left
+      // here are the controls, which it shares.
+      m_simulation.Lock();
+   }
+   else
+   {
+      unsigned long delta_milliseconds = GetDeltaMilliseconds();
+      if (m_replay && !m_replay->NextFrame(&delta_milliseconds))
+      {
+         // A log that runs out before the song is over means the
+         // player left early during the recording.  So do we.
+         if (m_state.midi_out) m_state.midi_out->Reset();
+
+         ChangeState(new TrackSelectionState(m_state));
+         return;
       }
+      if (m_log) m_log->Frame(delta_milliseconds);
+
+      Step(delta_milliseconds * 1000);
    }
 
-   if(IsKeyPressed(KeyPlus))
+   const int old_note_offset = m_note_offset;
+   const int old_song_speed = m_state.song_speed;
+   const bool old_paused = m_paused;
+
+   // During a replay, these come from the log instead of the keyboard
+   if(!m_replay && IsKeyPressed(KeyPlus))
    {
       m_note_offset += 12;
    }
 
-   if(IsKeyPressed(KeyMinus))
+   if(!m_replay && IsKeyPressed(KeyMinus))
    {
       m_note_offset -= 12;
    }
@@ -393,58 +772,129 @@ void PlayingState::Update()
       if (m_show_duration > MaxShowDuration) m_show_duration = MaxShowDuration;
    }
 
-   if (IsKeyPressed(KeyLeft))
+   if (!m_replay && IsKeyPressed(KeyLeft))
    {
       m_state.song_speed -= 10;
       if (m_state.song_speed < 0) m_state.song_speed = 0;
    }
 
-   if (IsKeyPressed(KeyRight))
+   if (!m_replay && IsKeyPressed(KeyRight))
    {
       m_state.song_speed += 10;
       if (m_state.song_speed > 400) m_state.song_speed = 400;
    }
 
-   if (IsKeyPressed(KeySpace))
+   if (!m_replay && IsKeyPressed(KeySpace))
    {
       m_paused = !m_paused;
    }
 
+   if (m_replay)
+   {
+      PerformanceRecordType type;
+      int value;
+      while (m_replay->NextChange(&type, &value))
+      {
+         switch (type)
+         {
+         case PerformanceRecordNoteOffset: m_note_offset = value; break;
+         case PerformanceRecordSpeed:      m_state.song_speed = value; break;
+         case PerformanceRecordPause:      m_paused = (value != 0); break;
+         default: break;
+         }
+      }
+   }
+
+   if (m_log)
+   {
+      if (m_note_offset != old_note_offset) m_log->NoteOffset(m_note_offset);
+      if (m_state.song_speed != old_song_speed) m_log->Speed(m_state.song_speed);
+      if (m_paused != old_paused) m_log->Pause(m_paused);
+   }
+
+   const bool song_over = m_state.midi->IsSongOver();
+   if (simulating) m_simulation.Unlock();
+
    if (IsKeyPressed(KeyEscape))
    {
+      m_simulation.Stop();
+      StopThru();
       if (m_state.midi_out) m_state.midi_out->Reset();
-      if (m_state.midi_in) m_state.midi_in->Reset();
+      ResetInputDevices();
 
       ChangeState(new TrackSelectionState(m_state));
       return;
    }
 
-   if (m_state.midi->IsSongOver())
+   if (song_over)
    {
+      m_simulation.Stop();
+      StopThru();
       if (m_state.midi_out) m_state.midi_out->Reset();
-      if (m_state.midi_in) m_state.midi_in->Reset();
+      ResetInputDevices();
 
-      if (m_state.midi_in && m_any_you_play_tracks) ChangeState(new StatsState(m_state));
+      if (HasInput() && m_any_you_play_tracks) ChangeState(new StatsState(m_state));
       else ChangeState(new TrackSelectionState(m_state));
 
       return;
    }
 }
 
+void PlayingState::DeclareTextures(TextureList &textures) const
+{
+   textures.push_back(PlayStatus);
+   textures.push_back(PlayStatus2);
+   textures.push_back(PlayKeys);
+   textures.push_back(PlayKeyRail);
+   textures.push_back(PlayKeyShadow);
+   textures.push_back(PlayKeysBlack);
+   textures.push_back(PlayNotesWhiteShadow);
+   textures.push_back(PlayNotesBlackShadow);
+   textures.push_back(PlayNotesWhiteColor);
+   textures.push_back(PlayNotesBlackColor);
+}
+
 void PlayingState::Draw(Renderer &renderer) const
 {
    const Tga *key_tex[3] = { GetTexture(PlayKeyRail),
                              GetTexture(PlayKeyShadow),
-                             GetTexture(PlayKeysBlack, true) };
+                             GetTexture(PlayKeysBlack) };
 
-   const Tga *note_tex[4] = { GetTexture(PlayNotesWhiteShadow, true),
-                              GetTexture(PlayNotesBlackShadow, true),
-                              GetTexture(PlayNotesWhiteColor, true),
-                              GetTexture(PlayNotesBlackColor, true) };
+   const Tga *note_tex[4] = { GetTexture(PlayNotesWhiteShadow),
+                              GetTexture(PlayNotesBlackShadow),
+                              GetTexture(PlayNotesWhiteColor),
+                              GetTexture(PlayNotesBlackColor) };
    renderer.ForceTexture(0);
 
-   m_keyboard->Draw(renderer, key_tex, note_tex, Layout::ScreenMarginX, 0, m_notes, m_show_duration,
-      m_state.midi->GetSongPositionInMicroseconds(), m_state.track_properties);
+   const PlayingSnapshot &snapshot = m_snapshots.Latest();
+
+   // Notes only ever retire in order, so everything before the
+   // snapshot's first note is finished
+   for (; m_drawn_notes_begin < snapshot.notes_begin; ++m_drawn_notes_begin) m_drawn_note_states[m_drawn_notes_begin] = Retired;
+   copy(snapshot.note_states.begin(), snapshot.note_states.end(), m_drawn_note_states.begin() + snapshot.notes_begin);
+
+   m_keyboard->SetKeys(snapshot.keys);
+
+   // A snapshot from the simulation thread is already a little old by
+   // the time it's drawn.  While the song is moving, account for that.
+   microseconds_t song_position = snapshot.song_position;
+   if (m_simulation.IsRunning() && !m_paused)
+   {
+      const unsigned long long age = min(Compatible::GetMicroseconds() - snapshot.taken, MaxInterpolationMicroseconds);
+      song_position += static_cast<microseconds_t>(age / 100) * m_state.song_speed;
+   }
+
+   // The calibrated round trip can't be split into its output and input
+   // halves, so assume they're even: the falling notes are drawn late by
+   // the output half, so they reach the keyboard right as the song's
+   // sound does.  (Listen makes up for both halves.)
+   const microseconds_t draw_time = song_position - m_state.latency_compensation / 2;
+
+   // Past the snapshot's notes, nothing has been touched yet
+   const size_t states_end = snapshot.notes_begin + snapshot.note_states.size();
+
+   m_keyboard->Draw(renderer, key_tex, note_tex, Layout::ScreenMarginX, 0, m_state.midi->Notes(), m_drawn_note_states,
+      m_state.midi->NoteIndex(), snapshot.notes_begin, states_end, m_show_duration, draw_time, m_state.track_properties);
 
    wstring title_text = m_state.song_title;
 
@@ -475,11 +925,11 @@ void PlayingState::Draw(Renderer &renderer) const
    renderer.DrawTga(GetTexture(PlayStatus),  Layout::ScreenMarginX - 1,   text_y);
    renderer.DrawTga(GetTexture(PlayStatus2), Layout::ScreenMarginX + 273, text_y);
 
-   wstring multiplier_text = WSTRING(fixed << setprecision(1) << CalculateScoreMultiplier());
+   wstring multiplier_text = WSTRING(fixed << setprecision(1) << snapshot.score_multiplier);
    wstring speed_text = WSTRING(m_state.song_speed << "%");
 
    TextWriter score(Layout::ScreenMarginX + 92, text_y + 3, renderer, false, Layout::ScoreFontSize);
-   score << static_cast<int>(m_state.stats.score);
+   score << static_cast<int>(snapshot.stats.score);
 
    TextWriter multipliers(Layout::ScreenMarginX + 236, text_y + 9, renderer, false, Layout::TitleFontSize);
    multipliers << Text(multiplier_text, Renderer::ToColor(138, 226, 52));
@@ -490,11 +940,11 @@ void PlayingState::Draw(Renderer &renderer) const
 
    double non_zero_playback_speed = ( (m_state.song_speed == 0) ? 0.1 : (m_state.song_speed/100.0) );
    microseconds_t tot_seconds = static_cast<microseconds_t>((m_state.midi->GetSongLengthInMicroseconds() / 100000.0) / non_zero_playback_speed);
-   microseconds_t cur_seconds = static_cast<microseconds_t>((m_state.midi->GetSongPositionInMicroseconds() / 100000.0) / non_zero_playback_speed);
+   microseconds_t cur_seconds = static_cast<microseconds_t>((snapshot.song_position / 100000.0) / non_zero_playback_speed);
    if (cur_seconds < 0) cur_seconds = 0;
    if (cur_seconds > tot_seconds) cur_seconds = tot_seconds;
 
-   int completion  = static_cast<int>(m_state.midi->GetSongPercentageComplete() * 100.0);
+   int completion  = static_cast<int>(snapshot.percentage_complete * 100.0);
 
    unsigned int tot_min = static_cast<unsigned int>((tot_seconds/10) / 60);
    unsigned int tot_sec = static_cast<unsigned int>((tot_seconds/10) % 60);
@@ -512,7 +962,7 @@ void PlayingState::Draw(Renderer &renderer) const
    time_text << WSTRING(current_time << L" / " << total_time << percent_complete);
 
    // Draw a song progress bar along the top of the screen
-   const int time_pb_width = static_cast<int>(m_state.midi->GetSongPercentageComplete() * (GetStateWidth() - Layout::ScreenMarginX*2));
+   const int time_pb_width = static_cast<int>(snapshot.percentage_complete * (GetStateWidth() - Layout::ScreenMarginX*2));
    const int pb_x = Layout::ScreenMarginX;
    const int pb_y = CalcKeyboardHeight() + 25;
 
@@ -523,8 +973,8 @@ void PlayingState::Draw(Renderer &renderer) const
    {
       const double note_count = 1.0 * m_look_ahead_you_play_note_count;
 
-      const int note_miss_pb_width = static_cast<int>(m_state.stats.notes_user_could_have_played / note_count * (GetStateWidth() - Layout::ScreenMarginX*2));
-      const int note_hit_pb_width = static_cast<int>(m_state.stats.notes_user_actually_played / note_count * (GetStateWidth() - Layout::ScreenMarginX*2));
+      const int note_miss_pb_width = static_cast<int>(snapshot.stats.notes_user_could_have_played / note_count * (GetStateWidth() - Layout::ScreenMarginX*2));
+      const int note_hit_pb_width = static_cast<int>(snapshot.stats.notes_user_actually_played / note_count * (GetStateWidth() - Layout::ScreenMarginX*2));
 
       renderer.SetColor(0xCE,0x5C,0x00);
       renderer.DrawQuad(pb_x, pb_y - 20, note_miss_pb_width, 16);
@@ -534,16 +984,16 @@ void PlayingState::Draw(Renderer &renderer) const
    }
 
    // Show the combo
-   if (m_current_combo > 5)
+   if (snapshot.combo > 5)
    {
       int combo_font_size = 20;
-      combo_font_size += (m_current_combo / 10);
+      combo_font_size += (snapshot.combo / 10);
 
       int combo_x = GetStateWidth() / 2;
       int combo_y = GetStateHeight() - CalcKeyboardHeight() + 30 - (combo_font_size/2);
 
       TextWriter combo_text(combo_x, combo_y, renderer, true, combo_font_size);
-      combo_text << WSTRING(m_current_combo << L" Combo!");
+      combo_text << WSTRING(snapshot.combo << L" Combo!");
    }
 }
 
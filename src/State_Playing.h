@@ -12,11 +12,16 @@
 #include "SharedState.h"
 #include "GameState.h"
 #include "KeyboardDisplay.h"
+#include "SimulationThread.h"
+
+#include "libmidi/MidiEvent.h"
 
 struct TrackProperties;
 class Midi;
 class MidiCommOut;
 class MidiCommIn;
+class PerformanceLog;
+class PerformanceReplay;
 
 struct ActiveNote
 {
@@ -28,25 +33,99 @@ struct ActiveNote
       if (lhs.channel < rhs.channel) return true;
       if (lhs.channel > rhs.channel) return false;
 
+      if (lhs.device < rhs.device) return true;
+      if (lhs.device > rhs.device) return false;
+
       return false;
    }
 
    NoteId note_id;
    unsigned char channel;
    int velocity;
+
+   // Which input device opened the note
+   size_t device;
 };
 typedef std::set<ActiveNote, ActiveNote> ActiveNoteSet;
 
-class PlayingState : public GameState
+// A single event from any of the player's input devices
+struct PlayerInputEvent
+{
+   // When the event arrived (only used to merge live devices).  Zero
+   // for replayed and virtual input.
+   unsigned long long timestamp;
+
+   // Live input timing (see InputLatency.h)
+   unsigned long driver_delay;
+   unsigned long long dequeued;
+
+   microseconds_t song_position;
+   size_t device;
+   MidiEvent ev;
+};
+typedef std::vector<PlayerInputEvent> PlayerInputList;
+
+// Anything that can stand in for the player's MIDI input
+// device.  (See SongSimulation.h.)
+class VirtualInput
+{
+public:
+   virtual ~VirtualInput() { }
+
+   // Returns the next event "played" by the given song
+   // position, or false if there is nothing new.
+   virtual bool Read(microseconds_t song_position, MidiEvent *ev) = 0;
+};
+
+// Everything Draw needs from the simulation, copied out after every
+// step so the simulation thread can keep going while it's drawn.
+struct PlayingSnapshot
+{
+   PlayingSnapshot() : song_position(0), taken(0), percentage_complete(0.0),
+      combo(0), score_multiplier(1.0), notes_begin(0) { }
+
+   microseconds_t song_position;
+
+   // Compatible::GetMicroseconds() when the snapshot was taken
+   unsigned long long taken;
+
+   double percentage_complete;
+   SongStatistics stats;
+   int combo;
+   double score_multiplier;
+
+   KeyStates keys;
+
+   // Every note before notes_begin is Retired.  note_states holds the
+   // rest of the notes that could have changed, starting with notes_begin.
+   size_t notes_begin;
+   NoteStateList note_states;
+};
+
+class PlayingState : public GameState, private FixedStepTarget
 {
 public:
    PlayingState(const SharedState &state);
    ~PlayingState();
 
+   // These must be called before the state is handed to a
+   // GameStateManager.  Either one replaces the live input device.
+   //
+   // The replay is owned (and deleted) by the state from here on
+   // out.  The virtual input is not.
+   void SetReplay(PerformanceReplay *replay) { m_replay = replay; }
+   void SetVirtualInput(VirtualInput *input) { m_virtual_input = input; }
+
+   // Includes the statistics for the song so far
+   const SharedState &GetSharedState() const { return m_state; }
+
 protected:
    virtual void Init();
    virtual void Update();
    virtual void Draw(Renderer &renderer) const;
+   virtual void DeclareTextures(TextureList &textures) const;
+   virtual void Suspend();
+   virtual void Resume();
 
 private:
 
@@ -57,13 +136,59 @@ private:
    void Play(microseconds_t delta_microseconds);
    void Listen();
 
+   // Plays, scores, and retires notes for this much real time.  During
+   // live play this runs on m_simulation instead of once per frame.
+   void Step(unsigned long step_microseconds);
+
+   // Copies the results of the last Step out for Draw
+   void PublishSnapshot();
+
+   // Sends the (already adjusted) input event to the output
+   // device, timing it if it came from a live device.  Does
+   // nothing if the MIDI thru already played it.
+   void PlayInput(const PlayerInputEvent &in);
+
+   // The MIDI thru (see MidiThru in MidiComm.h) plays live input from
+   // the input callback thread instead of waiting for Listen.
+   void StartThru();
+   void StopThru();
+
+   // Points each input key at the note Listen would most likely match
+   // it with if it were pressed within the next look_ahead of the song.
+   void UpdateThru(microseconds_t look_ahead);
+
+   // Collects this frame's input from every live input device (merged
+   // in the order it arrived), the replay log, or the virtual input.
+   void GatherInput();
+
+   // The number of input devices being scored (live or replayed)
+   size_t InputDeviceCount() const;
+   bool HasInput() const;
+
+   void ResetInputDevices();
+
    double CalculateScoreMultiplier() const;
 
+   // The first note that can still be hit at the given time (every note
+   // before it has a closed scoring window)
+   size_t FirstOpenNote(microseconds_t time) const;
+
    bool m_paused;
 
+   // Only drawn.  The simulation lights keys in m_keys instead.
    KeyboardDisplay *m_keyboard;
+   KeyStates m_keys;
+
    microseconds_t m_show_duration;
-   TranslatedNoteSet m_notes;
+
+   // The notes themselves are shared (read-only) from the Midi object.
+   // Only their per-session state changes, tracked here by the same index.
+   NoteStateList m_note_states;
+
+   // Every note before m_notes_begin is Retired.  No note at or
+   // after m_notes_end has started yet.
+   size_t m_notes_begin;
+   size_t m_notes_end;
 
    bool m_any_you_play_tracks;
    size_t m_look_ahead_you_play_note_count;
@@ -80,6 +205,30 @@ private:
 
    // For octave sliding
    int m_note_offset;
+
+   // At most one of these is set.  See PerformanceLog.h.
+   PerformanceLog *m_log;
+   PerformanceReplay *m_replay;
+
+   VirtualInput *m_virtual_input;
+
+   // midi_in (if there is one) followed by each of extra_midi_in
+   MidiCommInList m_input_devices;
+
+   // Kept around between frames to avoid reallocating
+   PlayerInputList m_input;
+
+   bool m_thru;
+
+   // Runs Step during live play.  While it's running, anything Step
+   // uses is only touched by the main thread while holding its lock.
+   FixedStepThread m_simulation;
+
+   mutable TripleBuffer<PlayingSnapshot> m_snapshots;
+
+   // Draw's copy of m_note_states, brought up to date from each snapshot
+   mutable NoteStateList m_drawn_note_states;
+   mutable size_t m_drawn_notes_begin;
 };
 
 #endif
@@ -47,6 +47,13 @@ void StatsState::Update()
    if (m_continue_button.hovering) m_tooltip = L"Try this song again with the same settings.";
 }
 
+void StatsState::DeclareTextures(TextureList &textures) const
+{
+   textures.push_back(StatsText);
+   textures.push_back(ButtonRetrySong);
+   textures.push_back(ButtonChooseTracks);
+}
+
 void StatsState::Draw(Renderer &renderer) const
 {
    const bool ConstrainedHeight = (GetStateHeight() < 720);
@@ -20,6 +20,7 @@ protected:
    virtual void Init();
    virtual void Update();
    virtual void Draw(Renderer &renderer) const;
+   virtual void DeclareTextures(TextureList &textures) const;
 
 private:
    ButtonState m_continue_button;
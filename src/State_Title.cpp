@@ -17,7 +17,10 @@
 #include "libmidi/Midi.h"
 #include "libmidi/MidiUtil.h"
 #include "libmidi/MidiComm.h"
+#include "libmidi/MidiDeviceRegistry.h"
 
+#include <algorithm>
+#include <iomanip>
 using namespace std;
 
 const static wstring OutputDeviceKey = L"Last Output Device";
@@ -26,6 +29,41 @@ const static wstring OutputKeySpecialDisabled = L"[no output device]";
 const static wstring InputDeviceKey = L"Last Input Device";
 const static wstring InputKeySpecialDisabled = L"[no input device]";
 
+// There is no interface for these yet.  This is a list of device
+// names (separated by '|') to open alongside the chosen input device.
+const static wstring ExtraInputDevicesKey = L"Extra Input Devices";
+
+// Calibration results are stored per output/input pair under this
+// prefix, as a number of microseconds.
+const static wstring LatencyCompensationKeyPrefix = L"Latency Compensation: ";
+
+const static unsigned int CalibrationNoteCount = 8;
+const static unsigned char CalibrationNote = 60;
+const static unsigned char CalibrationVelocity = 100;
+const static unsigned long long CalibrationTimeout = 1000000;
+const static unsigned long long CalibrationGap = 150000;
+
+// Anything beyond this is surely a mistake (someone playing along
+// during the test, say) rather than a real device.
+const static microseconds_t MaxLatencyCompensation = 500000;
+
+// Empty if either device is missing
+static wstring LatencyCompensationKey(const SharedState &state)
+{
+   if (!state.midi_out || !state.midi_in) return L"";
+
+   return LatencyCompensationKeyPrefix + state.midi_out->GetDeviceDescription().name
+      + L" -> " + state.midi_in->GetDeviceDescription().name;
+}
+
+static wstring DescribeLatencyCompensation(microseconds_t compensation)
+{
+   if (compensation == 0) return L"Latency not calibrated for these devices.  Click here to calibrate.";
+
+   return WSTRING(L"Round-trip latency: " << fixed << setprecision(1) << (compensation / 1000.0)
+      << L" ms.  Click here to recalibrate.");
+}
+
 TitleState::~TitleState()
 {
    if (m_output_tile) delete m_output_tile;
@@ -54,7 +92,7 @@ void TitleState::Init()
    if (!m_state.midi_out)
    {
       // Try to find the previously used device
-      MidiCommDescriptionList devices = MidiCommOut::GetDeviceList();
+      MidiCommDescriptionList devices = MidiDeviceRegistry::Outputs();
       for (size_t i = 0; i < devices.size(); ++i)
       {
          if (devices[i].name == last_output_device)
@@ -74,7 +112,7 @@ void TitleState::Init()
    if (!m_state.midi_in)
    {
       // Try to find the previously used device
-      MidiCommDescriptionList devices = MidiCommIn::GetDeviceList();
+      MidiCommDescriptionList devices = MidiDeviceRegistry::Inputs();
       for (size_t i = 0; i < devices.size(); ++i)
       {
          if (devices[i].name == last_input_device)
@@ -83,7 +121,7 @@ void TitleState::Init()
             {
                m_state.midi_in = new MidiCommIn(devices[i].id);
             }
-            catch (MidiErrorCode)
+            catch (const MidiError &)
             {
                m_state.midi_in = 0;
             }
@@ -95,6 +133,30 @@ void TitleState::Init()
       // completely acceptable.
    }
 
+   if (m_state.extra_midi_in.empty())
+   {
+      const wstring extra_input_devices = UserSetting::Get(ExtraInputDevicesKey, L"");
+
+      MidiCommDescriptionList devices = MidiDeviceRegistry::Inputs();
+      for (size_t i = 0; i < devices.size(); ++i)
+      {
+         // Don't open the main input device twice
+         if (m_state.midi_in && devices[i].id == m_state.midi_in->GetDeviceDescription().id) continue;
+
+         const wstring delimited = L"|" + extra_input_devices + L"|";
+         if (delimited.find(L"|" + devices[i].name + L"|") == wstring::npos) continue;
+
+         try
+         {
+            m_state.extra_midi_in.push_back(new MidiCommIn(devices[i].id));
+         }
+         catch (const MidiError &)
+         {
+            // Carry on without it
+         }
+      }
+   }
+
    int output_device_id = -1;
    if (last_output_device == OutputKeySpecialDisabled) output_device_id = -1;
 
@@ -118,10 +180,117 @@ void TitleState::Init()
    m_file_tile = new StringTile((GetStateWidth() - StringTileWidth) / 2, initial_y + each_y*0, GetTexture(SongBox));
    m_file_tile->SetString(m_state.song_title);
 
-   const MidiCommDescriptionList output_devices = MidiCommOut::GetDeviceList();
-   const MidiCommDescriptionList input_devices = MidiCommIn::GetDeviceList();
+   m_device_generation = MidiDeviceRegistry::Generation();
+   const MidiCommDescriptionList output_devices = MidiDeviceRegistry::Outputs();
+   const MidiCommDescriptionList input_devices = MidiDeviceRegistry::Inputs();
    m_output_tile = new DeviceTile((GetStateWidth() - DeviceTileWidth) / 2, initial_y + each_y*1, output_device_id, DeviceTileOutput, output_devices, GetTexture(InterfaceButtons), GetTexture(OutputBox));
    m_input_tile = new DeviceTile((GetStateWidth() - DeviceTileWidth) / 2, initial_y + each_y*2, input_device_id, DeviceTileInput, input_devices, GetTexture(InterfaceButtons), GetTexture(InputBox));
+
+   m_calibrate_button = ButtonState(m_input_tile->GetX(), m_input_tile->GetY() + DeviceTileHeight + 2,
+      DeviceTileWidth, Layout::SmallFontSize + 6);
+}
+
+microseconds_t TitleState::LoadLatencyCompensation() const
+{
+   const wstring key = LatencyCompensationKey(m_state);
+   if (key.empty()) return 0;
+
+   microseconds_t compensation = 0;
+   wistringstream stored(UserSetting::Get(key, L"0"));
+   stored >> compensation;
+
+   return max(static_cast<microseconds_t>(0), min(compensation, MaxLatencyCompensation));
+}
+
+void TitleState::StartCalibration()
+{
+   if (!m_state.midi_out || !m_state.midi_in) return;
+
+   // Anything else on the output would get in the way
+   m_output_tile->TurnOffPreview();
+   m_state.midi_out->Reset();
+
+   m_calibrating = true;
+   m_calibration_samples.clear();
+   m_calibration_sent = 0;
+   m_calibration_next = Compatible::GetMicroseconds();
+}
+
+void TitleState::StopCalibration(const wstring &status)
+{
+   if (m_calibration_sent != 0 && m_state.midi_out)
+   {
+      m_state.midi_out->Write(MidiEvent::Build(MidiEventSimple(0x80, CalibrationNote, 0)));
+   }
+
+   m_calibrating = false;
+   m_calibration_sent = 0;
+   m_calibration_status = status;
+}
+
+void TitleState::UpdateCalibration()
+{
+   // The devices changed out from under us
+   if (LatencyCompensationKey(m_state) != m_calibration_devices)
+   {
+      StopCalibration(L"");
+      return;
+   }
+
+   const unsigned long long now = Compatible::GetMicroseconds();
+
+   if (m_calibration_sent != 0)
+   {
+      while (m_state.midi_in->KeepReading())
+      {
+         unsigned long long arrived = 0;
+         MidiEvent ev = m_state.midi_in->Read(&arrived);
+
+         if (ev.Type() != MidiEventType_NoteOn || ev.NoteNumber() != CalibrationNote || ev.NoteVelocity() == 0) continue;
+         if (arrived < m_calibration_sent) continue;
+
+         m_calibration_samples.push_back(arrived - m_calibration_sent);
+
+         m_state.midi_out->Write(MidiEvent::Build(MidiEventSimple(0x80, CalibrationNote, 0)));
+         m_calibration_sent = 0;
+         m_calibration_next = now + CalibrationGap;
+         break;
+      }
+
+      if (m_calibration_sent != 0 && now - m_calibration_sent > CalibrationTimeout)
+      {
+         StopCalibration(L"No test notes came back.  Is the output looped back to the input?");
+      }
+
+      return;
+   }
+
+   if (now < m_calibration_next) return;
+
+   if (m_calibration_samples.size() < CalibrationNoteCount)
+   {
+      // Don't let anything old be mistaken for the echo
+      m_state.midi_in->Reset();
+
+      m_calibration_sent = Compatible::GetMicroseconds();
+      m_state.midi_out->Write(MidiEvent::Build(MidiEventSimple(0x90, CalibrationNote, CalibrationVelocity)));
+      return;
+   }
+
+   // The median ignores the odd sample delayed by something else
+   sort(m_calibration_samples.begin(), m_calibration_samples.end());
+   const microseconds_t round_trip = static_cast<microseconds_t>(m_calibration_samples[m_calibration_samples.size() / 2]);
+
+   if (round_trip > MaxLatencyCompensation)
+   {
+      StopCalibration(L"The round trip took too long to be a loopback.  Calibration failed.");
+      return;
+   }
+
+   UserSetting::Set(m_calibration_devices, WSTRING(round_trip));
+   m_state.latency_compensation = round_trip;
+
+   StopCalibration(DescribeLatencyCompensation(round_trip));
 }
 
 void TitleState::Update()
@@ -137,6 +306,16 @@ void TitleState::Update()
    m_continue_button.Update(mouse);
    m_back_button.Update(mouse);
 
+   // Devices were plugged in or removed.  (Windows renumbers devices when
+   // that happens, so the ones in use may be reopened below.)
+   const unsigned long device_generation = MidiDeviceRegistry::Generation();
+   if (device_generation != m_device_generation)
+   {
+      m_device_generation = device_generation;
+      m_output_tile->SetDeviceList(MidiDeviceRegistry::Outputs());
+      m_input_tile->SetDeviceList(MidiDeviceRegistry::Inputs());
+   }
+
    MouseInfo output_mouse(mouse);
    output_mouse.x -= m_output_tile->GetX();
    output_mouse.y -= m_output_tile->GetY();
@@ -188,7 +367,9 @@ void TitleState::Update()
             SharedState new_state;
             new_state.midi = new_midi;
             new_state.midi_in = m_state.midi_in;
+            new_state.extra_midi_in = m_state.extra_midi_in;
             new_state.midi_out = m_state.midi_out;
+            new_state.latency_compensation = m_state.latency_compensation;
             new_state.song_title = FileSelector::TrimFilename(filename);
 
             delete m_state.midi;
@@ -221,7 +402,7 @@ void TitleState::Update()
       }
    }
 
-   if (m_state.midi_out)
+   if (m_state.midi_out && !m_calibrating)
    {
       if (m_output_tile->HitPreviewButton())
       {
@@ -259,7 +440,7 @@ void TitleState::Update()
             m_state.midi_in = new MidiCommIn(input_id);
             UserSetting::Set(InputDeviceKey, m_state.midi_in->GetDeviceDescription().name);
          }
-         catch (MidiErrorCode)
+         catch (const MidiError &)
          {
             m_state.midi_in = 0;
          }
@@ -270,7 +451,22 @@ void TitleState::Update()
       }
    }
 
-   if (m_state.midi_in && m_input_tile->IsPreviewOn())
+   // Pick up the stored calibration whenever the pair of devices changes
+   const wstring compensation_key = LatencyCompensationKey(m_state);
+   if (!m_calibrating && compensation_key != m_calibration_devices)
+   {
+      m_calibration_devices = compensation_key;
+      m_state.latency_compensation = LoadLatencyCompensation();
+
+      m_calibration_status = L"";
+      if (!compensation_key.empty()) m_calibration_status = DescribeLatencyCompensation(m_state.latency_compensation);
+   }
+
+   m_calibrate_button.Update(mouse);
+   if (m_calibrating) UpdateCalibration();
+   else if (m_calibrate_button.hit && !compensation_key.empty()) StartCalibration();
+
+   if (m_state.midi_in && m_input_tile->IsPreviewOn() && !m_calibrating)
    {
       // Read note events to display on screen
       while (m_state.midi_in->KeepReading())
@@ -299,12 +495,17 @@ void TitleState::Update()
 
    if (IsKeyPressed(KeyEscape) || m_back_button.hit)
    {
+      if (m_calibrating) StopCalibration(L"");
+
       delete m_state.midi_out;
       m_state.midi_out = 0;
 
       delete m_state.midi_in;
       m_state.midi_in = 0;
 
+      for (MidiCommInList::iterator i = m_state.extra_midi_in.begin(); i != m_state.extra_midi_in.end(); ++i) delete *i;
+      m_state.extra_midi_in.clear();
+
       delete m_state.midi;
       m_state.midi = 0;
 
@@ -314,8 +515,11 @@ void TitleState::Update()
 
    if (IsKeyPressed(KeyEnter) || m_continue_button.hit)
    {
+      if (m_calibrating) StopCalibration(L"");
+
       if (m_state.midi_out) m_state.midi_out->Reset();
       if (m_state.midi_in) m_state.midi_in->Reset();
+      for (MidiCommInList::iterator i = m_state.extra_midi_in.begin(); i != m_state.extra_midi_in.end(); ++i) (*i)->Reset();
 
       ChangeState(new TrackSelectionState(m_state));
       return;
@@ -336,6 +540,12 @@ void TitleState::Update()
       else m_tooltip = L"Click to test your MIDI input device by playing notes.";
    }
 
+   if (m_calibrate_button.hovering && !compensation_key.empty())
+   {
+      if (m_calibrating) m_tooltip = L"Measuring the round trip from the output device back to the input device...";
+      else m_tooltip = L"Loop the output device back to the input device, then click to measure their latency.";
+   }
+
    if (m_output_tile->ButtonLeft().hovering) m_tooltip = L"Cycle through available output devices.";
    if (m_output_tile->ButtonRight().hovering) m_tooltip = L"Cycle through available output devices.";
    if (m_output_tile->ButtonPreview().hovering)
@@ -359,6 +569,17 @@ void TitleState::PlayDevicePreview(microseconds_t delta_microseconds)
    }
 }
 
+void TitleState::DeclareTextures(TextureList &textures) const
+{
+   textures.push_back(TitleLogo);
+   textures.push_back(SongBox);
+   textures.push_back(InputBox);
+   textures.push_back(OutputBox);
+   textures.push_back(InterfaceButtons);
+   textures.push_back(ButtonChooseTracks);
+   textures.push_back(ButtonExit);
+}
+
 void TitleState::Draw(Renderer &renderer) const
 {
    const bool compress_height = (GetStateHeight() < 750);
@@ -410,6 +631,16 @@ void TitleState::Draw(Renderer &renderer) const
       last_note << w(m_last_input_note_name);
    }
 
+   wstring calibration_text = m_calibration_status;
+   if (m_calibrating) calibration_text = WSTRING(L"Calibrating... " << m_calibration_samples.size() << L" of " << CalibrationNoteCount);
+
+   if (!calibration_text.empty())
+   {
+      TextWriter calibration(m_calibrate_button.x + m_calibrate_button.w / 2, m_calibrate_button.y + 2,
+         renderer, true, Layout::SmallFontSize);
+      calibration << Text(calibration_text, (m_calibrate_button.hovering ? White : Gray));
+   }
+
    const int tooltip_font_size = (compress_width ? Layout::ButtonFontSize : Layout::TitleFontSize);
    TextWriter tooltip(GetStateWidth() / 2, GetStateHeight() - Layout::ScreenMarginY/2 - tooltip_font_size/2, renderer, true, tooltip_font_size);
    tooltip << m_tooltip;
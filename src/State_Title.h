@@ -25,7 +25,8 @@ public:
    // screen pick a device for you.
    TitleState(const SharedState &state)
       : m_state(state), m_output_tile(0), m_input_tile(0),
-        m_file_tile(0), m_skip_next_mouse_up(false)
+        m_file_tile(0), m_skip_next_mouse_up(false),
+        m_device_generation(0), m_calibrating(false), m_calibration_sent(0), m_calibration_next(0)
    { }
 
    ~TitleState();
@@ -34,10 +35,21 @@ protected:
    virtual void Init();
    virtual void Update();
    virtual void Draw(Renderer &renderer) const;
+   virtual void DeclareTextures(TextureList &textures) const;
 
 private:
    void PlayDevicePreview(microseconds_t delta_microseconds);
 
+   // Latency calibration sends test notes out the output device and
+   // times how long they take to come back in the input device (which
+   // requires a loopback cable or virtual loopback port between them).
+   void StartCalibration();
+   void UpdateCalibration();
+   void StopCalibration(const std::wstring &status);
+
+   // The stored round trip for the current pair of devices, or 0
+   microseconds_t LoadLatencyCompensation() const;
+
    ButtonState m_continue_button;
    ButtonState m_back_button;
 
@@ -51,6 +63,22 @@ private:
    StringTile *m_file_tile;
 
    bool m_skip_next_mouse_up;
+
+   // See MidiDeviceRegistry::Generation
+   unsigned long m_device_generation;
+
+   ButtonState m_calibrate_button;
+   std::wstring m_calibration_status;
+
+   bool m_calibrating;
+   std::wstring m_calibration_devices;
+   std::vector<unsigned long long> m_calibration_samples;
+
+   // When the outstanding test note was sent (0 if there isn't one)
+   unsigned long long m_calibration_sent;
+
+   // When to send the next test note
+   unsigned long long m_calibration_next;
 };
 
 #endif
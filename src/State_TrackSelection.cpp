@@ -277,6 +277,14 @@ void TrackSelectionState::PlayTrackPreview(microseconds_t delta_microseconds)
    }
 }
 
+void TrackSelectionState::DeclareTextures(TextureList &textures) const
+{
+   textures.push_back(TrackPanel);
+   textures.push_back(InterfaceButtons);
+   textures.push_back(ButtonPlaySong);
+   textures.push_back(ButtonBackToTitle);
+}
+
 void TrackSelectionState::Draw(Renderer &renderer) const
 {
    Layout::DrawTitle(renderer, L"Choose Tracks To Play");
@@ -23,6 +23,7 @@ protected:
    virtual void Init();
    virtual void Update();
    virtual void Draw(Renderer &renderer) const;
+   virtual void DeclareTextures(TextureList &textures) const;
 
 private:
    void PlayTrackPreview(microseconds_t additional_time);
@@ -3,23 +3,380 @@
 // See license.txt for license information
 
 #include <map>
+#include <vector>
+#include <cmath>
+#include <algorithm>
 
 #include "TextWriter.h"
 #include "Renderer.h"
+#include "SoftwareRasterizer.h"
 #include "PianoGameError.h"
 #include "os_graphics.h"
 
+// Every glyph (printable ASCII only, like the display lists this replaced)
+// is rasterized once per font size into an alpha texture, so text is drawn
+// as ordinary textured quads through the renderer's batch.  Big fonts that
+// won't fit in one texture on this card are split across a few.
+const static int FirstGlyph = 32;
+const static int GlyphCount = 96;
+const static int AtlasColumns = 16;
+
+// Room around each glyph for anti-aliasing and overhangs
+const static int GlyphPadding = 2;
+
+// The software rasterizer has no texture size limit of its own
+const static int SoftwareMaxTextureSize = 1 << 16;
+
+// Layouts are dropped wholesale past this, so strings that change
+// every frame can't grow the cache forever
+const static size_t LayoutCacheLimit = 1024;
+
+struct GlyphAtlas
+{
+   // One texture per page, each tex_width x tex_height
+   std::vector<unsigned int> texture_ids;
+   int tex_width;
+   int tex_height;
+
+   int cell_width;
+   int cell_height;
+
+   // How the cells are laid out on each page
+   int columns;
+   int page_rows;
+
+   // Distance from the top of a cell down to the baseline
+   int ascent;
+   int line_height;
+
+   int advance[GlyphCount];
+};
+
+struct TextLayout
+{
+   int width;
+
+   std::vector<unsigned char> glyphs;
+   std::vector<int> pen_x;
+};
+
+// TODO: These should be deleted at shutdown
+static std::map<int, GlyphAtlas*> atlas_lookup;
+static std::map<std::pair<int, std::wstring>, TextLayout> layout_cache;
+
+static int NextPowerOfTwo(int n)
+{
+   int p = 1;
+   while (p < n) p *= 2;
+   return p;
+}
+
+// Picks the fewest pages (of at most max_size on a side) that hold every
+// glyph, keeping the usual 16 columns whenever they fit
+static void ArrangeCells(GlyphAtlas *atlas, int size, int max_size)
+{
+   if (atlas->cell_width > max_size || atlas->cell_height > max_size)
+   {
+      throw PianoGameError(WSTRING(L"Font size " << size << L" is too large for this graphics card's " << max_size << L" pixel textures."));
+   }
+
+   atlas->columns = std::min(AtlasColumns, max_size / atlas->cell_width);
+
+   const int rows = (GlyphCount + atlas->columns - 1) / atlas->columns;
+   atlas->page_rows = std::min(rows, max_size / atlas->cell_height);
+
+   atlas->texture_ids.assign((rows + atlas->page_rows - 1) / atlas->page_rows, 0);
+   atlas->tex_width = NextPowerOfTwo(atlas->cell_width * atlas->columns);
+   atlas->tex_height = NextPowerOfTwo(atlas->cell_height * atlas->page_rows);
+}
+
+// Where a glyph's cell is, in cells, on its page
+static void FindCell(const GlyphAtlas &atlas, int glyph, int *page, int *column, int *row)
+{
+   *column = glyph % atlas.columns;
+   *row = (glyph / atlas.columns) % atlas.page_rows;
+   *page = (glyph / atlas.columns) / atlas.page_rows;
+}
+
+static int GlyphIndex(wchar_t c)
+{
+   if (c < FirstGlyph) return -1;
+   if (c >= FirstGlyph + GlyphCount) return '?' - FirstGlyph;
+   return c - FirstGlyph;
+}
+
+// Fills in the atlas metrics and returns the rasterized glyphs as
+// tex_width x tex_height coverage values for each page, one page after
+// the other, top row first.
+static std::vector<unsigned char> RasterizeGlyphs(Context c, int size, int point_size, const std::wstring &fontname, int max_size, GlyphAtlas *atlas)
+{
+   std::vector<unsigned char> coverage;
+
 #ifdef WIN32
-// TODO: This should be deleted at shutdown
-static std::map<int, HFONT> font_handle_lookup;
-static int next_call_list_start = 1;
+
+   LOGFONT logical_font;
+   logical_font.lfHeight = point_size;
+   logical_font.lfWidth = 0;
+   logical_font.lfEscapement = 0;
+   logical_font.lfOrientation = 0;
+   logical_font.lfWeight = FW_NORMAL;
+   logical_font.lfItalic = false;
+   logical_font.lfUnderline = false;
+   logical_font.lfStrikeOut = false;
+   logical_font.lfCharSet = ANSI_CHARSET;
+   logical_font.lfOutPrecision = OUT_DEFAULT_PRECIS;
+   logical_font.lfClipPrecision = CLIP_DEFAULT_PRECIS;
+   logical_font.lfQuality = ANTIALIASED_QUALITY;
+   logical_font.lfPitchAndFamily = DEFAULT_PITCH | FF_DONTCARE;
+   lstrcpy(logical_font.lfFaceName, fontname.c_str()); 
+
+   HFONT font = CreateFontIndirect(&logical_font);
+   if (!font) throw PianoGameError(WSTRING(L"Couldn't create font '" << fontname << L"' at size " << size << L"."));
+
+   HDC dc = CreateCompatibleDC(c);
+   HFONT previous_font = (HFONT)SelectObject(dc, font);
+
+   TEXTMETRIC metrics;
+   GetTextMetrics(dc, &metrics);
+
+   INT widths[GlyphCount];
+   GetCharWidth32(dc, FirstGlyph, FirstGlyph + GlyphCount - 1, widths);
+   for (int i = 0; i < GlyphCount; ++i) atlas->advance[i] = widths[i];
+
+   atlas->cell_width = metrics.tmMaxCharWidth + GlyphPadding*2;
+   atlas->cell_height = metrics.tmHeight + GlyphPadding*2;
+   atlas->ascent = metrics.tmAscent + GlyphPadding;
+   atlas->line_height = metrics.tmHeight;
+
+   try
+   {
+      ArrangeCells(atlas, size, max_size);
+   }
+   catch (...)
+   {
+      SelectObject(dc, previous_font);
+      DeleteDC(dc);
+      DeleteObject(font);
+      throw;
+   }
+
+   // The pages are stacked top to bottom in one bitmap
+   const int bitmap_height = atlas->tex_height * static_cast<int>(atlas->texture_ids.size());
+
+   // A negative height makes the DIB top-down, which is the order we want
+   BITMAPINFO info;
+   ZeroMemory(&info, sizeof(BITMAPINFO));
+   info.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+   info.bmiHeader.biWidth = atlas->tex_width;
+   info.bmiHeader.biHeight = -bitmap_height;
+   info.bmiHeader.biPlanes = 1;
+   info.bmiHeader.biBitCount = 32;
+   info.bmiHeader.biCompression = BI_RGB;
+
+   void *bits = 0;
+   HBITMAP bitmap = CreateDIBSection(dc, &info, DIB_RGB_COLORS, &bits, 0, 0);
+   if (!bitmap || !bits)
+   {
+      SelectObject(dc, previous_font);
+      DeleteDC(dc);
+      DeleteObject(font);
+      throw PianoGameError(WSTRING(L"Couldn't create glyph bitmap for font size " << size << L"."));
+   }
+
+   HBITMAP previous_bitmap = (HBITMAP)SelectObject(dc, bitmap);
+   PatBlt(dc, 0, 0, atlas->tex_width, bitmap_height, BLACKNESS);
+
+   SetTextColor(dc, RGB(0xFF, 0xFF, 0xFF));
+   SetBkMode(dc, TRANSPARENT);
+   SetTextAlign(dc, TA_LEFT | TA_TOP | TA_NOUPDATECP);
+
+   for (int i = 0; i < GlyphCount; ++i)
+   {
+      const wchar_t glyph = static_cast<wchar_t>(FirstGlyph + i);
+
+      int page, column, row;
+      FindCell(*atlas, i, &page, &column, &row);
+      const int cell_x = column * atlas->cell_width;
+      const int cell_y = page * atlas->tex_height + row * atlas->cell_height;
+
+      TextOut(dc, cell_x + GlyphPadding, cell_y + GlyphPadding, &glyph, 1);
+   }
+   GdiFlush();
+
+   // White text on black, so any channel is the coverage
+   const size_t pixel_count = static_cast<size_t>(atlas->tex_width) * bitmap_height;
+   const unsigned char *pixels = static_cast<const unsigned char*>(bits);
+
+   coverage.resize(pixel_count);
+   for (size_t i = 0; i < pixel_count; ++i) coverage[i] = pixels[i*4 + 1];
+
+   SelectObject(dc, previous_bitmap);
+   SelectObject(dc, previous_font);
+   DeleteObject(bitmap);
+   DeleteDC(dc);
+   DeleteObject(font);
+
 #else
-// TODO: This should be deleted at shutdown
-static std::map<int, ATSUStyle> atsu_style_lookup;
+
+   // MACNOTE: Force Trebuchet MS.  It's what we mostly use anyway, but
+   // I want to be sure they have it.
+   const CFStringRef font_name = CFSTR("Trebuchet MS");
+
+   ATSFontRef font = ATSFontFindFromName(font_name, kATSOptionFlagsDefault);
+   if (!font) throw PianoGameError(WSTRING(L"Couldn't get ATSFontRef for font '" << WideFromMacString(font_name) << L"'."));
+
+   ATSFontMetrics metrics;
+   OSStatus status = ATSFontGetHorizontalMetrics(font, kATSOptionFlagsDefault, &metrics);
+   if (status != noErr) throw PianoGameError(WSTRING(L"Couldn't get font metrics.  Error code: " << static_cast<int>(status)));
+
+   // ATS metrics are in units of the point size (descent is negative)
+   const int ascent = static_cast<int>(ceil(metrics.ascent * point_size));
+   const int descent = static_cast<int>(ceil(-metrics.descent * point_size));
+   const int max_width = static_cast<int>(ceil(metrics.maxAdvanceWidth * point_size));
+
+   atlas->cell_width = max_width + GlyphPadding*2;
+   atlas->cell_height = ascent + descent + GlyphPadding*2;
+   atlas->ascent = ascent + GlyphPadding;
+   atlas->line_height = ascent + descent;
+   ArrangeCells(atlas, size, max_size);
+
+   // The pages are stacked top to bottom in one bitmap, and a bitmap
+   // context's first row of memory is the top of the image
+   const int bitmap_height = atlas->tex_height * static_cast<int>(atlas->texture_ids.size());
+   coverage.resize(static_cast<size_t>(atlas->tex_width) * bitmap_height, 0);
+
+   CGColorSpaceRef gray = CGColorSpaceCreateDeviceGray();
+   CGContextRef context = CGBitmapContextCreate(&coverage[0], atlas->tex_width, bitmap_height, 8, atlas->tex_width, gray, kCGImageAlphaNone);
+   CGColorSpaceRelease(gray);
+   if (!context) throw PianoGameError(WSTRING(L"Couldn't create glyph bitmap for font size " << size << L"."));
+
+   CGContextSelectFont(context, "Trebuchet MS", point_size, kCGEncodingMacRoman);
+   CGContextSetGrayFillColor(context, 1.0, 1.0);
+   CGContextSetShouldAntialias(context, true);
+
+   for (int i = 0; i < GlyphCount; ++i)
+   {
+      const char glyph = static_cast<char>(FirstGlyph + i);
+
+      int page, column, row;
+      FindCell(*atlas, i, &page, &column, &row);
+      const int cell_x = column * atlas->cell_width;
+      const int cell_y = page * atlas->tex_height + row * atlas->cell_height;
+
+      // Measure without drawing, then draw (CoreGraphics counts y upward)
+      CGContextSetTextDrawingMode(context, kCGTextInvisible);
+      CGContextSetTextPosition(context, 0, 0);
+      CGContextShowText(context, &glyph, 1);
+      atlas->advance[i] = static_cast<int>(CGContextGetTextPosition(context).x + 0.5f);
+
+      CGContextSetTextDrawingMode(context, kCGTextFill);
+      CGContextShowTextAtPoint(context, cell_x + GlyphPadding, bitmap_height - (cell_y + atlas->ascent), &glyph, 1);
+   }
+
+   CGContextRelease(context);
+
 #endif
 
-// TODO: This should be deleted at shutdown
-static std::map<int, int> font_size_lookup;
+   return coverage;
+}
+
+static const GlyphAtlas *GetAtlas(Context c, int size, int point_size, const std::wstring &fontname)
+{
+   std::map<int, GlyphAtlas*>::const_iterator i = atlas_lookup.find(size);
+   if (i != atlas_lookup.end()) return i->second;
+
+   SoftwareRasterizer *software = Renderer::GetSoftwareRasterizer();
+
+   GLint max_size = SoftwareMaxTextureSize;
+   if (!software) glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+
+   GlyphAtlas atlas;
+   std::vector<unsigned char> coverage = RasterizeGlyphs(c, size, point_size, fontname, max_size, &atlas);
+
+   const size_t page_pixels = static_cast<size_t>(atlas.tex_width) * atlas.tex_height;
+
+   if (software)
+   {
+      for (size_t p = 0; p < atlas.texture_ids.size(); ++p)
+      {
+         atlas.texture_ids[p] = software->CreateTexture(atlas.tex_width, atlas.tex_height, 1, &coverage[p * page_pixels]);
+      }
+
+      atlas_lookup[size] = new GlyphAtlas(atlas);
+      return atlas_lookup[size];
+   }
+
+   // Whatever is waiting in the batch was drawn with the old binding
+   Renderer::Flush();
+
+   // Anything left over from before isn't ours to report.  (There's one
+   // flag per kind of error, so this can't go on for long.)
+   for (int n = 0; n < 8 && glGetError() != GL_NO_ERROR; ++n) { }
+
+   for (size_t p = 0; p < atlas.texture_ids.size(); ++p)
+   {
+      GLuint id;
+      glGenTextures(1, &id);
+      atlas.texture_ids[p] = id;
+
+      // Glyphs are drawn pixel for pixel, so there's nothing to filter
+      glBindTexture(GL_TEXTURE_2D, id);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, atlas.tex_width, atlas.tex_height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, &coverage[p * page_pixels]);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+   }
+
+   const GLenum error = glGetError();
+   if (error != GL_NO_ERROR)
+   {
+      for (size_t p = 0; p < atlas.texture_ids.size(); ++p)
+      {
+         GLuint id = atlas.texture_ids[p];
+         glDeleteTextures(1, &id);
+      }
+
+      throw PianoGameError(WSTRING(L"Couldn't upload the glyphs for font size " << size << L" (" << atlas.tex_width << L"x"
+         << atlas.tex_height << L").  OpenGL error: " << static_cast<int>(error)));
+   }
+
+   atlas_lookup[size] = new GlyphAtlas(atlas);
+   return atlas_lookup[size];
+}
+
+static const TextLayout &GetLayout(const GlyphAtlas &atlas, int size, const std::wstring &text)
+{
+   const std::pair<int, std::wstring> key(size, text);
+
+   std::map<std::pair<int, std::wstring>, TextLayout>::const_iterator i = layout_cache.find(key);
+   if (i != layout_cache.end()) return i->second;
+
+   if (layout_cache.size() >= LayoutCacheLimit) layout_cache.clear();
+
+   TextLayout &layout = layout_cache[key];
+   layout.glyphs.reserve(text.length());
+   layout.pen_x.reserve(text.length());
+
+   int pen = 0;
+   for (std::wstring::const_iterator c = text.begin(); c != text.end(); ++c)
+   {
+      const int glyph = GlyphIndex(*c);
+      if (glyph < 0) continue;
+
+      // Spaces take up room but don't need a quad
+      if (glyph != ' ' - FirstGlyph)
+      {
+         layout.glyphs.push_back(static_cast<unsigned char>(glyph));
+         layout.pen_x.push_back(pen);
+      }
+
+      pen += atlas.advance[glyph];
+   }
+   layout.width = pen;
+
+   return layout;
+}
 
 TextWriter::TextWriter(int in_x, int in_y, Renderer &in_renderer, bool in_centered, int in_size, std::wstring fontname) :
 x(in_x), y(in_y), size(in_size), original_x(0), last_line_height(0), centered(in_centered), renderer(in_renderer)
@@ -30,92 +387,32 @@ x(in_x), y(in_y), size(in_size), original_x(0), last_line_height(0), centered(in
    y += renderer.m_yoffset;
 
 #ifdef WIN32
+   // Drawing without a window (see Renderer::UseSoftwareRasterizer)
+   // still needs the screen's DPI
+   HDC dc = renderer.m_context;
+   if (!dc) dc = GetDC(0);
 
-   Context c = renderer.m_context;
-   point_size = MulDiv(size, GetDeviceCaps(c, LOGPIXELSY), 72);
-
-   HFONT font = 0;
-   if (font_size_lookup[in_size] == 0)
-   {
-      // Set up the LOGFONT structure
-      LOGFONT logical_font;
-      logical_font.lfHeight = get_point_size();
-      logical_font.lfWidth = 0;
-      logical_font.lfEscapement = 0;
-      logical_font.lfOrientation = 0;
-      logical_font.lfWeight = FW_NORMAL;
-      logical_font.lfItalic = false;
-      logical_font.lfUnderline = false;
-      logical_font.lfStrikeOut = false;
-      logical_font.lfCharSet = ANSI_CHARSET;
-      logical_font.lfOutPrecision = OUT_DEFAULT_PRECIS;
-      logical_font.lfClipPrecision = CLIP_DEFAULT_PRECIS;
-      logical_font.lfQuality = PROOF_QUALITY;
-      logical_font.lfPitchAndFamily = DEFAULT_PITCH | FF_DONTCARE;
-      lstrcpy(logical_font.lfFaceName, fontname.c_str()); 
-
-      font = CreateFontIndirect(&logical_font);
-
-      HFONT previous_font = (HFONT)SelectObject(c, font);
-
-      wglUseFontBitmaps(c, 0, 128, next_call_list_start);
-      font_size_lookup[in_size] = next_call_list_start;
-      font_handle_lookup[in_size] = font;
-      next_call_list_start += 130;
-
-      SelectObject(c, previous_font);
-   }
+   point_size = MulDiv(size, GetDeviceCaps(dc, LOGPIXELSY), 72);
 
+   if (dc != renderer.m_context) ReleaseDC(0, dc);
 #else
-
    // TODO: is this sufficient?
    point_size = size;
-
-   if (font_size_lookup[size] == 0)
-   {
-      int list_start = glGenLists(128);
-
-      // MACNOTE: Force Trebuchet MS.  It's what we mostly use anyway, but
-      // I want to be sure they have it.
-      const CFStringRef font_name = CFSTR("Trebuchet MS");
-      
-      ATSFontFamilyRef font = ATSFontFamilyFindFromName(font_name, kATSOptionFlagsDefault);
-      if (!font) throw PianoGameError(WSTRING(L"Couldn't get ATSFontFamilyRef for font '" << WideFromMacString(font_name) << L"'."));         
-      
-      AGLContext context = aglGetCurrentContext();
-      if (!context) throw PianoGameError(L"Couldn't retrieve OpenGL context while creating font.");         
-      
-      GLboolean ret = aglUseFont(context, font, normal, size, 0, 128, list_start);
-      if (ret == GL_FALSE) throw PianoGameError(WSTRING(L"aglUseFont() call failed with error code: " << aglGetError()));
-      
-      font_size_lookup[size] = list_start;
-
-
-      // Create the ATSU style object that we'll use for calculating text extents and store it for later.
-      ATSUStyle style;
-
-      OSStatus status = ATSUCreateStyle(&style);
-      if (status != noErr) throw PianoGameError(WSTRING(L"Couldn't create ATSU style.  Error code: " << static_cast<int>(status)));
-
-      Fixed fixed_size = Long2Fix(size);
-      
-      ATSUAttributeTag tags[] = { kATSUSizeTag };
-      ByteCount sizes[] = { sizeof(Fixed) };
-      ATSUAttributeValuePtr values[] = { &fixed_size };
-      status = ATSUSetAttributes(style, sizeof(sizes) / sizeof(ByteCount), tags, sizes, values);
-      if (status != noErr) throw PianoGameError(WSTRING(L"Couldn't set ATSU style attributes.  Error code: " << static_cast<int>(status)));
-      
-      atsu_style_lookup[size] = style;      
-   }
-
 #endif
 
+   atlas = GetAtlas(renderer.m_context, size, point_size, fontname);
 }
 
 TextWriter::~TextWriter()
 {
 }
 
+void TextWriter::Prewarm(Renderer &renderer, int size, std::wstring fontname)
+{
+   // Constructing one is all it takes to build the atlas
+   TextWriter tw(0, 0, renderer, false, size, fontname);
+}
+
 int TextWriter::get_point_size() 
 {
    return point_size;
@@ -132,98 +429,54 @@ TextWriter& TextWriter::next_line()
 
 TextWriter& Text::operator<<(TextWriter& tw) const
 {
+   const GlyphAtlas &atlas = *tw.atlas;
+   const TextLayout &layout = GetLayout(atlas, tw.size, m_text);
+
    int draw_x;
    int draw_y;
-   calculate_position_and_advance_cursor(tw, &draw_x, &draw_y);
+   calculate_position_and_advance_cursor(tw, layout.width, &draw_x, &draw_y);
 
-   // TODO: This isn't Unicode!
-   std::string narrow(m_text.begin(), m_text.end());
+   // Our position already includes the renderer's offset, which
+   // DrawTexture is about to add again
+   draw_x -= tw.renderer.m_xoffset;
+   draw_y -= tw.renderer.m_yoffset;
+
+   // The baseline sits where the old bitmap fonts put it
+   const int top = draw_y + tw.size - atlas.ascent;
+   const double cell_tw = static_cast<double>(atlas.cell_width) / static_cast<double>(atlas.tex_width);
+   const double cell_th = static_cast<double>(atlas.cell_height) / static_cast<double>(atlas.tex_height);
+
+   Renderer::RecordTextRun(static_cast<unsigned int>(layout.glyphs.size()));
 
-   glBindTexture(GL_TEXTURE_2D, 0);
-   
-   glPushMatrix();
    tw.renderer.SetColor(m_color);
-   glListBase(font_size_lookup[tw.size]); 
-   glRasterPos2i(draw_x, draw_y + tw.size);
-   glCallLists(static_cast<int>(narrow.length()), GL_UNSIGNED_BYTE, narrow.c_str());
-   glPopMatrix();
+   for (size_t i = 0; i < layout.glyphs.size(); ++i)
+   {
+      int page, column, row;
+      FindCell(atlas, layout.glyphs[i], &page, &column, &row);
+
+      const double tx = column * cell_tw;
+      const double ty = row * cell_th;
 
-   // TODO: Should probably delete these on shutdown.
-   //glDeleteLists(1000, 128);
+      tw.renderer.DrawTexture(atlas.texture_ids[page], draw_x + layout.pen_x[i] - GlyphPadding, top,
+         atlas.cell_width, atlas.cell_height, tx, ty, cell_tw, cell_th);
+   }
 
    return tw;
 }
 
-void Text::calculate_position_and_advance_cursor(TextWriter &tw, int *out_x, int *out_y) const
+void Text::calculate_position_and_advance_cursor(TextWriter &tw, int width, int *out_x, int *out_y) const
 {
-#ifdef WIN32
-
-   const long options = DT_LEFT | DT_NOPREFIX;
-
-   Context c = tw.renderer.m_context;
-   int previous_map_mode = SetMapMode(c, MM_TEXT);
+   tw.last_line_height = tw.atlas->line_height;
 
-   HFONT font = font_handle_lookup[tw.size];
-
-   // Create the font we want to use, and swap it out with
-   // whatever is currently in there, along with our color
-   HFONT previous_font = (HFONT)SelectObject(c, font);
-
-   // Call DrawText to find out how large our text is
-   RECT drawing_rect = { tw.x, tw.y, 0, 0 };
-   tw.last_line_height = DrawText(c, m_text.c_str(), int(m_text.length()), &drawing_rect, options | DT_CALCRECT);
-
-   // Return the hdc settings to their previous setting
-   SelectObject(c, previous_font);
-   SetMapMode(c, previous_map_mode);
-
-#else
-
-   // Convert passed-in text to Unicode
-   CFStringRef cftext = MacStringFromWide(m_text, true).get();
-   CFDataRef unitext = CFStringCreateExternalRepresentation(kCFAllocatorDefault, cftext, kCFStringEncodingUnicode, 0);
-   if (!unitext) throw PianoGameError(WSTRING(L"Couldn't convert string to unicode: '" << m_text << L"'"));
-   CFRelease(cftext);
-
-   // Create an ATSU layout
-   ATSUTextLayout layout;
-   const UniCharCount run_length = kATSUToTextEnd;
-   OSStatus status = ATSUCreateTextLayoutWithTextPtr((ConstUniCharArrayPtr)CFDataGetBytePtr(unitext), kATSUFromTextBeginning, kATSUToTextEnd, CFDataGetLength(unitext) / 2, 1, &run_length, &atsu_style_lookup[tw.size], &layout);
-   if (status != noErr) throw PianoGameError(WSTRING(L"Couldn't create ATSU text layout for string: '" << m_text << L"', Error code: " << static_cast<int>(status)));
-
-   // Measure the size of the resulting text
-   Rect drawing_rect = { 0, 0, 0, 0 };
-   
-   ATSUTextMeasurement before = 0;
-   ATSUTextMeasurement after = 0;
-   ATSUTextMeasurement ascent = 0;
-   ATSUTextMeasurement descent = 0;
-   
-   status = ATSUGetUnjustifiedBounds(layout, 0, kATSUToTextEnd, &before, &after, &ascent, &descent);
-   if (status != noErr) throw PianoGameError(WSTRING(L"Couldn't get unjustified bounds for text layout for string: '" << m_text << L"', Error code: " << static_cast<int>(status)));
-
-   // NOTE: the +1 here is completely arbitrary and seemed to place the text better.
-   // It may just be a difference between the Windows and Mac text placement systems.
-   drawing_rect.top += tw.y + 1;
-   drawing_rect.left += tw.x + FixRound(before);
-   drawing_rect.right += tw.x + FixRound(after);
-
-   // Not used.
-   drawing_rect.bottom = 0;
-
-   // Clean-up
-	ATSUDisposeTextLayout(layout);
-   CFRelease(unitext);
-
-#endif
+   int left = tw.x;
 
    // Update the text-writer with post-draw coordinates
-   if (tw.centered) drawing_rect.left -= (drawing_rect.right - drawing_rect.left) / 2;
-   if (!tw.centered) tw.x += drawing_rect.right - drawing_rect.left;
+   if (tw.centered) left -= width / 2;
+   if (!tw.centered) tw.x += width;
 
    // Tell the draw function where to put the text
-   *out_x = drawing_rect.left;
-   *out_y = drawing_rect.top;
+   *out_x = left;
+   *out_y = tw.y;
 }
 
 TextWriter& operator<<(TextWriter& tw, const Text& t)
@@ -18,12 +18,14 @@
 #include "TrackProperties.h"
 
 class Renderer;
+struct GlyphAtlas;
 
 // A nice ostream-like class for drawing OS-specific (or OpenGL) text to the
 // screen in varying colors, fonts, and sizes.
 //
-// MACNOTE: Mac version of text-placement routine inserts a bizarre space
-// after each successive << operator.
+// Each font size is rasterized into a glyph texture the first time it is
+// used (see Prewarm) and strings are drawn as quads through the Renderer,
+// so constructing one of these every frame is cheap.
 //
 class TextWriter
 {
@@ -33,6 +35,10 @@ public:
    TextWriter(int in_x, int in_y, Renderer &in_renderer, bool in_centered = false, int in_size = 12, std::wstring fontname = L"Trebuchet MS");
    ~TextWriter();
 
+   // Builds the glyph texture for a font size ahead of time, so the
+   // first screen to use it doesn't hitch.  Needs a current GL context.
+   static void Prewarm(Renderer &renderer, int size, std::wstring fontname = L"Trebuchet MS");
+
    // Skips at least 1 line, or the height of the last write... whichever is greater
    // (so that you can skip down past a multiline write)
    TextWriter& next_line();
@@ -55,6 +61,7 @@ private:
    int last_line_height;
    bool centered;
    Renderer renderer;
+   const GlyphAtlas *atlas;
 
    friend class Text;
 };
@@ -94,10 +101,9 @@ public:
 private:
 
    // This will return where the text should be drawn on
-   // the screen (determined in an OS dependent way) and
-   // advance the TextWriter's position by the width and/or
-   // height of the text.
-   void calculate_position_and_advance_cursor(TextWriter &tw, int *out_x, int *out_y) const;
+   // the screen and advance the TextWriter's position by
+   // the width and/or height of the text.
+   void calculate_position_and_advance_cursor(TextWriter &tw, int width, int *out_x, int *out_y) const;
    
    Color m_color;
    std::wstring m_text;
@@ -0,0 +1,251 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "TextureAtlas.h"
+#include "Renderer.h"
+#include "SoftwareRasterizer.h"
+#include "PianoGameError.h"
+
+#include "os_graphics.h"
+
+#include <algorithm>
+using namespace std;
+
+// Any card we run on handles this much
+const static unsigned int MaxAtlasSize = 2048;
+
+// Each image's edge pixels are repeated this far out around it.  Linear
+// filtering reads one texel past the edge of a rectangle, which would
+// otherwise be some neighboring image.
+const static unsigned int Padding = 1;
+
+static unsigned int NextPowerOfTwo(unsigned int n)
+{
+   unsigned int p = 1;
+   while (p < n) p *= 2;
+   return p;
+}
+
+TextureAtlas::TextureAtlas(bool smooth)
+   : m_smooth(smooth), m_texture_id(0), m_width(0), m_height(0)
+{ }
+
+TextureAtlas::~TextureAtlas()
+{
+   for (vector<Entry>::iterator i = m_entries.begin(); i != m_entries.end(); ++i) Tga::Release(i->tga);
+   if (m_texture_id == 0) return;
+
+   Renderer::Flush();
+
+   if (SoftwareRasterizer *software = Renderer::GetSoftwareRasterizer()) software->ReleaseTexture(m_texture_id);
+   else glDeleteTextures(1, &m_texture_id);
+}
+
+void TextureAtlas::Add(int key, const Tga::Image &image)
+{
+   if (m_texture_id != 0) throw PianoGameError(L"Images can't be added to a texture atlas after it is built.");
+   if (image.bpp != 24 && image.bpp != 32) throw PianoGameError(L"Unsupported texture atlas image format.");
+
+   Entry entry;
+   entry.key = key;
+   entry.image = image;
+   entry.x = 0;
+   entry.y = 0;
+   entry.tga = 0;
+
+   m_entries.push_back(entry);
+}
+
+void TextureAtlas::Place(int key, unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+{
+   if (m_texture_id != 0) throw PianoGameError(L"Images can't be added to a texture atlas after it is built.");
+
+   Entry entry;
+   entry.key = key;
+   entry.image.width = width;
+   entry.image.height = height;
+   entry.image.bpp = 32;
+   entry.x = x;
+   entry.y = y;
+   entry.tga = 0;
+
+   m_entries.push_back(entry);
+}
+
+bool TextureAtlas::GetPlacement(int key, unsigned int *x, unsigned int *y, unsigned int *width, unsigned int *height) const
+{
+   for (vector<Entry>::const_iterator i = m_entries.begin(); i != m_entries.end(); ++i)
+   {
+      if (i->key != key) continue;
+
+      *x = i->x;
+      *y = i->y;
+      *width = i->image.width;
+      *height = i->image.height;
+      return true;
+   }
+
+   return false;
+}
+
+Tga *TextureAtlas::Get(int key) const
+{
+   for (vector<Entry>::const_iterator i = m_entries.begin(); i != m_entries.end(); ++i)
+   {
+      if (i->key == key) return i->tga;
+   }
+
+   return 0;
+}
+
+struct TallerEntry
+{
+   TallerEntry(const vector<unsigned int> &heights) : m_heights(heights) { }
+   bool operator()(size_t lhs, size_t rhs) const { return m_heights[lhs] > m_heights[rhs]; }
+
+   const vector<unsigned int> &m_heights;
+};
+
+unsigned int TextureAtlas::Pack(unsigned int width)
+{
+   // Tallest first, so each shelf wastes as little height as possible
+   vector<unsigned int> heights(m_entries.size());
+   vector<size_t> order(m_entries.size());
+   for (size_t i = 0; i < m_entries.size(); ++i)
+   {
+      heights[i] = m_entries[i].image.height + Padding*2;
+      order[i] = i;
+   }
+   stable_sort(order.begin(), order.end(), TallerEntry(heights));
+
+   unsigned int shelf_x = 0;
+   unsigned int shelf_y = 0;
+   unsigned int shelf_height = 0;
+
+   for (size_t n = 0; n < order.size(); ++n)
+   {
+      Entry &entry = m_entries[order[n]];
+      const unsigned int padded_width = entry.image.width + Padding*2;
+
+      if (shelf_x + padded_width > width)
+      {
+         shelf_y += shelf_height;
+         shelf_x = 0;
+         shelf_height = 0;
+      }
+
+      entry.x = shelf_x + Padding;
+      entry.y = shelf_y + Padding;
+
+      shelf_x += padded_width;
+      shelf_height = max(shelf_height, heights[order[n]]);
+   }
+
+   return shelf_y + shelf_height;
+}
+
+void TextureAtlas::Blit(const Entry &entry, vector<unsigned char> &texels) const
+{
+   const Tga::Image &image = entry.image;
+   const unsigned int bytes_per_pixel = image.bpp / 8;
+
+   // Every texel in the padded rectangle takes the nearest image pixel
+   const int left = static_cast<int>(entry.x - Padding);
+   const int bottom = static_cast<int>(entry.y - Padding);
+   const int padded_width = static_cast<int>(image.width + Padding*2);
+   const int padded_height = static_cast<int>(image.height + Padding*2);
+
+   for (int row = 0; row < padded_height; ++row)
+   {
+      const int image_row = max(0, min(row - static_cast<int>(Padding), static_cast<int>(image.height) - 1));
+      const unsigned char *src_row = &image.pixels[image_row * image.width * bytes_per_pixel];
+      unsigned char *dest = &texels[((bottom + row) * m_width + left) * 4];
+
+      for (int column = 0; column < padded_width; ++column)
+      {
+         const int image_column = max(0, min(column - static_cast<int>(Padding), static_cast<int>(image.width) - 1));
+         const unsigned char *src = src_row + image_column * bytes_per_pixel;
+
+         dest[0] = src[0];
+         dest[1] = src[1];
+         dest[2] = src[2];
+         dest[3] = (bytes_per_pixel == 4 ? src[3] : 0xFF);
+         dest += 4;
+      }
+   }
+}
+
+void TextureAtlas::Build()
+{
+   if (m_texture_id != 0) return;
+
+   vector<unsigned char> texels;
+   Arrange(texels);
+
+   Upload(m_width, m_height, &texels[0]);
+}
+
+void TextureAtlas::Arrange(vector<unsigned char> &texels)
+{
+   if (m_texture_id != 0) throw PianoGameError(L"A texture atlas can't be arranged after it is built.");
+
+   unsigned int widest = 1;
+   for (vector<Entry>::const_iterator i = m_entries.begin(); i != m_entries.end(); ++i) widest = max(widest, i->image.width + Padding*2);
+
+   // Start as narrow as the widest image allows and widen until the
+   // atlas is about square (smaller textures are kinder to old cards)
+   unsigned int width = NextPowerOfTwo(widest);
+   unsigned int height = NextPowerOfTwo(Pack(width));
+   while (height > width && width < MaxAtlasSize)
+   {
+      width *= 2;
+      height = NextPowerOfTwo(Pack(width));
+   }
+
+   if (width > MaxAtlasSize || height > MaxAtlasSize) throw PianoGameError(L"Too many graphics to fit in one texture.");
+
+   m_width = width;
+   m_height = height;
+
+   texels.assign(m_width * m_height * 4, 0);
+   for (vector<Entry>::const_iterator i = m_entries.begin(); i != m_entries.end(); ++i) Blit(*i, texels);
+}
+
+void TextureAtlas::Upload(unsigned int width, unsigned int height, const unsigned char *texels)
+{
+   if (m_texture_id != 0) return;
+
+   m_width = width;
+   m_height = height;
+
+   if (SoftwareRasterizer *software = Renderer::GetSoftwareRasterizer())
+   {
+      m_texture_id = software->CreateTexture(m_width, m_height, 4, texels);
+      software->SetSmooth(m_texture_id, m_smooth);
+   }
+   else
+   {
+      // Quads already batched might be waiting on whatever is bound
+      Renderer::Flush();
+
+      glGenTextures(1, &m_texture_id);
+      if (!m_texture_id) throw PianoGameError(L"Couldn't create texture atlas.");
+
+      const GLint filter = (m_smooth ? GL_LINEAR : GL_NEAREST);
+
+      glBindTexture(GL_TEXTURE_2D, m_texture_id);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, m_width, m_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+   }
+
+   for (vector<Entry>::iterator i = m_entries.begin(); i != m_entries.end(); ++i)
+   {
+      i->tga = Tga::Region(m_texture_id, m_width, m_height, i->x, i->y, i->image.width, i->image.height);
+
+      // The texture has its own copy now
+      vector<unsigned char>().swap(i->image.pixels);
+   }
+}
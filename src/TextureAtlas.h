@@ -0,0 +1,82 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __TEXTURE_ATLAS_H
+#define __TEXTURE_ATLAS_H
+
+#include <vector>
+
+#include "Tga.h"
+
+// Packs a set of images into one texture, so anything drawn from the set
+// batches together (see Renderer::Flush) no matter how the draws are
+// interleaved.  Each image comes back out as a Tga for its own rectangle.
+//
+// Filtering is per texture, so images that are drawn smoothed and ones
+// that aren't need separate atlases.
+class TextureAtlas
+{
+public:
+   TextureAtlas(bool smooth);
+   ~TextureAtlas();
+
+   // Everything has to be added before Build.  The key is only for Get.
+   void Add(int key, const Tga::Image &image);
+
+   // Packs every image and uploads the texture.  Throws PianoGameError
+   // if they won't all fit in the largest texture we're willing to make.
+   void Build();
+
+   // The first half of Build: packs every image into RGBA texels (bottom
+   // row first, GetWidth by GetHeight) without creating a texture.
+   void Arrange(std::vector<unsigned char> &texels);
+
+   // Where Arrange put an image (not including its padding).  False for
+   // a key that wasn't added.
+   bool GetPlacement(int key, unsigned int *x, unsigned int *y, unsigned int *width, unsigned int *height) const;
+
+   // For texels arranged ahead of time (see GraphicsArchive): Place each
+   // image where Arrange put it instead of Adding it, then Upload.
+   void Place(int key, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+   void Upload(unsigned int width, unsigned int height, const unsigned char *texels);
+
+   // Zero for a key that wasn't added (or before Build)
+   Tga *Get(int key) const;
+
+   unsigned int GetWidth() const { return m_width; }
+   unsigned int GetHeight() const { return m_height; }
+
+private:
+   // Not copyable
+   TextureAtlas(const TextureAtlas &);
+   TextureAtlas &operator=(const TextureAtlas &);
+
+   struct Entry
+   {
+      int key;
+      Tga::Image image;
+
+      // Where the image (not its padding) goes
+      unsigned int x;
+      unsigned int y;
+
+      Tga *tga;
+   };
+
+   // Places every entry on shelves across the given width and returns
+   // the height they need
+   unsigned int Pack(unsigned int width);
+
+   void Blit(const Entry &entry, std::vector<unsigned char> &texels) const;
+
+   bool m_smooth;
+
+   std::vector<Entry> m_entries;
+
+   TextureId m_texture_id;
+   unsigned int m_width;
+   unsigned int m_height;
+};
+
+#endif
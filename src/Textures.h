@@ -73,4 +73,57 @@ const static wchar_t* TextureResourceNames[_TextureEnumCount] =
    L"play_KeysBlack"
 };
 
+// Each page is one TextureAtlas, uploaded as a unit.  The menu screens
+// share a page, and the playing screen gets its own two.  (Graphics
+// stretched across the keyboard look better filtered, and filtering is
+// per texture.)
+enum TexturePage
+{
+   TexturePageMenus,
+   TexturePagePlaying,
+   TexturePagePlayingSmooth,
+
+   _TexturePageEnumCount
+};
+
+const static bool TexturePageSmooth[_TexturePageEnumCount] =
+{
+   false, // TexturePageMenus
+   false, // TexturePagePlaying
+   true   // TexturePagePlayingSmooth
+};
+
+const static TexturePage TexturePages[_TextureEnumCount] =
+{
+   TexturePageMenus,         // TitleLogo
+   TexturePageMenus,         // InterfaceButtons
+
+   TexturePageMenus,         // ButtonRetrySong
+   TexturePageMenus,         // ButtonChooseTracks
+   TexturePageMenus,         // ButtonExit
+   TexturePageMenus,         // ButtonBackToTitle
+   TexturePageMenus,         // ButtonPlaySong
+
+   TexturePageMenus,         // InputBox
+   TexturePageMenus,         // OutputBox
+   TexturePageMenus,         // SongBox
+
+   TexturePageMenus,         // TrackPanel
+
+   TexturePageMenus,         // StatsText
+
+   TexturePagePlaying,       // PlayStatus
+   TexturePagePlaying,       // PlayStatus2
+   TexturePagePlaying,       // PlayKeys
+
+   TexturePagePlayingSmooth, // PlayNotesBlackColor
+   TexturePagePlayingSmooth, // PlayNotesBlackShadow
+   TexturePagePlayingSmooth, // PlayNotesWhiteColor
+   TexturePagePlayingSmooth, // PlayNotesWhiteShadow
+
+   TexturePagePlaying,       // PlayKeyRail
+   TexturePagePlaying,       // PlayKeyShadow
+   TexturePagePlayingSmooth  // PlayKeysBlack
+};
+
 #endif
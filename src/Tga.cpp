@@ -1,11 +1,109 @@
 #include "Tga.h"
+#include "Renderer.h"
+#include "SoftwareRasterizer.h"
 
 #include "os.h"
 #include "os_graphics.h"
 #include "string_util.h"
 #include "PianoGameError.h"
+#include "CompatibleSystem.h"
+
+// PowerPC Macs only get the plain versions (see Compatible::HasSse2)
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define TGA_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef TGA_SSE2
+static const bool HasSse2 = Compatible::HasSse2();
+#else
+static const bool HasSse2 = false;
+#endif
+
+static bool SimdEnabled = true;
+
+bool Tga::HasSimd() { return HasSse2; }
+void Tga::EnableSimd(bool enable) { SimdEnabled = enable; }
+
+// TGA stores BGR(A).  This swaps it to RGB(A) in place.
+static void SwapRedBlue(unsigned char *pixels, unsigned int count, unsigned int bytes_per_pixel)
+{
+   unsigned int i = 0;
+
+#ifdef TGA_SSE2
+   if (bytes_per_pixel == 4 && HasSse2 && SimdEnabled)
+   {
+      // Four pixels at a time.  Shifting each 32-bit lane 16 bits either
+      // way trades the first and third bytes, and the masks keep the
+      // second and fourth where they are.
+      const __m128i green_alpha = _mm_set1_epi32(static_cast<int>(0xFF00FF00));
+      const __m128i red_blue = _mm_set1_epi32(0x00FF00FF);
+
+      for (; i + 4 <= count; i += 4)
+      {
+         __m128i *p = reinterpret_cast<__m128i*>(pixels + i*4);
+
+         const __m128i v = _mm_loadu_si128(p);
+         const __m128i rb = _mm_and_si128(v, red_blue);
+         const __m128i swapped = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+
+         _mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(v, green_alpha), swapped));
+      }
+   }
+#endif
+
+   for (unsigned char *p = pixels + i*bytes_per_pixel; i < count; ++i, p += bytes_per_pixel)
+   {
+      const unsigned char b = p[0];
+      p[0] = p[2];
+      p[2] = b;
+   }
+}
+
+// Writes count copies of the pixel at src
+static void FillPixels(unsigned char *dest, const unsigned char *src, unsigned int count, unsigned int bytes_per_pixel)
+{
+#ifdef TGA_SSE2
+   if (bytes_per_pixel == 4 && HasSse2 && SimdEnabled)
+   {
+      int pixel;
+      memcpy(&pixel, src, 4);
+
+      unsigned int i = 0;
+      const __m128i four = _mm_set1_epi32(pixel);
+      for (; i + 4 <= count; i += 4) _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i*4), four);
+
+      for (; i < count; ++i) memcpy(dest + i*4, &pixel, 4);
+      return;
+   }
+#endif
+
+   // Otherwise the filled part is doubled until it's long enough
+   const unsigned int total = count * bytes_per_pixel;
+   memcpy(dest, src, bytes_per_pixel);
+
+   for (unsigned int filled = bytes_per_pixel; filled < total; )
+   {
+      const unsigned int chunk = (filled < total - filled ? filled : total - filled);
+      memcpy(dest + filled, dest, chunk);
+      filled += chunk;
+   }
+}
 
 Tga* Tga::Load(const std::wstring &resource_name)
+{
+   Image image;
+   Decode(resource_name, &image);
+
+   Tga *ret = BuildFromParameters(&image.pixels[0], image.width, image.height, image.bpp);
+   if (!ret) throw PianoGameError(L"Couldn't create TGA texture.");
+
+   ret->SetSmooth(false);
+
+   return ret;
+}
+
+void Tga::Decode(const std::wstring &resource_name, Image *image)
 {
 
 #ifdef WIN32
@@ -22,7 +120,7 @@ Tga* Tga::Load(const std::wstring &resource_name)
    const unsigned char *bytes = reinterpret_cast<unsigned char*>(LockResource(resource));
    if (!bytes) throw PianoGameError(L"Couldn't lock TGA resource.");
 
-   Tga *ret = LoadFromData(bytes);
+   LoadFromData(bytes, image);
    FreeResource(resource);
 
 #else
@@ -40,21 +138,53 @@ Tga* Tga::Load(const std::wstring &resource_name)
    
    const UInt8 *bytes = CFDataGetBytePtr(data);   
 
-   Tga *ret = LoadFromData(bytes);
+   LoadFromData(bytes, image);
    CFRelease(data);
    
 #endif
+}
 
-   ret->SetSmooth(false);
+Tga *Tga::Region(TextureId texture_id, unsigned int texture_width, unsigned int texture_height,
+                 unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+{
+   Tga *t = new Tga();
+   t->m_texture_id = texture_id;
+   t->m_width = width;
+   t->m_height = height;
+   t->m_x = x;
+   t->m_y = y;
+   t->m_texture_width = texture_width;
+   t->m_texture_height = texture_height;
+   t->m_owns_texture = false;
 
-   return ret;
+   return t;
+}
+
+void Tga::TexCoords(int src_x, int src_y, int src_w, int src_h, double *tx, double *ty, double *tw, double *th) const
+{
+   const double texture_width = static_cast<double>(m_texture_width);
+   const double texture_height = static_cast<double>(m_texture_height);
+
+   // The rows are stored bottom first, so the top of the image is at the
+   // far end of its rectangle and moving down the image moves toward v=0
+   *tx = (m_x + src_x) / texture_width;
+   *ty = (static_cast<int>(m_y + m_height) - src_y) / texture_height;
+   *tw = src_w / texture_width;
+   *th = -src_h / texture_height;
 }
 
 void Tga::Release(Tga *tga)
 {
    if (!tga) return;
 
-   glDeleteTextures(1, &tga->m_texture_id);
+   if (!tga->m_owns_texture)
+   {
+      delete tga;
+      return;
+   }
+
+   if (SoftwareRasterizer *software = Renderer::GetSoftwareRasterizer()) software->ReleaseTexture(tga->m_texture_id);
+   else glDeleteTextures(1, &tga->m_texture_id);
 
    delete tga;
 }
@@ -65,6 +195,22 @@ const static unsigned char CompressedTgaHeader[TgaTypeHeaderLength] = {0,0,10,0,
 
 void Tga::SetSmooth(bool smooth)
 {
+   // This is called every time a state asks for a texture,
+   // so only touch OpenGL when the filter actually changes.
+   if (m_smooth_set && m_smooth == smooth) return;
+   m_smooth = smooth;
+   m_smooth_set = true;
+
+   // Quads already batched with this texture were drawn
+   // expecting the old filter.
+   Renderer::Flush();
+
+   if (SoftwareRasterizer *software = Renderer::GetSoftwareRasterizer())
+   {
+      software->SetSmooth(m_texture_id, smooth);
+      return;
+   }
+
    GLint filter = GL_NEAREST;
    if (smooth) filter = GL_LINEAR;
 
@@ -80,9 +226,9 @@ enum TgaType
    TgaUnknown
 };
 
-Tga *Tga::LoadFromData(const unsigned char *bytes)
+void Tga::LoadFromData(const unsigned char *bytes, Image *image)
 {
-   if (!bytes) return 0;
+   if (!bytes) throw PianoGameError(L"Couldn't read TGA resource.");
 
    const unsigned char *pos = bytes;
 
@@ -117,93 +263,62 @@ Tga *Tga::LoadFromData(const unsigned char *bytes)
    }
 
    const unsigned int data_size = width * height * bpp/8;
-   unsigned char *image_data = new unsigned char[data_size];
 
-   Tga *t = 0;
-   if (type == TgaCompressed) t = LoadCompressed(pos, image_data, width, height, bpp);
-   if (type == TgaUncompressed) t = LoadUncompressed(pos, image_data, data_size, width, height, bpp);
+   image->width = width;
+   image->height = height;
+   image->bpp = bpp;
+   image->pixels.resize(data_size);
 
-   delete[] image_data;
-   return t;
+   if (type == TgaCompressed) LoadCompressed(pos, &image->pixels[0], width, height, bpp);
+   if (type == TgaUncompressed) LoadUncompressed(pos, &image->pixels[0], data_size, width, height, bpp);
 }
 
-Tga *Tga::LoadUncompressed(const unsigned char *src, unsigned char *dest, unsigned int size, unsigned int width, unsigned int height, unsigned int bpp)
+void Tga::LoadUncompressed(const unsigned char *src, unsigned char *dest, unsigned int size, unsigned int, unsigned int, unsigned int bpp)
 {
    // We can use most of the data as-is with little modification
    memcpy(dest, src, size);
-
-   for (unsigned int cswap = 0; cswap < size; cswap += bpp/8)
-   {
-      dest[cswap] ^= dest[cswap+2] ^= dest[cswap] ^= dest[cswap+2];
-   }
-
-   return BuildFromParameters(dest, width, height, bpp);
+   SwapRedBlue(dest, size / (bpp/8), bpp/8);
 }
 
-Tga *Tga::LoadCompressed(const unsigned char *src, unsigned char *dest, unsigned int width, unsigned int height, unsigned int bpp)
+void Tga::LoadCompressed(const unsigned char *src, unsigned char *dest, unsigned int width, unsigned int height, unsigned int bpp)
 {
    const unsigned char *pos = src;
 
    const unsigned int BytesPerPixel = bpp / 8;
    const unsigned int PixelCount = height * width;
 
-   const static unsigned int MaxBytesPerPixel = 4;
-   unsigned char pixel_buffer[MaxBytesPerPixel];
-
    unsigned int pixel = 0;
-   unsigned int byte = 0;
+   unsigned char *out = dest;
 
+   // Everything is decoded in the file's BGR order first, so the colors
+   // can be swapped in one long pass at the end instead of pixel by pixel
    while (pixel < PixelCount)
    {
-      unsigned char chunkheader = 0;
-      memcpy(&chunkheader, pos, sizeof(unsigned char));
-      pos += sizeof(unsigned char);
+      const unsigned char chunkheader = *pos++;
+      const unsigned int count = (chunkheader & 0x7F) + 1;
+
+      if (pixel + count > PixelCount) throw PianoGameError(L"Too many pixels in TGA.");
 
       if (chunkheader < 128)
       {
-         chunkheader++;
-         for (short i = 0; i < chunkheader; i++)
-         {
-            memcpy(pixel_buffer, pos, BytesPerPixel);
-            pos += BytesPerPixel;
-
-            dest[byte + 0] = pixel_buffer[2];
-            dest[byte + 1] = pixel_buffer[1];
-            dest[byte + 2] = pixel_buffer[0];
-            if (BytesPerPixel == 4) dest[byte + 3] = pixel_buffer[3];
-
-            byte += BytesPerPixel;
-            pixel++;
-
-            if (pixel > PixelCount) throw PianoGameError(L"Too many pixels in TGA.");
-         }
+         // A packet of raw pixels
+         memcpy(out, pos, count * BytesPerPixel);
+         pos += count * BytesPerPixel;
       }
       else
       {
-         chunkheader -= 127;
-
-         memcpy(pixel_buffer, pos, BytesPerPixel);
+         // One pixel, repeated
+         FillPixels(out, pos, count, BytesPerPixel);
          pos += BytesPerPixel;
-
-         for (short i = 0; i < chunkheader; i++)
-         {
-            dest[byte + 0] = pixel_buffer[2];
-            dest[byte + 1] = pixel_buffer[1];
-            dest[byte + 2] = pixel_buffer[0];
-            if (BytesPerPixel == 4) dest[byte + 3] = pixel_buffer[3];
-
-            byte += BytesPerPixel;
-            pixel++;
-
-            if (pixel > PixelCount) throw PianoGameError(L"Too many pixels in TGA.");
-         }
       }
+
+      out += count * BytesPerPixel;
+      pixel += count;
    }
 
-   return BuildFromParameters(dest, width, height, bpp);
+   SwapRedBlue(dest, PixelCount, BytesPerPixel);
 }
 
-
 Tga *Tga::BuildFromParameters(const unsigned char *raw, unsigned int width, unsigned int height, unsigned int bpp)
 {
    unsigned int pixel_format = 0;
@@ -211,16 +326,25 @@ Tga *Tga::BuildFromParameters(const unsigned char *raw, unsigned int width, unsi
    if (bpp == 32) pixel_format = GL_RGBA;
 
    TextureId id;
-   glGenTextures(1, &id);
-   if (!id) return 0;
+   if (SoftwareRasterizer *software = Renderer::GetSoftwareRasterizer())
+   {
+      id = software->CreateTexture(width, height, bpp/8, raw);
+   }
+   else
+   {
+      glGenTextures(1, &id);
+      if (!id) return 0;
 
-   glBindTexture(GL_TEXTURE_2D, id);
-   glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-   glTexImage2D(GL_TEXTURE_2D, 0, bpp/8, width, height, 0, pixel_format, GL_UNSIGNED_BYTE, raw);
+      glBindTexture(GL_TEXTURE_2D, id);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+      glTexImage2D(GL_TEXTURE_2D, 0, bpp/8, width, height, 0, pixel_format, GL_UNSIGNED_BYTE, raw);
+   }
 
    Tga *t = new Tga();
    t->m_width = width;
    t->m_height = height;
+   t->m_texture_width = width;
+   t->m_texture_height = height;
    t->m_texture_id = id;
 
    return t;
@@ -2,6 +2,7 @@
 #define __TGA_H
 
 #include <string>
+#include <vector>
 
 #ifdef WIN32
 typedef unsigned int TextureId;
@@ -12,13 +13,43 @@ typedef unsigned long TextureId;
 class Tga
 {
 public:
+   // Decoded pixels, bottom row first, in RGB (bpp 24) or RGBA (bpp 32) order
+   struct Image
+   {
+      Image() : width(0), height(0), bpp(0) { }
+
+      unsigned int width;
+      unsigned int height;
+      unsigned int bpp;
+      std::vector<unsigned char> pixels;
+   };
+
    static Tga *Load(const std::wstring &resource_name);
    static void Release(Tga *tga);
 
+   // Reads a resource without creating a texture for it.  Safe to call
+   // from any thread.
+   static void Decode(const std::wstring &resource_name, Image *image);
+
+   // Decoding uses SSE2 where the processor has it.  Disabling it (to
+   // compare, see BenchmarkTgaDecode) falls back to plain C++.
+   static bool HasSimd();
+   static void EnableSimd(bool enable);
+
+   // A Tga for one rectangle (bottom row at y) of a texture that someone
+   // else owns, like a TextureAtlas.  Releasing it leaves the texture alone.
+   static Tga *Region(TextureId texture_id, unsigned int texture_width, unsigned int texture_height,
+      unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+
    TextureId GetId() const { return m_texture_id; }
    unsigned int GetWidth() const { return m_width; }
    unsigned int GetHeight() const { return m_height; }
 
+   // Converts a rectangle of the image (in pixels, from its top left)
+   // to the texture coordinates of its top left corner and its extent
+   void TexCoords(int src_x, int src_y, int src_w, int src_h, double *tx, double *ty, double *tw, double *th) const;
+
+   // For a region, this changes the filter of the whole texture
    void SetSmooth(bool smooth);
 
 private:
@@ -26,17 +57,27 @@ private:
    unsigned int m_width;
    unsigned int m_height;
 
-   Tga() { }
+   // Where the image sits in its texture
+   unsigned int m_x;
+   unsigned int m_y;
+   unsigned int m_texture_width;
+   unsigned int m_texture_height;
+   bool m_owns_texture;
+
+   bool m_smooth;
+   bool m_smooth_set;
+
+   Tga() : m_x(0), m_y(0), m_owns_texture(true), m_smooth(false), m_smooth_set(false) { }
    ~Tga() { }
 
    Tga(const Tga& rhs);
    Tga &operator=(const Tga& rhs);
 
 
-   static Tga *LoadFromData(const unsigned char *bytes);
+   static void LoadFromData(const unsigned char *bytes, Image *image);
 
-   static Tga *LoadCompressed(const unsigned char *src, unsigned char *dest, unsigned int width, unsigned int height, unsigned int bpp);
-   static Tga *LoadUncompressed(const unsigned char *src, unsigned char *dest, unsigned int size, unsigned int width, unsigned int height, unsigned int bpp);
+   static void LoadCompressed(const unsigned char *src, unsigned char *dest, unsigned int width, unsigned int height, unsigned int bpp);
+   static void LoadUncompressed(const unsigned char *src, unsigned char *dest, unsigned int size, unsigned int width, unsigned int height, unsigned int bpp);
 
    static Tga *BuildFromParameters(const unsigned char *data, unsigned int width, unsigned int height, unsigned int bpp);
 };
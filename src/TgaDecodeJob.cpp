@@ -0,0 +1,183 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "TgaDecodeJob.h"
+#include "CompatibleSystem.h"
+#include "PianoGameError.h"
+#include "string_util.h"
+
+#include <iomanip>
+using namespace std;
+
+// There are only a couple dozen images, so past this more threads just
+// fight over the same few
+const static int MaxThreads = 4;
+
+TgaDecodeJob::TgaDecodeJob(const vector<wstring> &resource_names, int thread_count)
+   : m_names(resource_names), m_images(resource_names.size()), m_started(Compatible::GetMicroseconds()),
+   m_next(0), m_done(0), m_finished(0)
+{
+   if (m_names.empty()) m_finished = m_started;
+
+   thread_count = min(thread_count, static_cast<int>(m_names.size()));
+   if (thread_count <= 0)
+   {
+      Work();
+      return;
+   }
+
+#ifdef WIN32
+   for (int i = 0; i < thread_count; ++i) m_threads.push_back(CreateThread(0, 0, WorkerMain, this, 0, 0));
+#else
+   m_threads.resize(thread_count);
+   for (int i = 0; i < thread_count; ++i) pthread_create(&m_threads[i], 0, WorkerMain, this);
+#endif
+}
+
+TgaDecodeJob::~TgaDecodeJob()
+{
+   Join();
+}
+
+int TgaDecodeJob::DefaultThreadCount()
+{
+   return min(Compatible::GetProcessorCount(), MaxThreads);
+}
+
+#ifdef WIN32
+
+DWORD WINAPI TgaDecodeJob::WorkerMain(LPVOID self)
+{
+   static_cast<TgaDecodeJob*>(self)->Work();
+   return 0;
+}
+
+void TgaDecodeJob::Join()
+{
+   for (size_t i = 0; i < m_threads.size(); ++i)
+   {
+      WaitForSingleObject(m_threads[i], INFINITE);
+      CloseHandle(m_threads[i]);
+   }
+   m_threads.clear();
+}
+
+#else
+
+void *TgaDecodeJob::WorkerMain(void *self)
+{
+   static_cast<TgaDecodeJob*>(self)->Work();
+   return 0;
+}
+
+void TgaDecodeJob::Join()
+{
+   for (size_t i = 0; i < m_threads.size(); ++i) pthread_join(m_threads[i], 0);
+   m_threads.clear();
+}
+
+#endif
+
+void TgaDecodeJob::Work()
+{
+   while (true)
+   {
+      m_lock.Lock();
+      const size_t index = m_next++;
+      m_lock.Unlock();
+
+      if (index >= m_names.size()) break;
+
+      wstring error;
+      try
+      {
+         Tga::Decode(m_names[index], &m_images[index]);
+      }
+      catch (const PianoGameError &e)
+      {
+         error = WSTRING(m_names[index] << L": " << e.GetErrorDescription());
+      }
+
+      m_lock.Lock();
+      if (m_error.empty()) m_error = error;
+      if (++m_done == m_names.size()) m_finished = Compatible::GetMicroseconds();
+      m_lock.Unlock();
+   }
+}
+
+bool TgaDecodeJob::IsFinished()
+{
+   m_lock.Lock();
+   const bool finished = (m_done == m_names.size());
+   m_lock.Unlock();
+
+   return finished;
+}
+
+void TgaDecodeJob::Wait()
+{
+   Join();
+
+   if (!m_error.empty()) throw PianoGameError(WSTRING(L"Couldn't decode graphics.  " << m_error));
+}
+
+unsigned long long TgaDecodeJob::GetMicroseconds()
+{
+   m_lock.Lock();
+   const unsigned long long finished = (m_done == m_names.size() ? m_finished : Compatible::GetMicroseconds());
+   m_lock.Unlock();
+
+   return finished - m_started;
+}
+
+wstring BenchmarkTgaDecode(const vector<wstring> &resource_names, int passes)
+{
+   const int thread_count = TgaDecodeJob::DefaultThreadCount();
+
+   struct Run
+   {
+      const wchar_t *name;
+      bool simd;
+      int threads;
+   };
+   const Run runs[3] =
+   {
+      { L"One thread, plain C++", false, 0 },
+      { L"One thread, SIMD", true, 0 },
+      { L"Worker threads, SIMD", true, thread_count }
+   };
+
+   unsigned long long pixels = 0;
+   wstring result = WSTRING(L"Decoded " << resource_names.size() << L" graphics " << passes << L" times each"
+      << L" (SSE2 " << (Tga::HasSimd() ? L"available" : L"not available") << L", " << thread_count << L" worker threads)\n\n");
+
+   for (int r = 0; r < 3; ++r)
+   {
+      Tga::EnableSimd(runs[r].simd);
+
+      unsigned long long total = 0;
+      unsigned long long best = 0;
+      for (int pass = 0; pass < passes; ++pass)
+      {
+         TgaDecodeJob job(resource_names, runs[r].threads);
+         job.Wait();
+
+         const unsigned long long elapsed = job.GetMicroseconds();
+         total += elapsed;
+         if (pass == 0 || elapsed < best) best = elapsed;
+
+         if (pixels == 0)
+         {
+            for (size_t i = 0; i < resource_names.size(); ++i) pixels += job.GetImage(i).width * job.GetImage(i).height;
+         }
+      }
+
+      result += WSTRING(left << setw(24) << runs[r].name << L"  avg " << (total / passes) << L" us, best " << best << L" us\n");
+   }
+
+   Tga::EnableSimd(true);
+
+   result += WSTRING(L"\n" << pixels << L" pixels in all\n");
+   return result;
+}
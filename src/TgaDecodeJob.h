@@ -0,0 +1,76 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __TGA_DECODE_JOB_H
+#define __TGA_DECODE_JOB_H
+
+#include <string>
+#include <vector>
+
+#include "Tga.h"
+#include "ThreadLock.h"
+
+// Decodes a list of TGA resources (see Tga::Decode) on a few worker
+// threads.  Creating the textures needs the GL context, so that part is
+// left for the main thread once the pixels are ready.
+class TgaDecodeJob
+{
+public:
+   // Starts decoding right away.  With no threads, everything is
+   // decoded on the spot instead.
+   TgaDecodeJob(const std::vector<std::wstring> &resource_names, int thread_count);
+
+   // Waits for the workers
+   ~TgaDecodeJob();
+
+   bool IsFinished();
+
+   // Waits for every image, then throws the first PianoGameError
+   // decoding ran into (if any)
+   void Wait();
+
+   // Only valid after Wait.  In the same order as the resource names.
+   Tga::Image &GetImage(size_t index) { return m_images[index]; }
+
+   // From construction until the last image was done
+   unsigned long long GetMicroseconds();
+
+   // One worker per processor
+   static int DefaultThreadCount();
+
+private:
+   // Not copyable
+   TgaDecodeJob(const TgaDecodeJob &);
+   TgaDecodeJob &operator=(const TgaDecodeJob &);
+
+   void Work();
+   void Join();
+
+#ifdef WIN32
+   static DWORD WINAPI WorkerMain(LPVOID self);
+   std::vector<HANDLE> m_threads;
+#else
+   static void *WorkerMain(void *self);
+   std::vector<pthread_t> m_threads;
+#endif
+
+   std::vector<std::wstring> m_names;
+   std::vector<Tga::Image> m_images;
+
+   unsigned long long m_started;
+
+   // Everything below is protected by m_lock
+   size_t m_next;
+   size_t m_done;
+   unsigned long long m_finished;
+   std::wstring m_error;
+
+   ThreadLock m_lock;
+};
+
+// Decodes every resource a few times over (one thread with and without
+// SIMD, then with a worker per processor) and describes the timings.
+std::wstring BenchmarkTgaDecode(const std::vector<std::wstring> &resource_names, int passes);
+
+#endif
@@ -0,0 +1,23 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "ThreadLock.h"
+
+#ifdef WIN32
+
+ThreadLock::ThreadLock() { InitializeCriticalSection(&m_lock); }
+ThreadLock::~ThreadLock() { DeleteCriticalSection(&m_lock); }
+
+void ThreadLock::Lock() { EnterCriticalSection(&m_lock); }
+void ThreadLock::Unlock() { LeaveCriticalSection(&m_lock); }
+
+#else
+
+ThreadLock::ThreadLock() { pthread_mutex_init(&m_lock, 0); }
+ThreadLock::~ThreadLock() { pthread_mutex_destroy(&m_lock); }
+
+void ThreadLock::Lock() { pthread_mutex_lock(&m_lock); }
+void ThreadLock::Unlock() { pthread_mutex_unlock(&m_lock); }
+
+#endif
@@ -0,0 +1,37 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __THREAD_LOCK_H
+#define __THREAD_LOCK_H
+
+#include "os.h"
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+// A plain (non-recursive) mutex for anything shared between the
+// main thread and one of the game's own threads.
+class ThreadLock
+{
+public:
+   ThreadLock();
+   ~ThreadLock();
+
+   void Lock();
+   void Unlock();
+
+private:
+   // Not copyable
+   ThreadLock(const ThreadLock &);
+   ThreadLock &operator=(const ThreadLock &);
+
+#ifdef WIN32
+   CRITICAL_SECTION m_lock;
+#else
+   pthread_mutex_t m_lock;
+#endif
+};
+
+#endif
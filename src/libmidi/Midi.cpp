@@ -145,10 +145,11 @@ Midi Midi::ReadFromStream(istream &stream)
 
    // Translate each track's list of notes and list
    // of events into microseconds.
+   TranslatedNoteSet translated_notes;
    for (MidiTrackList::iterator i = m.m_tracks.begin(); i != m.m_tracks.end(); ++i)
    {
       i->Reset();
-      m.TranslateNotes(i->Notes(), pulses_per_quarter_note);
+      m.TranslateNotes(i->Notes(), pulses_per_quarter_note, translated_notes);
 
       MidiEventMicrosecondList event_usecs;
       for (MidiEventPulsesList::const_iterator j = i->EventPulses().begin(); j != i->EventPulses().end(); ++j)
@@ -158,10 +159,15 @@ Midi Midi::ReadFromStream(istream &stream)
       i->SetEventUsecs(event_usecs);
    }
 
+   // The set did our sorting (and weeded out duplicates).  From here on
+   // out the note list never changes, so flatten it into a simple array.
+   m.m_translated_notes.assign(translated_notes.begin(), translated_notes.end());
+   m.m_note_index.Build(m.m_translated_notes);
+
    m.m_initialized = true;
 
    // Just grab the end of the last note to find out how long the song is
-   m.m_microsecond_base_song_length = m.m_translated_notes.rbegin()->end;
+   m.m_microsecond_base_song_length = m.m_translated_notes.back().end;
 
    // Eat everything up until *just* before the first note event
    m.m_microsecond_dead_start_air = m.GetEventPulseInMicroseconds(m.FindFirstNotePulse(), pulses_per_quarter_note) - 1;
@@ -356,7 +362,7 @@ void Midi::Reset(microseconds_t lead_in_microseconds, microseconds_t lead_out_mi
    for (MidiTrackList::iterator i = m_tracks.begin(); i != m_tracks.end(); ++i) { i->Reset(); }
 }
 
-void Midi::TranslateNotes(const NoteSet &notes, unsigned short pulses_per_quarter_note)
+void Midi::TranslateNotes(const NoteSet &notes, unsigned short pulses_per_quarter_note, TranslatedNoteSet &out) const
 {
    for (NoteSet::const_iterator i = notes.begin(); i != notes.end(); ++i)
    {
@@ -369,7 +375,7 @@ void Midi::TranslateNotes(const NoteSet &notes, unsigned short pulses_per_quarte
       trans.start = GetEventPulseInMicroseconds(i->start, pulses_per_quarter_note);
       trans.end = GetEventPulseInMicroseconds(i->end, pulses_per_quarter_note);
 
-      m_translated_notes.insert(trans);
+      out.insert(trans);
    }
 }
 
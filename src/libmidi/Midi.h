@@ -9,6 +9,7 @@
 #include <vector>
 
 #include "Note.h"
+#include "NoteIndex.h"
 #include "MidiTrack.h"
 #include "MidiTypes.h"
 
@@ -31,7 +32,11 @@ public:
 
    const std::vector<MidiTrack> &Tracks() const { return m_tracks; }
 
-   const TranslatedNoteSet &Notes() const { return m_translated_notes; }
+   // Sorted by start time (see TranslatedNote's ordering)
+   const TranslatedNoteList &Notes() const { return m_translated_notes; }
+
+   // For finding the Notes() that overlap some stretch of time
+   const TranslatedNoteIndex &NoteIndex() const { return m_note_index; }
 
    MidiEventListWithTrackId Update(microseconds_t delta_microseconds);
 
@@ -73,11 +78,12 @@ private:
    unsigned long FindFirstNotePulse();
 
    void BuildTempoTrack();
-   void TranslateNotes(const NoteSet &notes, unsigned short pulses_per_quarter_note);
+   void TranslateNotes(const NoteSet &notes, unsigned short pulses_per_quarter_note, TranslatedNoteSet &out) const;
 
    bool m_initialized;
 
-   TranslatedNoteSet m_translated_notes;
+   TranslatedNoteList m_translated_notes;
+   TranslatedNoteIndex m_note_index;
 
    // Position can be negative (for lead-in).
    microseconds_t m_microsecond_song_position;
@@ -5,6 +5,7 @@
 #include "MidiEvent.h"
 #include "MidiComm.h"
 #include "MidiUtil.h"
+#include "MidiDeviceRegistry.h"
 
 #include <string>
 #include <sstream>
@@ -15,6 +16,255 @@ using namespace std;
 #include "../CompatibleSystem.h"
 #include "../string_util.h"
 
+#ifndef WIN32
+#include <libkern/OSAtomic.h>
+#include <CoreAudio/HostTime.h>
+#include <sched.h>
+#endif
+
+// Keeps the CPU (and compiler) from reordering memory accesses across
+// this point.  The input buffer depends on an event being completely
+// written before the write index that publishes it is, and completely
+// read before the read index that frees its slot is.
+static inline void InputBufferBarrier()
+{
+#ifdef WIN32
+   MemoryBarrier();
+#else
+   OSMemoryBarrier();
+#endif
+}
+
+MidiThru::MidiThru()
+   : m_out(0), m_routing(0)
+{
+   for (unsigned int i = 0; i < KeyCount; ++i)
+   {
+      m_keys[i] = 0;
+      m_sounding[i] = 0;
+   }
+}
+
+const static unsigned long ThruKeyEnabled = 0x80000000;
+
+static unsigned long PackThruKey(unsigned char note, unsigned char channel, unsigned char velocity)
+{
+   return ThruKeyEnabled | (static_cast<unsigned long>(note & 0x7F) << 16) | ((channel & 0x0F) << 8) | (velocity & 0x7F);
+}
+
+void MidiThru::Start(MidiCommOut *out)
+{
+   Stop();
+
+   InputBufferBarrier();
+   m_out = out;
+}
+
+void MidiThru::Stop()
+{
+   MidiCommOut *out = m_out;
+   if (!out) return;
+
+   m_out = 0;
+   InputBufferBarrier();
+
+   // Route only holds onto the output for the length of one Write
+   while (m_routing)
+   {
+#ifdef WIN32
+      Sleep(0);
+#else
+      sched_yield();
+#endif
+      InputBufferBarrier();
+   }
+
+   for (unsigned int i = 0; i < KeyCount; ++i)
+   {
+      const unsigned long sounding = m_sounding[i];
+      m_sounding[i] = 0;
+      if (!(sounding & ThruKeyEnabled)) continue;
+
+      const unsigned char note = static_cast<unsigned char>((sounding >> 16) & 0x7F);
+      const unsigned char channel = static_cast<unsigned char>((sounding >> 8) & 0x0F);
+      out->Write(MidiEvent::Build(MidiEventSimple(0x80 | channel, note, 0)));
+   }
+}
+
+void MidiThru::SetKey(unsigned char input_note, unsigned char output_note, unsigned char channel, unsigned char velocity)
+{
+   if (input_note >= KeyCount) return;
+
+   const unsigned long packed = PackThruKey(output_note, channel, velocity);
+   if (m_keys[input_note] != packed) m_keys[input_note] = packed;
+}
+
+void MidiThru::ClearKey(unsigned char input_note)
+{
+   if (input_note >= KeyCount) return;
+   if (m_keys[input_note] != 0) m_keys[input_note] = 0;
+}
+
+void MidiThru::Route(const MidiEventSimple &simple)
+{
+   const unsigned char type = simple.status & 0xF0;
+   if (type != 0x80 && type != 0x90) return;
+   if (simple.byte1 >= KeyCount) return;
+
+   m_routing = 1;
+   InputBufferBarrier();
+
+   MidiCommOut *out = m_out;
+   if (out)
+   {
+      const bool release = (type == 0x80 || simple.byte2 == 0);
+
+      unsigned long play = m_keys[simple.byte1];
+      if (release)
+      {
+         play = m_sounding[simple.byte1];
+         m_sounding[simple.byte1] = 0;
+      }
+
+      if (play & ThruKeyEnabled)
+      {
+         const unsigned char note = static_cast<unsigned char>((play >> 16) & 0x7F);
+         const unsigned char channel = static_cast<unsigned char>((play >> 8) & 0x0F);
+         const unsigned char velocity = (release ? simple.byte2 : static_cast<unsigned char>(play & 0x7F));
+
+         if (!release) m_sounding[simple.byte1] = play;
+
+         try
+         {
+            out->Write(MidiEvent::Build(MidiEventSimple(type | channel, note, velocity)));
+         }
+         catch (const MidiError &)
+         {
+            // A missed echo isn't worth bringing down the driver's
+            // thread over.  The game thread will still score the note.
+         }
+      }
+   }
+
+   InputBufferBarrier();
+   m_routing = 0;
+}
+
+MidiInputClass ClassifyMidiInput(unsigned char status)
+{
+   if (status < 0x80) return MidiInputUndefined;
+   if (status < 0xF0) return MidiInputChannelVoice;
+   if (status < 0xF8) return MidiInputSystemCommon;
+
+   switch (status)
+   {
+   case 0xF8:
+   case 0xF9: return MidiInputClock;
+
+   case 0xFA:
+   case 0xFB:
+   case 0xFC: return MidiInputTransport;
+
+   case 0xFE: return MidiInputActiveSensing;
+   case 0xFF: return MidiInputSystemReset;
+
+   default:   return MidiInputUndefined;
+   }
+}
+
+// A list of class names separated by '|' (e.g. "voice|clock")
+const static wstring InputAcceptKey = L"Input Accept";
+
+static unsigned long DefaultAcceptMask()
+{
+   const wstring setting = UserSetting::Get(InputAcceptKey, L"");
+   if (setting.empty()) return MIDI_INPUT_ACCEPT(MidiInputChannelVoice);
+
+   const static wchar_t *names[MidiInputClassCount] = { L"voice", L"common", L"clock", L"transport", L"sensing", L"reset", L"undefined" };
+
+   unsigned long mask = 0;
+   const wstring delimited = L"|" + setting + L"|";
+   for (int i = 0; i < MidiInputClassCount; ++i)
+   {
+      if (delimited.find(L"|" + wstring(names[i]) + L"|") != wstring::npos) mask |= MIDI_INPUT_ACCEPT(i);
+   }
+
+   return mask;
+}
+
+void MidiCommIn::SetAcceptMask(unsigned long mask)
+{
+   // A system reset would throw MidiError_MetaEventOnInput when read
+   m_accept_mask = (mask & ~MIDI_INPUT_ACCEPT(MidiInputSystemReset));
+}
+
+unsigned long MidiCommIn::GetDroppedCount(MidiInputClass input_class) const
+{
+   if (input_class >= MidiInputClassCount) return 0;
+   return m_dropped[input_class];
+}
+
+void MidiCommIn::BufferEvent(const MidiEventSimple &simple, unsigned long driver_delay)
+{
+   const MidiInputClass input_class = ClassifyMidiInput(simple.status);
+   if (!(m_accept_mask & MIDI_INPUT_ACCEPT(input_class)))
+   {
+      m_dropped[input_class]++;
+      return;
+   }
+
+   // The echo goes out before anything else so it's as quick as possible
+   m_thru.Route(simple);
+
+   const unsigned int write = m_buffer_write;
+   const unsigned int next = (write + 1) % BufferSize;
+
+   // Full
+   if (next == m_buffer_read)
+   {
+      m_overflowed++;
+      return;
+   }
+
+   m_buffer[write].simple = simple;
+   m_buffer[write].timestamp = Compatible::GetMicroseconds();
+   m_buffer[write].driver_delay = driver_delay;
+
+   InputBufferBarrier();
+   m_buffer_write = next;
+}
+
+void MidiCommIn::Reset()
+{
+   // Only the reader's index moves, so this is safe
+   // even while the callback is adding events.
+   m_buffer_read = m_buffer_write;
+}
+
+bool MidiCommIn::KeepReading() const
+{
+   return (m_buffer_read != m_buffer_write);
+}
+
+MidiEvent MidiCommIn::Read(unsigned long long *timestamp, unsigned long *driver_delay)
+{
+   const unsigned int read = m_buffer_read;
+   if (read == m_buffer_write) throw MidiError(MidiError_NoInputAvailable);
+
+   InputBufferBarrier();
+   const BufferedEvent buffered = m_buffer[read];
+
+   InputBufferBarrier();
+   m_buffer_read = (read + 1) % BufferSize;
+
+   if (timestamp) *timestamp = buffered.timestamp;
+   if (driver_delay) *driver_delay = buffered.driver_delay;
+
+   // Building the full event happens here (rather than in the
+   // callback) to keep the driver's thread as short as possible.
+   return MidiEvent::Build(buffered.simple);
+}
+
 #ifdef WIN32
 
 void midi_check(MMRESULT ret)
@@ -77,16 +327,19 @@ MidiCommDescriptionList MidiCommIn::GetDeviceList()
 }
 
 MidiCommIn::MidiCommIn(unsigned int device_id)
+   : m_overflowed(0), m_buffer_write(0), m_buffer_read(0), m_start_microseconds(0)
 {
-   m_description = GetDeviceList()[device_id];
+   if (!MidiDeviceRegistry::FindInput(device_id, &m_description)) throw MidiError(MidiError_MM_BadDeviceID);
 
-   InitializeCriticalSection(&m_buffer_mutex);
+   SetAcceptMask(DefaultAcceptMask());
+   for (int i = 0; i < MidiInputClassCount; ++i) m_dropped[i] = 0;
 
    midi_check(midiInOpen(&m_input_device, device_id,
       reinterpret_cast<DWORD_PTR>(MidiInputCallback),
       reinterpret_cast<DWORD_PTR>(this),
       CALLBACK_FUNCTION));
    
+   m_start_microseconds = Compatible::GetMicroseconds();
    midi_check(midiInStart(m_input_device));
 }
 
@@ -95,14 +348,12 @@ MidiCommIn::~MidiCommIn()
    midi_check(midiInStop(m_input_device));
    midi_check(midiInReset(m_input_device));
    midi_check(midiInClose(m_input_device));
-
-   DeleteCriticalSection(&m_buffer_mutex);
 }
 
 // This is only called by the callback function.  The reason this
 // is public (and the callback isn't a static member) is to keep the
 // HMIDIIN definition out of this classes header.
-void MidiCommIn::InputCallback(unsigned int msg, unsigned long p1, unsigned long)
+void MidiCommIn::InputCallback(unsigned int msg, unsigned long p1, unsigned long p2, unsigned long)
 {
    try
    {
@@ -113,11 +364,15 @@ void MidiCommIn::InputCallback(unsigned int msg, unsigned long p1, unsigned long
             unsigned char status = LOBYTE(LOWORD(p1));
             unsigned char byte1  = HIBYTE(LOWORD(p1));
             unsigned char byte2  = LOBYTE(HIWORD(p1));
-            MidiEvent ev = MidiEvent::Build(MidiEventSimple(status, byte1, byte2));
 
-            EnterCriticalSection(&m_buffer_mutex);
-            m_event_buffer.push(ev);
-            LeaveCriticalSection(&m_buffer_mutex);
+            // p2 is when the driver received the event, in milliseconds
+            // since midiInStart.  That's coarse, so a delay under a
+            // millisecond can come out to zero.
+            const unsigned long long received = m_start_microseconds + static_cast<unsigned long long>(p2) * 1000;
+            const unsigned long long now = Compatible::GetMicroseconds();
+            const unsigned long driver_delay = (now > received ? static_cast<unsigned long>(now - received) : 0);
+
+            BufferEvent(MidiEventSimple(status, byte1, byte2), driver_delay);
          }
          break;
 
@@ -149,11 +404,7 @@ void MidiCommIn::InputCallback(unsigned int msg, unsigned long p1, unsigned long
                unsigned char status = LOBYTE(LOWORD(p1));
                unsigned char byte1  = HIBYTE(LOWORD(p1));
                unsigned char byte2  = LOBYTE(HIWORD(p1));
-               MidiEvent ev = MidiEvent::Build(MidiEventSimple(status, byte1, byte2));
-
-               EnterCriticalSection(&m_buffer_mutex);
-               m_event_buffer.push(ev);
-               LeaveCriticalSection(&m_buffer_mutex);
+               BufferEvent(MidiEventSimple(status, byte1, byte2), 0);
                break;
             }
             throw MidiError(MidiError_InvalidInputErrorBehavior);
@@ -177,42 +428,6 @@ void MidiCommIn::InputCallback(unsigned int msg, unsigned long p1, unsigned long
 
 }
 
-void MidiCommIn::Reset()
-{
-   EnterCriticalSection(&m_buffer_mutex);
-   while (!m_event_buffer.empty()) m_event_buffer.pop();
-   LeaveCriticalSection(&m_buffer_mutex);
-}
-
-bool MidiCommIn::KeepReading() const
-{
-   bool buffer_empty;
-
-   EnterCriticalSection(&m_buffer_mutex);
-   buffer_empty = m_event_buffer.empty();
-   LeaveCriticalSection(&m_buffer_mutex);
-
-   return (!buffer_empty);
-}
-
-MidiEvent MidiCommIn::Read()
-{
-   MidiEvent ev(MidiEvent::NullEvent());
-   bool buffer_empty;
-
-   EnterCriticalSection(&m_buffer_mutex);
-   buffer_empty = m_event_buffer.empty();
-   if (!buffer_empty)
-   {
-      ev = m_event_buffer.front();
-      m_event_buffer.pop();
-   }
-   LeaveCriticalSection(&m_buffer_mutex);
-
-   if (buffer_empty) throw MidiError(MidiError_NoInputAvailable);
-   return ev;
-}
-
 MidiCommDescriptionList MidiCommOut::GetDeviceList()
 {
    MidiCommDescriptionList devices;
@@ -235,7 +450,7 @@ MidiCommDescriptionList MidiCommOut::GetDeviceList()
 
 MidiCommOut::MidiCommOut(unsigned int device_id)
 {
-   m_description = GetDeviceList()[device_id];
+   if (!MidiDeviceRegistry::FindOutput(device_id, &m_description)) throw MidiError(MidiError_MM_BadDeviceID);
 
    midi_check(midiOutOpen(&m_output_device, device_id, 0, 0, CALLBACK_NULL));
 }
@@ -350,14 +565,8 @@ static CFStringRef BuildEndpointName(MIDIEndpointRef endpoint)
 }
 
 
-static bool built_input_list = false;
-static MidiCommDescriptionList in_list(MidiCommIn::GetDeviceList());
-
-
 MidiCommDescriptionList MidiCommIn::GetDeviceList()
 {
-   if (built_input_list) return in_list;
-
    MidiCommDescriptionList devices;
 
    ItemCount sources = MIDIGetNumberOfSources();
@@ -375,7 +584,6 @@ MidiCommDescriptionList MidiCommIn::GetDeviceList()
       devices.push_back(d);
    }   
 
-   built_input_list = true;
    return devices;
 }
 
@@ -383,20 +591,31 @@ void midi_input(const MIDIPacketList *packet_list, void *read_ref_con, void *sou
 {
    MidiCommIn *comm_in = (MidiCommIn*)source_ref_con;
 
+   const UInt64 now = AudioGetCurrentHostTime();
+
    // TODO: There is no guarantee that events are coming in one at a time!   
    const MIDIPacket *packet = &packet_list->packet[0];
    for (int i = 0; i < packet_list->numPackets; ++i)
    {
-      comm_in->InputCallback(packet->data[0], packet->data[1], packet->data[2]);
+      // A zero time stamp means "now"
+      unsigned long driver_delay = 0;
+      if (packet->timeStamp != 0 && packet->timeStamp < now)
+      {
+         driver_delay = static_cast<unsigned long>(AudioConvertHostTimeToNanos(now - packet->timeStamp) / 1000);
+      }
+
+      comm_in->InputCallback(packet->data[0], packet->data[1], packet->data[2], driver_delay);
       packet = MIDIPacketNext(packet);
    }
 }
 
 MidiCommIn::MidiCommIn(unsigned int device_id)
+   : m_overflowed(0), m_buffer_write(0), m_buffer_read(0)
 {
-   pthread_mutex_init(&m_mutex, 0);
+   if (!MidiDeviceRegistry::FindInput(device_id, &m_description)) throw MidiError(MidiError_MM_BadDeviceID);
 
-   m_description = MidiCommIn::GetDeviceList()[device_id];
+   SetAcceptMask(DefaultAcceptMask());
+   for (int i = 0; i < MidiInputClassCount; ++i) m_dropped[i] = 0;
 
    MIDIClientCreate(CFSTR("Piano Game"), 0, this, &m_client);
    MIDIInputPortCreate(m_client, CFSTR("Piano Game In"), midi_input, this, &m_port);
@@ -412,68 +631,21 @@ MidiCommIn::~MidiCommIn()
 
    // This disposes the port too.
    MIDIClientDispose(m_client);
-
-   pthread_mutex_destroy(&m_mutex);
 }
 
-void MidiCommIn::InputCallback(unsigned int status, unsigned long byte1, unsigned long byte2)
+void MidiCommIn::InputCallback(unsigned int status, unsigned long byte1, unsigned long byte2, unsigned long driver_delay)
 {
    unsigned char small_status = (unsigned char)status;
    unsigned char small_byte1  = (unsigned char)byte1;
    unsigned char small_byte2  = (unsigned char)byte2;
-   MidiEvent ev = MidiEvent::Build(MidiEventSimple(small_status, small_byte1, small_byte2));
-
-   pthread_mutex_lock(&m_mutex);
-   m_event_buffer.push(ev);
-   pthread_mutex_unlock(&m_mutex);
-}
-
-void MidiCommIn::Reset()
-{
-   pthread_mutex_lock(&m_mutex);
-   while (!m_event_buffer.empty()) m_event_buffer.pop();
-   pthread_mutex_unlock(&m_mutex);
-}
-
-bool MidiCommIn::KeepReading() const
-{
-   bool buffer_empty;
-
-   pthread_mutex_lock(&m_mutex);
-   buffer_empty = m_event_buffer.empty();
-   pthread_mutex_unlock(&m_mutex);
-
-   return (!buffer_empty);
-}
-
-MidiEvent MidiCommIn::Read()
-{
-   MidiEvent ev(MidiEvent::NullEvent());
-   bool buffer_empty;
-
-   pthread_mutex_lock(&m_mutex);
-   buffer_empty = m_event_buffer.empty();
-   if (!buffer_empty)
-   {
-      ev = m_event_buffer.front();
-      m_event_buffer.pop();
-   }
-   pthread_mutex_unlock(&m_mutex);
-
-   if (buffer_empty) throw MidiError(MidiError_NoInputAvailable);
-   return ev;
+   BufferEvent(MidiEventSimple(small_status, small_byte1, small_byte2), driver_delay);
 }
 
 
 
 
-static bool built_output_list = false;
-static MidiCommDescriptionList out_list(MidiCommOut::GetDeviceList());
-
 MidiCommDescriptionList MidiCommOut::GetDeviceList()
 {
-   if (built_output_list) return out_list;
-
    MidiCommDescriptionList devices;
 
    // Add the built-in synth
@@ -498,13 +670,12 @@ MidiCommDescriptionList MidiCommOut::GetDeviceList()
       devices.push_back(d);
    }
 
-   built_output_list = true;
    return devices;
 }
 
 void MidiCommOut::Acquire(unsigned int device_id)
 {
-   m_description = GetDeviceList()[device_id];
+   if (!MidiDeviceRegistry::FindOutput(device_id, &m_description)) throw MidiError(MidiError_MM_BadDeviceID);
 
    if (m_description.id == 0)
    {
@@ -7,7 +7,6 @@
 
 #include <string>
 #include <vector>
-#include <queue>
 
 #include "../os.h"
 
@@ -25,17 +24,89 @@ struct MidiCommDescription
 };
 
 typedef std::vector<MidiCommDescription> MidiCommDescriptionList;
-typedef std::queue<MidiEvent> MidiEventQueue;
+
+// Incoming messages are sorted into these classes (by status byte) as
+// soon as they arrive.  Only accepted classes are buffered for Read().
+enum MidiInputClass
+{
+   MidiInputChannelVoice,     // 0x80-0xEF: notes, controllers, pitch bend, etc.
+   MidiInputSystemCommon,     // 0xF0-0xF7: SysEx, time code, song position/select, tune request
+   MidiInputClock,            // 0xF8-0xF9: timing clock and tick
+   MidiInputTransport,        // 0xFA-0xFC: start, continue, stop
+   MidiInputActiveSensing,    // 0xFE
+   MidiInputSystemReset,      // 0xFF (never accepted; it reads as a meta event)
+   MidiInputUndefined,        // 0xFD, or a data byte where a status should be
+
+   MidiInputClassCount
+};
+
+// For use with MidiCommIn::SetAcceptMask
+#define MIDI_INPUT_ACCEPT(input_class) (1UL << (input_class))
+
+MidiInputClass ClassifyMidiInput(unsigned char status);
+
+class MidiCommOut;
+
+// Echoes note presses straight from an input device's callback thread to
+// an output device, so the sound doesn't have to wait for the next frame.
+//
+// Each input key has an entry saying which note, channel, and velocity to
+// play in its place (or that it shouldn't play at all).  The game thread
+// keeps those entries up to date while the callback thread reads them.
+// Each entry is a single aligned word, so no locking is required.
+class MidiThru
+{
+public:
+   MidiThru();
+
+   // Game thread.  Stop() doesn't return until the callback thread is
+   // done with the output device, so it is safe to Reset (or delete)
+   // the output afterward.  Any notes still sounding are turned off.
+   // The output must not be Reset or deleted while the thru is running.
+   void Start(MidiCommOut *out);
+   void Stop();
+   bool IsRunning() const { return (m_out != 0); }
+
+   // Game thread.  Changes only affect presses that come after them.
+   void SetKey(unsigned char input_note, unsigned char output_note, unsigned char channel, unsigned char velocity);
+   void ClearKey(unsigned char input_note);
+
+   // Callback thread only.  Plays note-on and note-off events according
+   // to the key table and ignores everything else.
+   void Route(const MidiEventSimple &simple);
+
+private:
+   const static unsigned int KeyCount = 128;
+
+   // Bit 31 is set for keys that should play.  Below that, the output
+   // note is in bits 16-23, the channel in 8-11, and velocity in 0-7.
+   volatile unsigned long m_keys[KeyCount];
+
+   // Only touched by the callback thread (or by Stop, once the callback
+   // thread is known to be finished).  Same packing as m_keys, recording
+   // what each held key actually played so the release matches it.
+   unsigned long m_sounding[KeyCount];
+
+   MidiCommOut * volatile m_out;
+   volatile long m_routing;
+};
 
 // Once you create a MidiCommIn object, MIDI events are read continuously
 // in a separate thread and stored in a buffer.  Use the Read() function
 // to grab one event at a time from the buffer.
+//
+// The buffer is a lock-free ring with exactly one writer (the driver's
+// callback thread) and one reader (whoever calls Read).  Reading from
+// more than one thread at a time is not supported.
 class MidiCommIn
 {
 public:
+   // Asks the OS directly, which can be slow.  Use MidiDeviceRegistry
+   // (which calls this from a background thread) instead.
    static MidiCommDescriptionList GetDeviceList();
 
-   // device_id is obtained from GetDeviceList()
+   // device_id is obtained from MidiDeviceRegistry.  Throws
+   // MidiError_MM_BadDeviceID if the device is no longer there.
    MidiCommIn(unsigned int device_id);
    ~MidiCommIn();
 
@@ -44,7 +115,12 @@ public:
    // Returns the next buffered input event.  Use KeepReading() (usually in
    // a while loop) to see if you should call this function.  If called when
    // KeepReading() is false, this will throw MidiError_NoInputAvailable.
-   MidiEvent Read();
+   //
+   // If timestamp is given, it is filled with the time the event arrived
+   // (from Compatible::GetMicroseconds), which is comparable across devices.
+   // If driver_delay is given, it is filled with how many microseconds the
+   // OS driver held the event before it arrived (0 if unknown).
+   MidiEvent Read(unsigned long long *timestamp = 0, unsigned long *driver_delay = 0);
 
    // Discard events from the input buffer
    void Reset();
@@ -52,27 +128,73 @@ public:
    // Returns whether the input device has more buffered events.
    bool KeepReading() const;
 
+   // A combination of MIDI_INPUT_ACCEPT flags.  Messages of any other
+   // class are dropped in the driver's callback, before they reach the
+   // buffer (or the MIDI thru).  The default comes from the "Input
+   // Accept" setting, or is just the channel voice messages.
+   void SetAcceptMask(unsigned long mask);
+   unsigned long GetAcceptMask() const { return m_accept_mask; }
+
+   // How many messages of the given class have been dropped by the
+   // accept mask since the device was opened
+   unsigned long GetDroppedCount(MidiInputClass input_class) const;
+
+   // How many accepted messages have been lost because the buffer was
+   // full (the reader fell behind) since the device was opened
+   unsigned long GetOverflowCount() const { return m_overflowed; }
+
+   // Every event is offered to this (from the callback thread) before
+   // being buffered.  It does nothing until it is started.
+   MidiThru &Thru() { return m_thru; }
+
    // Internal callback, do not use!
    //
    // NOTE: The Mac implementation of this class uses this callback
    // in a different way than Windows.  Windows calls this function
    // with a variety of Windows data (error messages, structs, and
    // whatnot).  The Mac side uses the three parameters as the usual
-   // MIDI event triple.  (SysEx is filtered out in both cases.)
-   void InputCallback(unsigned int msg, unsigned long p1, unsigned long p2);
+   // MIDI event triple, plus the delay worked out from the packet's
+   // time stamp.  (SysEx is filtered out in both cases.)
+   void InputCallback(unsigned int msg, unsigned long p1, unsigned long p2, unsigned long driver_delay = 0);
 
 private:
+   // Called only from InputCallback.  If the buffer is full, the
+   // event is dropped (and counted) rather than making the driver wait.
+   void BufferEvent(const MidiEventSimple &simple, unsigned long driver_delay);
+
    MidiCommDescription m_description;
+   MidiThru m_thru;
+
+   volatile unsigned long m_accept_mask;
+
+   // Only changed by the callback thread
+   volatile unsigned long m_dropped[MidiInputClassCount];
+   volatile unsigned long m_overflowed;
 
-   MidiEventQueue m_event_buffer;
+   struct BufferedEvent
+   {
+      MidiEventSimple simple;
+      unsigned long long timestamp;
+      unsigned long driver_delay;
+   };
+
+   const static unsigned int BufferSize = 1024;
+   BufferedEvent m_buffer[BufferSize];
+
+   // m_buffer_write is only ever changed by the callback thread and
+   // m_buffer_read only by the reader.  The buffer is empty when
+   // they're equal (so it holds at most BufferSize-1 events).
+   volatile unsigned int m_buffer_write;
+   volatile unsigned int m_buffer_read;
 
 #ifdef WIN32
    HMIDIIN m_input_device;
-   mutable CRITICAL_SECTION m_buffer_mutex;
+
+   // Windows stamps input with milliseconds since midiInStart
+   unsigned long long m_start_microseconds;
 #else
    MIDIClientRef m_client;
    MIDIPortRef m_port;
-   mutable pthread_mutex_t m_mutex;
 #endif
 
 };
@@ -80,9 +202,12 @@ private:
 class MidiCommOut
 {
 public:
+   // Asks the OS directly, which can be slow.  Use MidiDeviceRegistry
+   // (which calls this from a background thread) instead.
    static MidiCommDescriptionList GetDeviceList();
 
-   // device_id is obtained from GetDeviceList()
+   // device_id is obtained from MidiDeviceRegistry.  Throws
+   // MidiError_MM_BadDeviceID if the device is no longer there.
    MidiCommOut(unsigned int device_id);
    ~MidiCommOut();
 
@@ -0,0 +1,329 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "MidiDeviceRegistry.h"
+#include "MidiUtil.h"
+
+#include "../os.h"
+
+#ifndef WIN32
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+using namespace std;
+
+namespace MidiDeviceRegistry
+{
+   // How long to wait between scans if nobody asks for one sooner
+   const static unsigned long PollMilliseconds = 5000;
+
+   static bool g_started(false);
+
+   // Everything below is protected by g_lock
+   static bool g_scanned(false);
+   static bool g_stopping(false);
+   static unsigned long g_generation(0);
+   static MidiCommDescriptionList g_inputs;
+   static MidiCommDescriptionList g_outputs;
+
+#ifdef WIN32
+   static CRITICAL_SECTION g_lock;
+
+   // Auto-reset: a refresh was requested or we're stopping
+   static HANDLE g_wake(0);
+
+   // Manual-reset: the first scan is finished
+   static HANDLE g_scanned_event(0);
+
+   static HANDLE g_thread(0);
+
+   static void Lock() { EnterCriticalSection(&g_lock); }
+   static void Unlock() { LeaveCriticalSection(&g_lock); }
+#else
+   static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+   static pthread_cond_t g_wake = PTHREAD_COND_INITIALIZER;
+   static pthread_cond_t g_scanned_cond = PTHREAD_COND_INITIALIZER;
+
+   static pthread_t g_thread;
+   static MIDIClientRef g_client(0);
+
+   // Protected by g_lock.  Keeps a request that comes in during a
+   // scan from being lost.
+   static bool g_refresh_requested(false);
+
+   static void Lock() { pthread_mutex_lock(&g_lock); }
+   static void Unlock() { pthread_mutex_unlock(&g_lock); }
+#endif
+
+   static bool SameList(const MidiCommDescriptionList &a, const MidiCommDescriptionList &b)
+   {
+      if (a.size() != b.size()) return false;
+      for (size_t i = 0; i < a.size(); ++i)
+      {
+         if (a[i].id != b[i].id || a[i].name != b[i].name) return false;
+      }
+
+      return true;
+   }
+
+   // Runs on the registry thread
+   static void Scan()
+   {
+      MidiCommDescriptionList inputs;
+      MidiCommDescriptionList outputs;
+      bool good = true;
+
+      try
+      {
+         inputs = MidiCommIn::GetDeviceList();
+         outputs = MidiCommOut::GetDeviceList();
+      }
+      catch (const MidiError &)
+      {
+         good = false;
+      }
+      catch (MidiErrorCode)
+      {
+         good = false;
+      }
+
+      Lock();
+
+      // A failed scan keeps the last good lists.  The next poll will try again.
+      if (good && (!SameList(inputs, g_inputs) || !SameList(outputs, g_outputs)))
+      {
+         g_inputs.swap(inputs);
+         g_outputs.swap(outputs);
+         g_generation++;
+      }
+
+      const bool first_scan = !g_scanned;
+      g_scanned = true;
+
+#ifndef WIN32
+      if (first_scan) pthread_cond_broadcast(&g_scanned_cond);
+#endif
+
+      Unlock();
+
+#ifdef WIN32
+      if (first_scan) SetEvent(g_scanned_event);
+#endif
+   }
+
+#ifdef WIN32
+
+   static DWORD WINAPI RegistryThread(LPVOID)
+   {
+      while (true)
+      {
+         Scan();
+
+         WaitForSingleObject(g_wake, PollMilliseconds);
+
+         Lock();
+         const bool stopping = g_stopping;
+         Unlock();
+
+         if (stopping) break;
+      }
+
+      return 0;
+   }
+
+   void Start()
+   {
+      if (g_started) return;
+
+      InitializeCriticalSection(&g_lock);
+      g_wake = CreateEvent(0, FALSE, FALSE, 0);
+      g_scanned_event = CreateEvent(0, TRUE, FALSE, 0);
+
+      g_stopping = false;
+      g_thread = CreateThread(0, 0, RegistryThread, 0, 0, 0);
+
+      g_started = true;
+   }
+
+   void Stop()
+   {
+      if (!g_started) return;
+
+      Lock();
+      g_stopping = true;
+      Unlock();
+
+      SetEvent(g_wake);
+      WaitForSingleObject(g_thread, INFINITE);
+
+      CloseHandle(g_thread);
+      CloseHandle(g_scanned_event);
+      CloseHandle(g_wake);
+      DeleteCriticalSection(&g_lock);
+
+      g_started = false;
+   }
+
+   void RequestRefresh()
+   {
+      if (!g_started) return;
+
+      // An auto-reset event remembers a request made during a scan
+      SetEvent(g_wake);
+   }
+
+   static void WaitForFirstScan()
+   {
+      WaitForSingleObject(g_scanned_event, INFINITE);
+   }
+
+#else
+
+   static void *RegistryThread(void *)
+   {
+      Lock();
+      while (!g_stopping)
+      {
+         g_refresh_requested = false;
+
+         Unlock();
+         Scan();
+         Lock();
+
+         if (g_stopping || g_refresh_requested) continue;
+
+         timeval now;
+         gettimeofday(&now, 0);
+
+         timespec deadline;
+         deadline.tv_sec = now.tv_sec + PollMilliseconds / 1000;
+         deadline.tv_nsec = now.tv_usec * 1000 + (PollMilliseconds % 1000) * 1000000;
+         if (deadline.tv_nsec >= 1000000000)
+         {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+         }
+
+         pthread_cond_timedwait(&g_wake, &g_lock, &deadline);
+      }
+      Unlock();
+
+      return 0;
+   }
+
+   // CoreMIDI delivers this on the main thread's run loop
+   static void RegistryNotify(const MIDINotification *message, void *)
+   {
+      if (message->messageID == kMIDIMsgSetupChanged) RequestRefresh();
+   }
+
+   void Start()
+   {
+      if (g_started) return;
+
+      g_stopping = false;
+      MIDIClientCreate(CFSTR("Piano Game Devices"), RegistryNotify, 0, &g_client);
+      pthread_create(&g_thread, 0, RegistryThread, 0);
+
+      g_started = true;
+   }
+
+   void Stop()
+   {
+      if (!g_started) return;
+
+      Lock();
+      g_stopping = true;
+      pthread_cond_signal(&g_wake);
+      Unlock();
+
+      pthread_join(g_thread, 0);
+
+      if (g_client) MIDIClientDispose(g_client);
+      g_client = 0;
+
+      g_started = false;
+   }
+
+   void RequestRefresh()
+   {
+      if (!g_started) return;
+
+      Lock();
+      g_refresh_requested = true;
+      pthread_cond_signal(&g_wake);
+      Unlock();
+   }
+
+   static void WaitForFirstScan()
+   {
+      Lock();
+      while (!g_scanned) pthread_cond_wait(&g_scanned_cond, &g_lock);
+      Unlock();
+   }
+
+#endif
+
+   unsigned long Generation()
+   {
+      if (!g_started) return 0;
+
+      Lock();
+      const unsigned long generation = g_generation;
+      Unlock();
+
+      return generation;
+   }
+
+   MidiCommDescriptionList Inputs()
+   {
+      if (!g_started) return MidiCommIn::GetDeviceList();
+
+      WaitForFirstScan();
+
+      Lock();
+      MidiCommDescriptionList inputs(g_inputs);
+      Unlock();
+
+      return inputs;
+   }
+
+   MidiCommDescriptionList Outputs()
+   {
+      if (!g_started) return MidiCommOut::GetDeviceList();
+
+      WaitForFirstScan();
+
+      Lock();
+      MidiCommDescriptionList outputs(g_outputs);
+      Unlock();
+
+      return outputs;
+   }
+
+   static bool Find(const MidiCommDescriptionList &devices, unsigned int device_id, MidiCommDescription *description)
+   {
+      for (MidiCommDescriptionList::const_iterator i = devices.begin(); i != devices.end(); ++i)
+      {
+         if (i->id != device_id) continue;
+
+         *description = *i;
+         return true;
+      }
+
+      return false;
+   }
+
+   bool FindInput(unsigned int device_id, MidiCommDescription *description)
+   {
+      return Find(Inputs(), device_id, description);
+   }
+
+   bool FindOutput(unsigned int device_id, MidiCommDescription *description)
+   {
+      return Find(Outputs(), device_id, description);
+   }
+
+};
@@ -0,0 +1,52 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __MIDI_DEVICE_REGISTRY_H
+#define __MIDI_DEVICE_REGISTRY_H
+
+#include "MidiComm.h"
+
+// Enumerating MIDI devices can be slow (Windows drivers sometimes need
+// to be retried), so it is done on a background thread instead of every
+// time someone wants a list.  The thread scans once at startup and again
+// whenever a hotplug notification comes in (or every few seconds, in
+// case one doesn't).  Everyone else gets a copy of the latest scan.
+namespace MidiDeviceRegistry
+{
+   // Call once at startup, and Stop once before exiting.  Until Start
+   // is called, the lists below are enumerated on the spot instead.
+   void Start();
+   void Stop();
+
+   // Asks for a fresh scan as soon as possible (e.g. after the OS says
+   // a device was added or removed).  Doesn't wait for it to finish.
+   void RequestRefresh();
+
+   // Increases every time a scan finds the device lists changed
+   unsigned long Generation();
+
+   // These only ever wait on the first scan after Start
+   MidiCommDescriptionList Inputs();
+   MidiCommDescriptionList Outputs();
+
+   // Returns false if no device with that id was present in the last scan
+   bool FindInput(unsigned int device_id, MidiCommDescription *description);
+   bool FindOutput(unsigned int device_id, MidiCommDescription *description);
+};
+
+// Starts the registry on construction and stops it on destruction, so
+// every way out of a scope (early returns and exceptions included)
+// stops the thread before the device lists go away.
+class MidiDeviceRegistryScope
+{
+public:
+   MidiDeviceRegistryScope() { MidiDeviceRegistry::Start(); }
+   ~MidiDeviceRegistryScope() { MidiDeviceRegistry::Stop(); }
+
+private:
+   MidiDeviceRegistryScope(const MidiDeviceRegistryScope &);
+   MidiDeviceRegistryScope &operator=(const MidiDeviceRegistryScope &);
+};
+
+#endif
@@ -6,6 +6,7 @@
 #define __MIDI_NOTE_H
 
 #include <set>
+#include <vector>
 #include "MidiTypes.h"
 
 // Range of all 128 MIDI notes possible
@@ -19,7 +20,11 @@ enum NoteState
    AutoPlayed,
    UserPlayable,
    UserHit,
-   UserMissed
+   UserMissed,
+
+   // Finished playing and no longer available to hit.  Notes
+   // in this state are skipped entirely (in place of erasing them).
+   Retired
 };
 
 template <class T>
@@ -51,8 +56,6 @@ struct GenericNote
    // play the user's input correctly
    unsigned char channel;
    int velocity;
-
-   NoteState state;
 };
 
 // Note keeps the internal pulses found in the MIDI file which are
@@ -65,4 +68,14 @@ typedef GenericNote<microseconds_t> TranslatedNote;
 typedef std::set<Note, Note> NoteSet;
 typedef std::set<TranslatedNote, TranslatedNote> TranslatedNoteSet;
 
+// The song's final, immutable timeline.  This is the same ordering as a
+// TranslatedNoteSet, but flattened into an array so it can be shared (and
+// indexed) by everyone without copying.
+typedef std::vector<TranslatedNote> TranslatedNoteList;
+
+// Per-session NoteState for each note in a TranslatedNoteList, stored in
+// a parallel array (and by the same index) so the timeline itself never
+// has to change during play.
+typedef std::vector<unsigned char> NoteStateList;
+
 #endif
@@ -0,0 +1,97 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#include "NoteIndex.h"
+
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+void TranslatedNoteIndex::Build(const TranslatedNoteList &notes)
+{
+   m_starts.resize(notes.size());
+   m_ends.resize(notes.size());
+   for (size_t i = 0; i < notes.size(); ++i)
+   {
+      m_starts[i] = notes[i].start;
+      m_ends[i] = notes[i].end;
+   }
+
+   m_leaf_count = 1;
+   while (m_leaf_count < notes.size()) m_leaf_count *= 2;
+
+   // Padding leaves (past the last note) can never overlap anything
+   m_max_end.assign(m_leaf_count * 2, numeric_limits<microseconds_t>::min());
+
+   for (size_t i = 0; i < m_ends.size(); ++i) m_max_end[m_leaf_count + i] = m_ends[i];
+   for (size_t n = m_leaf_count - 1; n > 0; --n) m_max_end[n] = max(m_max_end[n*2], m_max_end[n*2 + 1]);
+}
+
+size_t TranslatedNoteIndex::FirstStartingAt(microseconds_t time) const
+{
+   return lower_bound(m_starts.begin(), m_starts.end(), time) - m_starts.begin();
+}
+
+void TranslatedNoteIndex::FindOverlapping(microseconds_t begin_time, microseconds_t end_time, vector<size_t> &out) const
+{
+   if (m_starts.empty()) return;
+
+   // Nothing at or past this point starts before the window closes
+   const size_t limit = FirstStartingAt(end_time);
+
+   Collect(1, 0, m_leaf_count, limit, begin_time, out);
+}
+
+void TranslatedNoteIndex::Collect(size_t node, size_t node_first, size_t node_last, size_t limit,
+                                  microseconds_t begin_time, vector<size_t> &out) const
+{
+   if (node_first >= limit) return;
+
+   // Everything under this node finished before the window opens
+   if (m_max_end[node] <= begin_time) return;
+
+   if (node >= m_leaf_count)
+   {
+      out.push_back(node_first);
+      return;
+   }
+
+   // Left first, so the results come out in list order
+   const size_t middle = (node_first + node_last) / 2;
+   Collect(node*2,     node_first, middle, limit, begin_time, out);
+   Collect(node*2 + 1, middle, node_last,  limit, begin_time, out);
+}
+
+void TranslatedNoteWindow::Advance(const TranslatedNoteIndex &index, microseconds_t begin_time, microseconds_t end_time)
+{
+   const bool forward = (m_index == &index && begin_time >= m_begin && end_time >= m_end);
+
+   m_index = &index;
+   m_begin = begin_time;
+   m_end = end_time;
+
+   if (!forward)
+   {
+      m_notes.clear();
+      index.FindOverlapping(begin_time, end_time, m_notes);
+      m_next = index.FirstStartingAt(end_time);
+      return;
+   }
+
+   // Drop the notes that have finished (keeping the rest in order)
+   size_t kept = 0;
+   for (size_t i = 0; i < m_notes.size(); ++i)
+   {
+      if (index.End(m_notes[i]) > begin_time) m_notes[kept++] = m_notes[i];
+   }
+   m_notes.resize(kept);
+
+   // Everything before m_next is already in the list (or was dropped),
+   // so the new arrivals all go on the end
+   for (; m_next < index.Count() && index.Start(m_next) < end_time; ++m_next)
+   {
+      if (index.End(m_next) > begin_time) m_notes.push_back(m_next);
+   }
+}
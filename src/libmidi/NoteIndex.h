@@ -0,0 +1,83 @@
+
+// Copyright (c)2007 Nicholas Piegdon
+// See license.txt for license information
+
+#ifndef __MIDI_NOTE_INDEX_H
+#define __MIDI_NOTE_INDEX_H
+
+#include <vector>
+
+#include "Note.h"
+#include "MidiTypes.h"
+
+// Answers "which notes are sounding at some point in [begin, end)?" for a
+// TranslatedNoteList without walking the list from the start.  Sorting by
+// start time alone isn't enough: one long sustained note can overlap a
+// window that thousands of later (already finished) notes don't.
+//
+// This keeps the start times for binary searching and a max-end tree on
+// top of the end times, so a query only descends into the parts of the
+// list that hold an overlapping note: O(log n + k) for k results.
+//
+// Note indices returned here are indices into the TranslatedNoteList the
+// index was built from, always in ascending (list) order.
+class TranslatedNoteIndex
+{
+public:
+   TranslatedNoteIndex() : m_leaf_count(0) { }
+
+   // The list must already be sorted by start time (as Midi::Notes() is)
+   void Build(const TranslatedNoteList &notes);
+
+   size_t Count() const { return m_starts.size(); }
+   microseconds_t Start(size_t note) const { return m_starts[note]; }
+   microseconds_t End(size_t note) const { return m_ends[note]; }
+
+   // The first note starting at or after the given time
+   // (or Count() if there aren't any)
+   size_t FirstStartingAt(microseconds_t time) const;
+
+   // Appends every note where start < end_time and end > begin_time
+   void FindOverlapping(microseconds_t begin_time, microseconds_t end_time, std::vector<size_t> &out) const;
+
+private:
+   void Collect(size_t node, size_t node_first, size_t node_last, size_t limit,
+      microseconds_t begin_time, std::vector<size_t> &out) const;
+
+   std::vector<microseconds_t> m_starts;
+   std::vector<microseconds_t> m_ends;
+
+   // Implicit binary tree (node n has children 2n and 2n+1) where each
+   // node holds the latest end time of any note beneath it
+   std::vector<microseconds_t> m_max_end;
+   size_t m_leaf_count;
+};
+
+// Follows an overlapping window across a TranslatedNoteIndex as it slides
+// forward through the song.  Moving the window forward only touches the
+// notes that enter or leave it.  Moving it backward (after a song reset,
+// for instance) falls back to a fresh query.
+class TranslatedNoteWindow
+{
+public:
+   TranslatedNoteWindow() : m_index(0), m_next(0), m_begin(0), m_end(0) { }
+
+   void Advance(const TranslatedNoteIndex &index, microseconds_t begin_time, microseconds_t end_time);
+   void Reset() { m_index = 0; m_notes.clear(); }
+
+   // Every note overlapping the window, in list order
+   const std::vector<size_t> &Notes() const { return m_notes; }
+
+private:
+   const TranslatedNoteIndex *m_index;
+
+   std::vector<size_t> m_notes;
+
+   // The first note that hasn't entered the window yet
+   size_t m_next;
+
+   microseconds_t m_begin;
+   microseconds_t m_end;
+};
+
+#endif
@@ -6,7 +6,9 @@
 #include "os_graphics.h"
 
 #include <set>
+#include <map>
 #include <string>
+#include <vector>
 #include "string_util.h"
 #include "file_selector.h"
 #include "UserSettings.h"
@@ -17,12 +19,22 @@
 #include "PianoGameError.h"
 #include "libmidi/Midi.h"
 #include "libmidi/SynthVolume.h"
+#include "libmidi/MidiDeviceRegistry.h"
 
 #include "Tga.h"
 #include "Renderer.h"
+#include "TextWriter.h"
 #include "SharedState.h"
 #include "GameState.h"
 #include "State_Title.h"
+#include "PerformanceLog.h"
+#include "SongSimulation.h"
+#include "SoftwareRasterizer.h"
+#include "RenderRecording.h"
+#include "TgaDecodeJob.h"
+#include "GraphicsArchive.h"
+
+#include <fstream>
 
 using namespace std;
 
@@ -95,6 +107,182 @@ private:
 };
 static EdgeTracker window_state;
 
+// Plays a song start to finish with no window and writes the results to
+// a text report.  Arguments: <song.mid> <report.txt> [performance log]
+//
+// When rendering, every frame is also drawn in software and the last one
+// is saved.  Arguments: <song.mid> <report.txt> <frame.tga> [performance log]
+//
+// Errors are written to the report instead of shown in a message box,
+// so this can run unattended.
+static int RunSimulation(const vector<wstring> &arguments, bool render)
+{
+   // Roughly 60 FPS
+   const static unsigned long SimulatedFrameMilliseconds = 16;
+
+   // Fixed (rather than the display size) so frames from different
+   // machines can be compared
+   const static int RenderedWidth = 1024;
+   const static int RenderedHeight = 768;
+
+   const size_t log_argument = (render ? 3 : 2);
+
+   wstring result;
+   int exit_code = 0;
+
+   try
+   {
+      Midi midi = Midi::ReadFromFile(arguments[0]);
+
+      PerformanceReplay *replay = 0;
+      if (arguments.size() > log_argument) replay = new PerformanceReplay(arguments[log_argument]);
+
+      if (render)
+      {
+         SoftwareRasterizer rasterizer(RenderedWidth, RenderedHeight);
+         result = SimulateSong(&midi, SimulatedFrameMilliseconds, replay, &rasterizer).Describe();
+
+         if (!rasterizer.SaveTga(arguments[2])) throw PianoGameError(WSTRING(L"Couldn't write frame image '" << arguments[2] << L"'."));
+      }
+      else result = SimulateSong(&midi, SimulatedFrameMilliseconds, replay).Describe();
+   }
+   catch (const PianoGameError &e)
+   {
+      result = WSTRING(L"Simulation failed: " << e.GetErrorDescription() << L"\n");
+      exit_code = 1;
+   }
+   catch (const MidiError &e)
+   {
+      result = WSTRING(L"Simulation failed: " << e.GetErrorDescription() << L"\n");
+      exit_code = 1;
+   }
+
+#ifdef WIN32
+   wofstream report(reinterpret_cast<const wchar_t*>(arguments[1].c_str()));
+#else
+   std::string narrow(arguments[1].begin(), arguments[1].end());
+   wofstream report(narrow.c_str());
+#endif
+
+   report << result;
+   return exit_code;
+}
+
+// Draws the frames in a render recording (see GameStateManager's F8)
+// with the software rasterizer and writes how long each one took.
+// Arguments: <recording> <report.txt>
+static int RunBenchmark(const vector<wstring> &arguments)
+{
+   const static int Passes = 5;
+
+   // Only the cost of drawing is being measured, so any texture
+   // of a similar size will do in place of the real ones
+   const static int StandInTextureSize = 256;
+
+   wstring result;
+   int exit_code = 0;
+
+   try
+   {
+      RenderRecording recording = RenderRecording::Load(arguments[0]);
+
+      SoftwareRasterizer rasterizer(recording.GetScreenWidth(), recording.GetScreenHeight());
+      Renderer::UseSoftwareRasterizer(&rasterizer);
+
+      vector<unsigned char> stand_in(StandInTextureSize * StandInTextureSize * 4, 0xFF);
+      for (size_t i = 3; i < stand_in.size(); i += 4) stand_in[i] = 0xC0;
+
+      map<unsigned int, unsigned int> textures;
+      const set<unsigned int> ids = recording.TextureIds();
+      for (set<unsigned int>::const_iterator i = ids.begin(); i != ids.end(); ++i)
+      {
+         textures[*i] = rasterizer.CreateTexture(StandInTextureSize, StandInTextureSize, 4, &stand_in[0]);
+      }
+
+      Renderer renderer(0);
+      result = BenchmarkRecording(recording, renderer, textures, Passes);
+
+      Renderer::UseSoftwareRasterizer(0);
+   }
+   catch (const PianoGameError &e)
+   {
+      result = WSTRING(L"Benchmark failed: " << e.GetErrorDescription() << L"\n");
+      exit_code = 1;
+   }
+
+#ifdef WIN32
+   wofstream report(reinterpret_cast<const wchar_t*>(arguments[1].c_str()));
+#else
+   std::string narrow(arguments[1].begin(), arguments[1].end());
+   wofstream report(narrow.c_str());
+#endif
+
+   report << result;
+   return exit_code;
+}
+
+// Decodes every graphic the game uses a few times over and writes how
+// long it took.  Arguments: <report.txt>
+static int RunDecodeBenchmark(const vector<wstring> &arguments)
+{
+   const static int Passes = 10;
+
+   wstring result;
+   int exit_code = 0;
+
+   try
+   {
+      vector<wstring> names;
+      for (int i = 0; i < _TextureEnumCount; ++i) names.push_back(TextureResourceNames[i]);
+
+      result = BenchmarkTgaDecode(names, Passes);
+   }
+   catch (const PianoGameError &e)
+   {
+      result = WSTRING(L"Benchmark failed: " << e.GetErrorDescription() << L"\n");
+      exit_code = 1;
+   }
+
+#ifdef WIN32
+   wofstream report(reinterpret_cast<const wchar_t*>(arguments[0].c_str()));
+#else
+   std::string narrow(arguments[0].begin(), arguments[0].end());
+   wofstream report(narrow.c_str());
+#endif
+
+   report << result;
+   return exit_code;
+}
+
+// Writes the GraphicsArchive the game maps at startup.  This runs as a
+// build step.  Arguments: <graphics.pak> <report.txt>
+static int RunPackGraphics(const vector<wstring> &arguments)
+{
+   wstring result;
+   int exit_code = 0;
+
+   try
+   {
+      GraphicsArchive::Write(arguments[0]);
+      result = WSTRING(L"Packed " << _TextureEnumCount << L" graphics into " << _TexturePageEnumCount << L" pages in '" << arguments[0] << L"'.\n");
+   }
+   catch (const PianoGameError &e)
+   {
+      result = WSTRING(L"Packing failed: " << e.GetErrorDescription() << L"\n");
+      exit_code = 1;
+   }
+
+#ifdef WIN32
+   wofstream report(reinterpret_cast<const wchar_t*>(arguments[1].c_str()));
+#else
+   std::string narrow(arguments[1].begin(), arguments[1].end());
+   wofstream report(narrow.c_str());
+#endif
+
+   report << result;
+   return exit_code;
+}
+
 
 #ifdef WIN32
 // Windows
@@ -129,6 +317,11 @@ int main(int argc, char *argv[])
    try
    {
       wstring command_line;
+      vector<wstring> simulation_arguments;
+      bool render_simulation = false;
+      vector<wstring> benchmark_arguments;
+      vector<wstring> decode_benchmark_arguments;
+      vector<wstring> pack_arguments;
 
       UserSetting::Initialize(application_name);
 
@@ -156,6 +349,55 @@ int main(int argc, char *argv[])
             {
                command_line = arguments[1];
             }
+
+            // PianoGame --simulate <song.mid> <report.txt> [performance log]
+            if (argument_count >= 4 && wstring(arguments[1]) == L"--simulate")
+            {
+               for (int i = 2; i < argument_count; ++i) simulation_arguments.push_back(arguments[i]);
+            }
+
+            // PianoGame --render <song.mid> <report.txt> <frame.tga> [performance log]
+            if (argument_count >= 5 && wstring(arguments[1]) == L"--render")
+            {
+               for (int i = 2; i < argument_count; ++i) simulation_arguments.push_back(arguments[i]);
+               render_simulation = true;
+            }
+
+            // PianoGame --bench <recording> <report.txt>
+            if (argument_count >= 4 && wstring(arguments[1]) == L"--bench")
+            {
+               for (int i = 2; i < argument_count; ++i) benchmark_arguments.push_back(arguments[i]);
+            }
+
+            // PianoGame --decode-bench <report.txt>
+            if (argument_count >= 3 && wstring(arguments[1]) == L"--decode-bench")
+            {
+               for (int i = 2; i < argument_count; ++i) decode_benchmark_arguments.push_back(arguments[i]);
+            }
+
+            // PianoGame --pack-graphics <graphics.pak> <report.txt>
+            if (argument_count >= 4 && wstring(arguments[1]) == L"--pack-graphics")
+            {
+               for (int i = 2; i < argument_count; ++i) pack_arguments.push_back(arguments[i]);
+            }
+
+            // Anything else starting with "--" is one of the modes above
+            // with the wrong number of arguments (or no mode at all), not
+            // a file name
+            const bool any_mode = (simulation_arguments.size() > 0 || benchmark_arguments.size() > 0
+               || decode_benchmark_arguments.size() > 0 || pack_arguments.size() > 0);
+
+            if (!any_mode && command_line.substr(0, 2) == L"--")
+            {
+               throw PianoGameError(WSTRING(L"Unrecognized command line option '" << command_line << L"' (or the wrong number of arguments for it).\n\n"
+                  << L"Usage:\n"
+                  << L"   PianoGame [song.mid]\n"
+                  << L"   PianoGame --simulate <song.mid> <report.txt> [performance log]\n"
+                  << L"   PianoGame --render <song.mid> <report.txt> <frame.tga> [performance log]\n"
+                  << L"   PianoGame --bench <recording> <report.txt>\n"
+                  << L"   PianoGame --decode-bench <report.txt>\n"
+                  << L"   PianoGame --pack-graphics <graphics.pak> <report.txt>\n"));
+            }
          }
 
          FreeLibrary(shell32);
@@ -192,6 +434,14 @@ int main(int argc, char *argv[])
       
 #endif
 
+      if (simulation_arguments.size() > 0) return RunSimulation(simulation_arguments, render_simulation);
+      if (benchmark_arguments.size() > 0) return RunBenchmark(benchmark_arguments);
+      if (decode_benchmark_arguments.size() > 0) return RunDecodeBenchmark(decode_benchmark_arguments);
+      if (pack_arguments.size() > 0) return RunPackGraphics(pack_arguments);
+
+      // Get a head start on finding MIDI devices for the title screen
+      MidiDeviceRegistryScope device_registry;
+
       // Strip any leading or trailing quotes from the filename
       // argument (to match the format returned by the open-file
       // dialog later).
@@ -253,6 +503,9 @@ int main(int argc, char *argv[])
       // seek the "Open" dialog to the right folder.
       FileSelector::SetLastMidiFilename(command_line);
 
+      // Get a head start on loading the graphics while the window is created
+      state_manager.StartLoadingTextures();
+
       // This does what is necessary in construction and
       // resets what it does during its destruction.  We
       // never actually have to reference it.
@@ -340,6 +593,19 @@ int main(int argc, char *argv[])
       glLoadIdentity();
       gluOrtho2D(0, WindowWidth, 0, WindowHeight);
 
+      // Build the glyph textures for every font size the states use now,
+      // instead of the first time each screen comes up.  (The combo text
+      // grows a size every ten notes; the first few of those are here too.)
+      {
+#ifdef WIN32
+         Renderer prewarm_renderer(dc_win);
+#else
+         Renderer prewarm_renderer(aglContext);
+#endif
+         const static int PrewarmSizes[] = { 12, 14, 20, 21, 22, 23, 24, 25, 26, 28, 100 };
+         for (size_t i = 0; i < sizeof(PrewarmSizes) / sizeof(int); ++i) TextWriter::Prewarm(prewarm_renderer, PrewarmSizes[i]);
+      }
+
       SharedState state;
       state.song_title = FileSelector::TrimFilename(command_line);
       state.midi = midi;
@@ -367,7 +633,10 @@ int main(int argc, char *argv[])
          {
             if (window_state.IsActive())
             {
-               state_manager.Update(window_state.JustActivated());
+               const bool just_activated = window_state.JustActivated();
+               if (just_activated) state_manager.Resume();
+
+               state_manager.Update(just_activated);
 
                Renderer renderer(dc_win);
                renderer.SetVSyncInterval(1);
@@ -441,10 +710,22 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
          return 0;
       }
 
+   case WM_DEVICECHANGE:
+      {
+         // Something was plugged in or removed.  It may or may not have
+         // been a MIDI device, but a rescan is cheap in the background.
+         MidiDeviceRegistry::RequestRefresh();
+         return TRUE;
+      }
+
    case WM_ACTIVATE:
       {
          if (LOWORD(wParam) != WA_INACTIVE) window_state.Activate();
-         else window_state.Deactivate();
+         else
+         {
+            window_state.Deactivate();
+            state_manager.Suspend();
+         }
          
          return 0;
       }
@@ -474,6 +755,9 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
          case VK_ESCAPE:   state_manager.KeyPress(KeyEscape);  break;
 
          case VK_F6:       state_manager.KeyPress(KeyF6);      break;
+         case VK_F7:       state_manager.KeyPress(KeyF7);      break;
+         case VK_F8:       state_manager.KeyPress(KeyF8);      break;
+         case VK_F9:       state_manager.KeyPress(KeyF9);      break;
 
          case VK_OEM_PLUS: state_manager.KeyPress(KeyPlus);    break;
          case VK_OEM_MINUS:state_manager.KeyPress(KeyMinus);   break;
@@ -579,7 +863,10 @@ static pascal void GameLoop(EventLoopTimerRef inTimer, void *)
 
    try
    {
-      state_manager.Update(window_state.JustActivated());
+      const bool just_activated = window_state.JustActivated();
+      if (just_activated) state_manager.Resume();
+
+      state_manager.Update(just_activated);
 
       Renderer renderer(aglContext);
       renderer.SetVSyncInterval(1);
@@ -683,6 +970,7 @@ static pascal OSStatus AppEventHandlerProc(EventHandlerCallRef callRef, EventRef
       case kEventAppHidden:
       case kEventAppDeactivated:
          window_state.Deactivate();
+         state_manager.Suspend();
          break;
          
       case kEventAppQuit:
@@ -802,6 +1090,9 @@ static pascal OSStatus KeyEventHandlerProc(EventHandlerCallRef callRef, EventRef
       case 53:  state_manager.KeyPress(KeyEscape); break;
 
       case 97:  state_manager.KeyPress(KeyF6);     break;
+      case 98:  state_manager.KeyPress(KeyF7);     break;
+      case 100: state_manager.KeyPress(KeyF8);     break;
+      case 101: state_manager.KeyPress(KeyF9);     break;
 
       case 24:  state_manager.KeyPress(KeyPlus);   break;
       case 27:  state_manager.KeyPress(KeyMinus);  break;